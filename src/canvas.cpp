@@ -1,13 +1,178 @@
 /* This file is a part of photoquick program, which is GPLv3 licensed */
 
 #include "canvas.h"
+#include "common.h"
 #include <QDebug>
 #include <QSizePolicy>
 #include <QTransform>
 #include <QPainter>
 #include <cmath>
+#include <cstring>
 
 
+enum {
+    SAMPLE_NEAREST,
+    SAMPLE_BILINEAR,
+    SAMPLE_BOX
+};
+
+// source pixels used by a scaled pixel along one axis
+typedef struct {
+    int first;
+    int last;
+    int weight;// weight of last pixel out of 256, for bilinear sampling
+} Span;
+
+// spans of n scaled pixels starting at pos, when src_n pixels are scaled to dst_n
+static void calc_spans(Span *spans, int pos, int n, int src_n, int dst_n, int mode)
+{
+    double factor = src_n/(double)dst_n;
+    for (int i=0; i<n; i++) {
+        int x = pos + i;
+        Span &span = spans[i];
+        span.weight = 0;
+        if (mode==SAMPLE_BILINEAR) {
+            double src_x = clamp((x+0.5)*factor - 0.5, 0.0, src_n-1.0);
+            span.first = src_x;
+            span.last = MIN(span.first+1, src_n-1);
+            span.weight = (src_x - span.first)*256 + 0.5;
+            continue;
+        }
+        span.first = MIN(int(x*factor), src_n-1);
+        span.last = span.first;
+        if (mode==SAMPLE_BOX)
+            span.last = MAX(span.first, MIN(int((x+1)*factor), src_n) - 1);
+    }
+}
+
+// renders rect of img scaled to size, with mask overlay. integer scales use
+// nearest pixel, other upscales bilinear, and downscales average of source pixels
+static QImage render_scaled(const QImage &img, const QImage &mask, QSize size, QRect rect)
+{
+    int w = rect.width(), h = rect.height();
+    int mode = SAMPLE_BOX;
+    if (size.width() >= img.width()) {
+        bool integer_scale = size.width() % img.width() == 0 and
+                    size.height() % img.height() == 0 and
+                    size.width()/img.width() == size.height()/img.height();
+        mode = integer_scale ? SAMPLE_NEAREST : SAMPLE_BILINEAR;
+    }
+    Span *xspans = (Span*) malloc((w+h)*sizeof(Span));
+    Span *yspans = xspans + w;
+    calc_spans(xspans, rect.x(), w, img.width(), size.width(), mode);
+    calc_spans(yspans, rect.y(), h, img.height(), size.height(), mode);
+    int ox = xspans[0].first, oy = yspans[0].first;
+    QRect src_rect(ox, oy, xspans[w-1].last - ox + 1, yspans[h-1].last - oy + 1);
+    QImage piece = displayPiece(img, mask, src_rect);
+    QImage out(w, h, piece.format());
+    ImageView src = constView(piece);
+    ImageView dst(out);
+    int pw = src_rect.width();
+
+    #pragma omp parallel
+    {
+        uint *sum = (uint*) malloc(4*pw*sizeof(uint));// box sums of columns
+        #pragma omp for
+        for (int y=0; y<h; y++) {
+            Span &ys = yspans[y];
+            QRgb *dst_row = dst.row<QRgb>(y);
+            if (mode==SAMPLE_NEAREST) {
+                QRgb *row = src.row<QRgb>(ys.first-oy);
+                for (int x=0; x<w; x++)
+                    dst_row[x] = row[xspans[x].first-ox];
+            }
+            else if (mode==SAMPLE_BILINEAR) {
+                QRgb *row1 = src.row<QRgb>(ys.first-oy);
+                QRgb *row2 = src.row<QRgb>(ys.last-oy);
+                int wy = ys.weight;
+                for (int x=0; x<w; x++) {
+                    Span &xs = xspans[x];
+                    int wx = xs.weight;
+                    QRgb p1 = row1[xs.first-ox], p2 = row1[xs.last-ox];
+                    QRgb p3 = row2[xs.first-ox], p4 = row2[xs.last-ox];
+                    QRgb clr = 0;
+                    for (int shift=0; shift<32; shift+=8) {
+                        int top = ((p1>>shift)&0xff)*(256-wx) + ((p2>>shift)&0xff)*wx;
+                        int btm = ((p3>>shift)&0xff)*(256-wx) + ((p4>>shift)&0xff)*wx;
+                        uint val = (top*(256-wy) + btm*wy + 32768) >> 16;
+                        clr |= val << shift;
+                    }
+                    dst_row[x] = clr;
+                }
+            }
+            else {
+                memset(sum, 0, 4*pw*sizeof(uint));
+                for (int sy=ys.first; sy<=ys.last; sy++) {
+                    QRgb *row = src.row<QRgb>(sy-oy);
+                    for (int x=0; x<pw; x++) {
+                        QRgb clr = row[x];
+                        sum[4*x]   += clr & 0xff;
+                        sum[4*x+1] += (clr>>8) & 0xff;
+                        sum[4*x+2] += (clr>>16) & 0xff;
+                        sum[4*x+3] += clr>>24;
+                    }
+                }
+                int rows = ys.last - ys.first + 1;
+                for (int x=0; x<w; x++) {
+                    Span &xs = xspans[x];
+                    uint b=0, g=0, r=0, a=0;
+                    for (int sx=xs.first-ox; sx<=xs.last-ox; sx++) {
+                        b += sum[4*sx];
+                        g += sum[4*sx+1];
+                        r += sum[4*sx+2];
+                        a += sum[4*sx+3];
+                    }
+                    uint count = rows*(xs.last - xs.first + 1);
+                    uint half = count/2;
+                    dst_row[x] = (b+half)/count | ((g+half)/count)<<8 |
+                                ((r+half)/count)<<16 | ((a+half)/count)<<24;
+                }
+            }
+        }
+        free(sum);
+    }
+    free(xspans);
+    return out;
+}
+
+
+// bounding rectangle of masked pixels of MonoLSB mask, null if none is masked
+static QRect mask_bounding_rect(const QImage &mask)
+{
+    int w = mask.width(), h = mask.height();
+    int x1 = w, y1 = h, x2 = -1, y2 = -1;
+    ImageView view = constView(mask);
+    // bits after last pixel are ignored
+    uchar last_mask = (w%8) ? (1 << (w%8)) - 1 : 0xff;
+    int bytes = (w+7)/8;
+    #pragma omp parallel for reduction(min:x1,y1) reduction(max:x2,y2)
+    for (int y=0; y<h; y++) {
+        const uchar *row = view.row<uchar>(y);
+        int first = 0, last = bytes-1;
+        while (first<last and row[first]==0)
+            first++;
+        while (last>=first and (last==bytes-1 ? row[last] & last_mask : row[last])==0)
+            last--;
+        if (last<first)
+            continue;
+        uchar byte = first==bytes-1 ? row[first] & last_mask : row[first];
+        int bit = 0;
+        while (not ((byte >> bit) & 1))
+            bit++;
+        x1 = MIN(x1, 8*first + bit);
+        byte = last==bytes-1 ? row[last] & last_mask : row[last];
+        bit = 7;
+        while (not ((byte >> bit) & 1))
+            bit--;
+        x2 = MAX(x2, 8*last + bit);
+        y1 = MIN(y1, y);
+        y2 = MAX(y2, y);
+    }
+    if (x2<0)
+        return QRect();
+    return QRect(x1, y1, x2-x1+1, y2-y1+1);
+}
+
 Canvas:: Canvas(QScrollArea *scrollArea, ImageData *img_dat) : QLabel(scrollArea)
 {
     vScrollbar = scrollArea->verticalScrollBar();
@@ -18,6 +183,10 @@ Canvas:: Canvas(QScrollArea *scrollArea, ImageData *img_dat) : QLabel(scrollArea
     mouse_pressed = false;
     drag_to_scroll = true;
     scale = 1.0;
+    tiles_x = 1;
+    tiles_key = 0;
+    restored_key = 0;
+    drawn_unsaved = false;
 }
 
 void
@@ -29,6 +198,12 @@ Canvas:: setAnimation(QMovie *anim)
     else
         data->image = QImage();
     this->animation = true;
+    tiles.clear();
+    tiles_size = QSize();
+    pyramid.clear();
+    // size is set by the movie
+    setMinimumSize(0, 0);
+    setMaximumSize(QWIDGETSIZE_MAX, QWIDGETSIZE_MAX);
     setMovie(anim);
     anim->start();
 }
@@ -40,8 +215,7 @@ Canvas:: setNewImage(QImage img)
         this->animation = false;
         movie()->deleteLater();
     }
-    undo_stack.clear();
-    undo_index = -1;
+    history.clear();
     data->image = img;
     updateImage();
 }
@@ -49,28 +223,42 @@ Canvas:: setNewImage(QImage img)
 void
 Canvas:: updateImage()
 {
-    showScaled();// this must be before addToUndoStack because it applies mask over image
+    restoreMaskedArea();// this must be before addToUndoStack
     addToUndoStack();
+    // tiles drawn from an image not in history may differ anywhere
+    QRect changed = drawn_unsaved ? data->image.rect() : history.changedRect();
+    drawn_unsaved = false;
+    redraw(changed);
 }
 
 
 void
 Canvas:: setMask(QImage mask_img)
 {
+    toRgbFormat(data->image);
     tmp_image = data->image;
+    restored_key = data->image.cacheKey();
     // using 1 bit per pixel image as mask, reduces memory usage significantly
     mask = QImage(mask_img.width(), mask_img.height(), QImage::Format_MonoLSB);
-
+    ImageView src = constView(mask_img);
+    ImageView dst(mask);
+    int w = mask_img.width();
+    #pragma omp parallel for
     for (int y=0; y<mask_img.height(); y++)
     {
-        uchar *row = mask.scanLine(y);
-        QRgb* imgRow = (QRgb*) mask_img.constScanLine(y);
-        for (int x=0; x<mask_img.width(); x++) {
-            int val = qRed(imgRow[x]) > 127 ? 1 : 0;
-            int bitmask = 1 << (x%8);
-            row[x/8] = (row[x/8] & ~bitmask) | (val << (x%8));
+        QRgb *imgRow = src.row<QRgb>(y);
+        uchar *row = dst.row<uchar>(y);
+        // each byte is written at once from 8 pixels
+        for (int x=0; x<w; x+=8) {
+            int n = MIN(8, w-x);
+            uchar byte = 0;
+            for (int i=0; i<n; i++)
+                byte |= (qRed(imgRow[x+i]) > 127) << i;
+            row[x/8] = byte;
         }
     }
+    mask_rect = mask_bounding_rect(mask);
+    tiles.clear();// mask overlay changed
     showScaled();
 }
 
@@ -79,6 +267,7 @@ Canvas:: clearMask()
 {
     mask = QImage();
     tmp_image = QImage();
+    tiles.clear();// mask overlay changed
     showScaled();
 }
 
@@ -86,47 +275,181 @@ void
 Canvas:: invertMask()
 {
     mask.invertPixels();
+    mask_rect = mask_bounding_rect(mask);
     tmp_image = data->image;// prevents restoring of previously masked areas
+    restored_key = data->image.cacheKey();
+    tiles.clear();// mask overlay changed
     showScaled();
 }
 
+// restore masked areas in data->image from tmp_image. a filter
+// (e.g grayscale) may have changed the format of the image.
+// mask is read 64 pixels at a time, skipping runs which are all unmasked
 void
-Canvas:: showScaled()
+Canvas:: restoreMaskedArea()
 {
-    QPixmap pm;
-    if (not mask.isNull()) {
-        // restore masked areas in data->image from tmp_image
-        QImage pmImg = data->image.copy();
-
-        for (int y=0, h=mask.height(); y<h; y++)
-        {
-            QRgb *row = (QRgb*)data->image.scanLine(y);
-            QRgb *tmpRow = (QRgb*)tmp_image.constScanLine(y);
-            QRgb *pmRow = (QRgb*) pmImg.scanLine(y);
-            const uchar *maskRow = mask.constScanLine(y);
-            for (int x=0, w=mask.width(); x<w; x++) {
-                uchar masked = (maskRow[x/8] >> (x%8) ) & 0x01;
-                if (masked == 1){
-                    row[x] = tmpRow[x];
-                    // add a green tone over masked region
-                    pmRow[x] = qRgb(0.5*qRed(row[x]), 127+0.5*qGreen(row[x]), 0.5*qBlue(row[x]));
-                }
+    if (mask.isNull() or mask_rect.isEmpty() or data->image.cacheKey()==restored_key)
+        return;
+    toRgbFormat(data->image);
+    ImageView dst(data->image);
+    ImageView src = constView(tmp_image);
+    ImageView maskView = constView(mask);
+    int x1 = mask_rect.left() & ~63;
+    int x2 = mask_rect.right() + 1;
+    #pragma omp parallel for
+    for (int y=mask_rect.top(); y<=mask_rect.bottom(); y++)
+    {
+        QRgb *row = dst.row<QRgb>(y);
+        QRgb *tmpRow = src.row<QRgb>(y);
+        const uchar *maskRow = maskView.row<uchar>(y);
+        for (int x=x1; x<x2; x+=64) {
+            int n = MIN(64, x2-x);
+            const uchar *bits = maskRow + x/8;
+            quint64 word = 0;
+            memcpy(&word, bits, (n+7)/8);
+            if (word == 0)
+                continue;
+            if (n == 64 and word == ~0ULL) {
+                memcpy(row+x, tmpRow+x, 64*sizeof(QRgb));
+                continue;
+            }
+            for (int i=0; i<n; i++) {
+                if ((bits[i>>3] >> (i&7)) & 1)
+                    row[x+i] = tmpRow[x+i];
             }
         }
-        pm = QPixmap::fromImage(pmImg);
     }
-    else {
-        pm = QPixmap::fromImage(data->image);
+    restored_key = data->image.cacheKey();
+}
+
+void
+Canvas:: showScaled()
+{
+    restoreMaskedArea();
+    if (data->image.cacheKey() != tiles_key) {
+        // image was changed anywhere without updateImage(), pyramid also
+        // finds it by cacheKey(). a zoom only changes size of tiles
+        tiles.clear();
+        drawn_unsaved = true;
+    }
+    redraw(QRect());
+}
+
+void
+Canvas:: redraw(QRect rect)
+{
+    QSize size = scaledSize();
+    if (size != tiles_size) {
+        tiles.clear();
+        tiles_size = size;
+        tiles_x = (size.width() + CANVAS_TILE_SIZE - 1)/CANVAS_TILE_SIZE;
     }
-    if (scale != 1.0) {
-        Qt::TransformationMode mode = floorf(scale) == ceilf(scale)? // integer scale
-                                    Qt::FastTransformation : Qt::SmoothTransformation;
-        pm = pm.scaledToHeight(scale*pm.height(), mode);
+    else if (not rect.isEmpty()) {
+        // a scaled pixel depends on source pixels upto one pixel away, and
+        // pixels of pyramid level n cover 2^n image pixels
+        int pad = 2 << ImagePyramid::levelFor(data->image.size(), size);
+        float sx = size.width()/(float)data->image.width();
+        float sy = size.height()/(float)data->image.height();
+        int x1 = MAX(0, int((rect.left()-pad)*sx) - 1);
+        int y1 = MAX(0, int((rect.top()-pad)*sy) - 1);
+        int x2 = MIN(size.width()-1, int(ceilf((rect.right()+1+pad)*sx)) + 1);
+        int y2 = MIN(size.height()-1, int(ceilf((rect.bottom()+1+pad)*sy)) + 1);
+        for (int ty=y1/CANVAS_TILE_SIZE; ty<=y2/CANVAS_TILE_SIZE; ty++) {
+            for (int tx=x1/CANVAS_TILE_SIZE; tx<=x2/CANVAS_TILE_SIZE; tx++)
+                tiles.remove(ty*tiles_x + tx);
+        }
     }
-    setPixmap(pm);
+    if (not rect.isEmpty())
+        pyramid.invalidate(data->image, rect);
+    tiles_key = data->image.cacheKey();
+    if (pixmap() or movie())// remove pixmap set by tools or preview dialogs
+        QLabel::clear();
+    setFixedSize(size);
+    update();
     emit imageUpdated();
 }
 
+QSize
+Canvas:: scaledSize()
+{
+    int w = data->image.width();
+    int h = data->image.height();
+    if (scale == 1.0 or h == 0)
+        return QSize(w, h);
+    int scaled_h = MAX(1, int(scale*h));
+    return QSize(MAX(1, int(w*scaled_h/(float)h + 0.5)), scaled_h);
+}
+
+QPixmap
+Canvas:: tile(int tx, int ty)
+{
+    if (data->image.cacheKey() != tiles_key) {
+        // image was changed without redraw()
+        tiles.clear();
+        tiles_key = data->image.cacheKey();
+        drawn_unsaved = true;
+    }
+    int key = ty*tiles_x + tx;
+    auto it = tiles.constFind(key);
+    if (it != tiles.constEnd())
+        return it.value();
+    QRect rect(tx*CANVAS_TILE_SIZE, ty*CANVAS_TILE_SIZE, CANVAS_TILE_SIZE, CANVAS_TILE_SIZE);
+    rect = rect.intersected(QRect(QPoint(0,0), tiles_size));
+    QPixmap pm = QPixmap::fromImage(renderScaled(tiles_size, rect));
+    tiles.insert(key, pm);
+    return pm;
+}
+
+void
+Canvas:: paintEvent(QPaintEvent *ev)
+{
+    if (animation or pixmap() or data->image.isNull()) {
+        QLabel::paintEvent(ev);
+        return;
+    }
+    QRect visible = visibleRegion().boundingRect();
+    QRect rect = ev->rect().intersected(visible);
+    QPainter painter(this);
+    if (not rect.isEmpty()) {
+        for (int ty=rect.top()/CANVAS_TILE_SIZE; ty<=rect.bottom()/CANVAS_TILE_SIZE; ty++) {
+            for (int tx=rect.left()/CANVAS_TILE_SIZE; tx<=rect.right()/CANVAS_TILE_SIZE; tx++)
+                painter.drawPixmap(tx*CANVAS_TILE_SIZE, ty*CANVAS_TILE_SIZE, tile(tx, ty));
+        }
+    }
+    painter.end();
+    // free tiles far from visible area
+    QRect keep = visible.adjusted(-CANVAS_TILE_MARGIN, -CANVAS_TILE_MARGIN,
+                                    CANVAS_TILE_MARGIN, CANVAS_TILE_MARGIN);
+    for (auto it = tiles.begin(); it != tiles.end(); ) {
+        int tx = it.key() % tiles_x, ty = it.key() / tiles_x;
+        QRect tile_rect(tx*CANVAS_TILE_SIZE, ty*CANVAS_TILE_SIZE, CANVAS_TILE_SIZE, CANVAS_TILE_SIZE);
+        if (tile_rect.intersects(keep))
+            ++it;
+        else
+            it = tiles.erase(it);
+    }
+}
+
+// renders rect of image scaled to size. zoomed out views are rendered from the
+// smallest pyramid level which is not smaller than size
+QImage
+Canvas:: renderScaled(QSize size, QRect rect)
+{
+    int n = ImagePyramid::levelFor(data->image.size(), size);
+    if (n==0)
+        return render_scaled(data->image, mask, size, rect);
+    return render_scaled(pyramid.level(data->image, mask, n), QImage(), size, rect);
+}
+
+QImage
+Canvas:: scaledImage()
+{
+    QSize size = scaledSize();
+    QImage img = renderScaled(size, QRect(QPoint(0,0), size));
+    return img.convertToFormat(data->image.hasAlphaChannel() ?
+                                QImage::Format_ARGB32 : QImage::Format_RGB32);
+}
+
 void
 Canvas:: rotate(int degree, Qt::Axis axis)
 {
@@ -166,31 +489,38 @@ Canvas:: mouseMoveEvent(QMouseEvent *ev)
 void
 Canvas:: addToUndoStack()
 {
-    if (undo_index < (int)undo_stack.size()-1)
-        undo_stack.resize(undo_index+1);
-    undo_stack.push_back(data->image);
-    undo_index++;
+    history.add(data->image);
+}
+
+// shows image restored by undo or redo
+void
+Canvas:: showRestored()
+{
+    QRect changed = history.changedRect();
+    // masked area is kept unchanged
+    qint64 key = data->image.cacheKey();
+    restoreMaskedArea();
+    drawn_unsaved = data->image.cacheKey() != key;
+    if (drawn_unsaved)
+        changed |= mask_rect;
+    redraw(changed);
 }
 
 void
 Canvas:: undo()
 {
-    if (undo_index<1)
+    if (not history.undo(data->image))
         return;
-    undo_index--;
-    data->image = undo_stack[undo_index];
-    showScaled();
+    showRestored();
 }
 
 
 void
 Canvas:: redo()
 {
-    if (undo_index>(int)undo_stack.size()-2)
+    if (not history.redo(data->image))
         return;
-    undo_index++;
-    data->image = undo_stack[undo_index];
-    showScaled();
+    showRestored();
 }
 
 
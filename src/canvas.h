@@ -1,13 +1,28 @@
 #pragma once
-/* Image Label Object to display the image. */
+/* Image Label Object to display the image.
+  The scaled image is drawn in tiles of CANVAS_TILE_SIZE pixels, which are
+  rendered only when they become visible, and kept while they are near the
+  visible area. Zoomed out tiles are rendered from a mipmap pyramid of the
+  image. An edit invalidates only the tiles and pyramid area it changed.
+  While a tool or preview dialog sets a pixmap on the label, that pixmap is
+  shown instead.
+*/
 #include "plugin.h"
+#include "history.h"
+#include "pyramid.h"
 #include <QLabel>
+#include <QHash>
+#include <QPixmap>
+#include <QPaintEvent>
 #include <QMovie>
 #include <QMouseEvent>
 #include <QScrollArea>
 #include <QScrollBar>
 #include <QCursor>
 
+#define CANVAS_TILE_SIZE 256
+// tiles farther than this from the visible area are freed
+#define CANVAS_TILE_MARGIN 256
 
 //This is the widget responsible for displaying image
 class Canvas : public QLabel
@@ -20,17 +35,27 @@ public:
     void setMask(QImage mask);
     void clearMask();
     void rotate(int degree, Qt::Axis axis=Qt::ZAxis);
+    QSize scaledSize();
+    // image with mask overlay, scaled to current scale
+    QImage scaledImage();
     // Variables
     ImageData *data;
     QImage mask;// 1 bpp binary mask image of format MonoLSB, 0=unmasked, 1=masked
     QImage tmp_image;// to restore masked area in data->image after applying filters
+    QRect mask_rect;// bounding rect of masked pixels
     bool animation = false;
     float scale;
     bool drag_to_scroll;    // if click and drag moves image
-    std::vector<QImage> undo_stack;
-    int undo_index = -1;
+    UndoHistory history;
 private:
     void addToUndoStack();
+    void restoreMaskedArea();
+    // shows image at current scale, redrawing only given area of image
+    void redraw(QRect rect);
+    void showRestored();
+    QPixmap tile(int tx, int ty);
+    QImage renderScaled(QSize size, QRect rect);
+    void paintEvent(QPaintEvent *ev);
     void mousePressEvent(QMouseEvent *ev);
     void mouseReleaseEvent(QMouseEvent *ev);
     void mouseMoveEvent(QMouseEvent *ev);
@@ -39,8 +64,16 @@ private:
     int v_scrollbar_pos, h_scrollbar_pos;
     QPoint clk_global;
     QScrollBar *vScrollbar, *hScrollbar;
+    QHash<int, QPixmap> tiles;// rendered tiles, key is ty*tiles_x + tx
+    int tiles_x;
+    QSize tiles_size;// scaled image size for which tiles were rendered
+    qint64 tiles_key;// cacheKey() of image from which tiles were rendered
+    ImagePyramid pyramid;
+    // tiles may have been drawn from an image which is not in history
+    bool drawn_unsaved;
+    qint64 restored_key;// cacheKey() of image after masked area was restored
 public slots:
-    void updateImage();// shows scaled and adds current image to undo_stack
+    void updateImage();// shows scaled and adds current image to undo history
     void showScaled();
     void invertMask();
     void undo();
@@ -0,0 +1,182 @@
+// this file is part of photoquick program which is GPLv3 licensed
+#include "colorspace.h"
+#include "common.h"
+#include <cmath>
+#include <cstring>
+
+// allows selecting between two float values without branch (if conversion),
+// otherwise the row loops can not be vectorized. used only on those loops and
+// the functions inlined in them
+#if defined(__GNUC__) && !defined(__clang__)
+  #define NO_TRAPPING_MATH __attribute__((optimize("no-trapping-math")))
+#else
+  #define NO_TRAPPING_MATH
+#endif
+
+// D65 standard referent
+#define LAB_Xn 0.950470f
+#define LAB_Yn 1
+#define LAB_Zn 1.088830f
+
+#define LAB_t0 0.137931f  // 16 / 116
+#define LAB_t1 0.206897f  // 24 / 116
+#define LAB_t2 0.128419f  // 3 * t1 * t1
+#define LAB_t3 0.008856f  // t1^3
+
+#define PI_2 1.570796f
+
+// linear to srgb table size. Steepest slope of srgb curve is 12.92*255,
+// so this gives less than 0.2 unit error in result
+#define LINEAR_TABLE_BITS 14
+#define LINEAR_TABLE_SIZE (1<<LINEAR_TABLE_BITS)
+
+typedef struct SrgbTables {
+    float to_linear[256];// srgb byte to linear value
+    unsigned char to_srgb[LINEAR_TABLE_SIZE+1];// linear value to srgb byte
+    SrgbTables() {
+        for (int i=0; i<256; i++) {
+            float v = i/255.0f;
+            to_linear[i] = (v > 0.04045f) ? powf((v + 0.055f) / 1.055f, 2.4f) : v / 12.92f;
+        }
+        for (int i=0; i<LINEAR_TABLE_SIZE; i++) {
+            float v = (i+0.5f)/LINEAR_TABLE_SIZE;
+            v = (v > 0.003131f) ? 1.055f * powf(v, 1.0f/2.4f) - 0.055f : 12.92f * v;
+            int val = 255*v;
+            to_srgb[i] = val>255 ? 255 : val;
+        }
+        to_srgb[LINEAR_TABLE_SIZE] = 255;// for values >= 1.0
+    }
+} SrgbTables;
+
+// tables are created on first use (thread safe in C++11)
+static const SrgbTables& srgbTables()
+{
+    static SrgbTables tables;
+    return tables;
+}
+
+// cube root for t > 0. Initial guess by dividing exponent by 3, then two
+// Newton iterations give about 1e-6 relative error
+static inline NO_TRAPPING_MATH float fast_cbrt(float t)
+{
+    int i;
+    memcpy(&i, &t, 4);
+    i = i/3 + 0x2a5137a0;
+    float y;
+    memcpy(&y, &i, 4);
+    y = (2*y + t/(y*y)) * (1.0f/3);
+    y = (2*y + t/(y*y)) * (1.0f/3);
+    return y;
+}
+
+static inline NO_TRAPPING_MATH float xyz_lab(float t)
+{
+    float c = fast_cbrt(t > LAB_t3 ? t : LAB_t3);
+    float lin = t / LAB_t2 + LAB_t0;
+    return t > LAB_t3 ? c : lin;
+}
+
+static inline NO_TRAPPING_MATH float lab_xyz(float t)
+{
+    float cube = t*t*t;
+    float lin = LAB_t2 * (t - LAB_t0);
+    return t > LAB_t1 ? cube : lin;
+}
+
+// atan2 in degrees (-180 -> 180). max error is about 1e-5 radian
+static inline NO_TRAPPING_MATH float fast_atan2_deg(float y, float x)
+{
+    float ax = fabsf(x), ay = fabsf(y);
+    float mx = ax > ay ? ax : ay;
+    float mn = ax > ay ? ay : ax;
+    float a = mn / (mx > 0 ? mx : 1);
+    float s = a*a;
+    float r = a*(0.9998660f + s*(-0.3302995f + s*(0.1801410f + s*(-0.0851330f + s*0.0208351f))));
+    // all values are calculated before selecting, so that there is no branch
+    float r1 = PI_2 - r;
+    r = ay > ax ? r1 : r;
+    float r2 = 2*PI_2 - r;
+    r = x < 0 ? r2 : r;
+    float r3 = -r;
+    r = y < 0 ? r3 : r;
+    return r * 57.295780f;
+}
+
+// sin and cos of angle in degrees (must be > -360). Angle is reduced to
+// -45 -> 45 degree, where Taylor series gives about 3e-7 error
+static inline NO_TRAPPING_MATH void fast_sincos_deg(float deg, float &sin_val, float &cos_val)
+{
+    int q = (int)(deg/90 + 4.5f) - 4;// round() without function call
+    float x = (deg - 90*q) * 0.017453293f;
+    int quadrant = q & 3;
+    float x2 = x*x;
+    float s = x*(1 - x2*(1.0f/6 - x2*(1.0f/120 - x2*(1.0f/5040))));
+    float c = 1 - x2*(0.5f - x2*(1.0f/24 - x2*(1.0f/720 - x2*(1.0f/40320))));
+    // sin(x+90) = cos(x), cos(x+90) = -sin(x)
+    float sn = (quadrant & 1) ? c : s;
+    float cs = (quadrant & 1) ? s : c;
+    // sign is +1 or -1, multiplied instead of branching
+    sin_val = sn * (1 - (quadrant & 2));
+    cos_val = cs * (1 - ((quadrant+1) & 2));
+}
+
+NO_TRAPPING_MATH void rgbToLchRow(const QRgb *src, float *L, float *C, float *H, int n)
+{
+    const float *to_linear = srgbTables().to_linear;
+    #pragma omp simd
+    for (int i=0; i<n; i++) {
+        float r = to_linear[qRed(src[i])];
+        float g = to_linear[qGreen(src[i])];
+        float b = to_linear[qBlue(src[i])];
+        float x = xyz_lab((0.412456f * r + 0.357576f * g + 0.180437f * b) / LAB_Xn);
+        float y = xyz_lab((0.212673f * r + 0.715152f * g + 0.072175f * b) / LAB_Yn);
+        float z = xyz_lab((0.019334f * r + 0.119192f * g + 0.950304f * b) / LAB_Zn);
+        float l = 116 * y - 16;
+        float a = 500 * (x - y);
+        b = 200 * (y - z);
+        L[i] = l < 0 ? 0 : l;
+        C[i] = a*a + b*b;
+        float h = fast_atan2_deg(b, a);
+        float h1 = h + 360;
+        H[i] = h < 0 ? h1 : h;
+    }
+    // sqrtf() sets errno, so it is done in separate loop which is not vectorized
+    for (int i=0; i<n; i++)
+        C[i] = sqrtf(C[i]);
+}
+
+// index of linear value in linear to srgb table
+static inline NO_TRAPPING_MATH int srgb_index(float v)
+{
+    v *= LINEAR_TABLE_SIZE;
+    v = v < 0 ? 0 : v;
+    v = v > LINEAR_TABLE_SIZE ? LINEAR_TABLE_SIZE : v;
+    return v;
+}
+
+NO_TRAPPING_MATH void lchToRgbRow(const float *L, const float *C, const float *H, QRgb *dst, int n)
+{
+    const unsigned char *to_srgb = srgbTables().to_srgb;
+    // table lookup of bytes can not be vectorized, so table indices are
+    // calculated for a block of pixels first, then looked up
+    int idx[3][64];
+    for (int i0=0; i0<n; i0+=64) {
+        int len = MIN(64, n-i0);
+        #pragma omp simd
+        for (int i=0; i<len; i++) {
+            float sin_h, cos_h;
+            fast_sincos_deg(H[i0+i], sin_h, cos_h);
+            float a = cos_h*C[i0+i];
+            float b = sin_h*C[i0+i];
+            float y = (L[i0+i] + 16) / 116;
+            float x = LAB_Xn * lab_xyz(y + a/500);
+            float z = LAB_Zn * lab_xyz(y - b/200);
+            y = LAB_Yn * lab_xyz(y);
+            idx[0][i] = srgb_index( 3.240454f*x - 1.537139f*y - 0.498531f*z);
+            idx[1][i] = srgb_index(-0.969266f*x + 1.876011f*y + 0.041556f*z);
+            idx[2][i] = srgb_index( 0.055643f*x - 0.204026f*y + 1.057225f*z);
+        }
+        for (int i=0; i<len; i++)
+            dst[i0+i] = qRgb(to_srgb[idx[0][i]], to_srgb[idx[1][i]], to_srgb[idx[2][i]]);
+    }
+}
@@ -0,0 +1,13 @@
+#pragma once
+/* Fast batched conversion between sRGB and CIE LCh(ab) colorspace.
+  A row of pixels is converted at once to/from separate float arrays of L, C
+  and H, so that the loops can be vectorized by compiler. Transcendental
+  functions are replaced by lookup tables and polynomial approximations.
+*/
+#include <QRgb>
+
+// L = 0->100, C = 0->134, H = 0->360 (degrees)
+void rgbToLchRow(const QRgb *src, float *L, float *C, float *H, int n);
+
+// converts to opaque sRGB pixels. Out of gamut colors are clipped
+void lchToRgbRow(const float *L, const float *C, const float *H, QRgb *dst, int n);
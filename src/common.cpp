@@ -98,6 +98,14 @@ QImage setImageBackgroundColor(QImage img, QRgb color)
 }
 
 
+void toRgbFormat(QImage &img)
+{
+    if (img.hasAlphaChannel() && img.format()!=QImage::Format_ARGB32)
+        img = img.convertToFormat(QImage::Format_ARGB32);
+    else if (!img.hasAlphaChannel() and img.format()!=QImage::Format_RGB32)
+        img = img.convertToFormat(QImage::Format_RGB32);
+}
+
 // load an image from file
 QImage loadImage(QString fileName)
 {
@@ -110,11 +118,15 @@ QImage loadImage(QString fileName)
         if (img.isNull())
             return img;
     }
-    // Converted because filters can only be applied to RGB32 or ARGB32 image
-    if (img.hasAlphaChannel() && img.format()!=QImage::Format_ARGB32)
-        img = img.convertToFormat(QImage::Format_ARGB32);
-    else if (!img.hasAlphaChannel() and img.format()!=QImage::Format_RGB32)
-        img = img.convertToFormat(QImage::Format_RGB32);
+    // grayscale and black & white images (e.g scanned pages) are kept in their
+    // compact formats, others are converted, because filters work on RGB32 or ARGB32
+    if (img.format()==QImage::Format_MonoLSB)
+        img = img.convertToFormat(QImage::Format_Mono);
+    else if (img.format()==QImage::Format_Indexed8 && img.allGray() && !img.hasAlphaChannel())
+        img = img.convertToFormat(QImage::Format_Grayscale8);
+    if (not (img.format()==QImage::Format_Grayscale8 or
+            (img.format()==QImage::Format_Mono && !img.hasAlphaChannel())))
+        toRgbFormat(img);
     // Get jpg orientation
     FILE *f = qfopen(fileName, "rb");
     int orientation = getOrientation(f);
@@ -63,8 +63,13 @@ const char* getFormat(QString filename);
 // convert ARGB32 image to RGB32 image with color background
 QImage setImageBackgroundColor(QImage img, QRgb color);
 
+// convert image to RGB32 (or ARGB32 if it has transparency) format, if it is
+// not already. Most filters and tools work only on these two formats
+void toRgbFormat(QImage &img);
+
 // load an image from file
-// Returns an autorotated image according to exif data
+// Returns an autorotated image according to exif data. Grayscale images are
+// loaded as Grayscale8, black & white images as Mono, others as RGB32 or ARGB32
 QImage loadImage(QString filename);
 
 // saves img as jpeg with that exif
@@ -90,6 +95,34 @@ public:
 void debug(const char *format, ...);
 
 
+// Gives lock free access to rows of a QImage from multiple threads.
+// QImage::scanLine() may detach (deep copy) the shared image data, so it is not
+// safe to call it from parallel loops. The view detaches the image only once
+// when created, so it must be created before the parallel region, and it is
+// valid until the image is modified using QImage methods.
+class ImageView
+{
+public:
+    // for writing, detaches the image if its data is shared
+    ImageView(QImage &img) : data(img.bits()), stride(img.bytesPerLine()),
+                        width(img.width()), height(img.height()), format(img.format()) {}
+    // for reading only
+    ImageView(const QImage &img) : data((uchar*)img.constBits()), stride(img.bytesPerLine()),
+                        width(img.width()), height(img.height()), format(img.format()) {}
+
+    template<class T=QRgb>
+    inline T* row(int y) const { return (T*)(data + (size_t)y*stride); }
+
+    uchar *data;
+    int stride;// bytes per line
+    int width;
+    int height;
+    QImage::Format format;
+};
+
+// read only view, which never detaches the image, even if it is not const
+inline ImageView constView(const QImage &img) { return ImageView(img); }
+
 // Runtime detection of byte order
 inline bool isBigEndian()
 {
@@ -283,7 +283,8 @@ LensDialog:: getResult(QImage img)
     edge = edgeSpin->value();
     zoom = zoomSpin->value();
 
-    lensDistortion(img, main, edge, zoom);
+    lens_map.update(img.width(), img.height(), main, edge, zoom);
+    lens_map.apply(img);
     return img;
 }
 
@@ -355,6 +356,62 @@ GammaDialog:: getResult(QImage img)
 }
 
 
+// ----------- Preview Dialog for Unsharp Mask --------- //
+
+SharpenDialog:: SharpenDialog(QLabel *canvas, QImage img, float scale) : PreviewDialog(canvas,img,scale)
+{
+    setWindowTitle("Sharpen");
+    QLabel *label0 = new QLabel("Amount :", this);
+    QLabel *label1 = new QLabel("Threshold :", this);
+    QLabel *label2 = new QLabel("Radius :", this);
+    amountSpin = new QDoubleSpinBox(this);
+    amountSpin->setSingleStep(0.1);
+    amountSpin->setRange(0.1, 5.0);
+    amountSpin->setValue(amount);
+    threshSpin = new QSpinBox(this);
+    threshSpin->setRange(0, 255);
+    threshSpin->setValue(thresh);
+    radiusSpin = new QSpinBox(this);
+    radiusSpin->setRange(1, 50);
+    radiusSpin->setValue(radius);
+    gaussianCheck = new QCheckBox("Gaussian Blur Mask", this);
+    gaussianCheck->setChecked(gaussian);
+    QDialogButtonBox *btnBox = new QDialogButtonBox(QDialogButtonBox::Ok|
+                                    QDialogButtonBox::Cancel, Qt::Horizontal, this);
+    QGridLayout *layout = new QGridLayout(this);
+    layout->addWidget(label0, 0,0,1,1);
+    layout->addWidget(label1, 1,0,1,1);
+    layout->addWidget(label2, 2,0,1,1);
+    layout->addWidget(amountSpin, 0,1,1,1);
+    layout->addWidget(threshSpin, 1,1,1,1);
+    layout->addWidget(radiusSpin, 2,1,1,1);
+    layout->addWidget(gaussianCheck, 3,0,1,2);
+    layout->addWidget(btnBox, 4,0,1,2);
+
+    connect(amountSpin, SIGNAL(valueChanged(double)), this, SLOT(triggerPreview()));
+    connect(threshSpin, SIGNAL(valueChanged(int)), this, SLOT(triggerPreview()));
+    connect(radiusSpin, SIGNAL(valueChanged(int)), this, SLOT(triggerPreview()));
+    connect(gaussianCheck, SIGNAL(toggled(bool)), this, SLOT(triggerPreview()));
+    connect(btnBox, SIGNAL(accepted()), this, SLOT(accept()));
+    connect(btnBox, SIGNAL(rejected()), this, SLOT(reject()));
+
+    triggerPreview();
+}
+
+QImage
+SharpenDialog:: getResult(QImage img)
+{
+    amount = amountSpin->value();
+    thresh = threshSpin->value();
+    radius = radiusSpin->value();
+    gaussian = gaussianCheck->isChecked();
+
+    int r = MAX(1, (int)roundf(radius*radius_scale));
+    unsharpMask(img, amount, thresh, r, gaussian);
+    return img;
+}
+
+
 
 // ----------- Preview Dialog for Contrast Levels Adjustment --------- //
 
@@ -546,12 +603,14 @@ LevelsDialog:: LevelsDialog(QLabel *canvas, QImage img, float scale) : PreviewDi
 QImage
 LevelsDialog:: getResult(QImage img)
 {
-    levelImageChannel(img, CHANNEL_R, inputRSlider->left_val, inputRSlider->right_val,
-                                    outputRSlider->left_val, outputRSlider->right_val);
-    levelImageChannel(img, CHANNEL_G, inputGSlider->left_val, inputGSlider->right_val,
-                                    outputGSlider->left_val, outputGSlider->right_val);
-    levelImageChannel(img, CHANNEL_B, inputBSlider->left_val, inputBSlider->right_val,
-                                    outputBSlider->left_val, outputBSlider->right_val);
+    // all three channels are adjusted in a single pass
+    PointOps().levelChannel(CHANNEL_R, inputRSlider->left_val, inputRSlider->right_val,
+                                    outputRSlider->left_val, outputRSlider->right_val)
+              .levelChannel(CHANNEL_G, inputGSlider->left_val, inputGSlider->right_val,
+                                    outputGSlider->left_val, outputGSlider->right_val)
+              .levelChannel(CHANNEL_B, inputBSlider->left_val, inputBSlider->right_val,
+                                    outputBSlider->left_val, outputBSlider->right_val)
+              .apply(img);
     return img;
 }
 
@@ -7,6 +7,7 @@
 #include <QTextEdit>
 #include <QImage>
 #include <QTimer>
+#include "filters.h"
 
 // Dialog to set JPG Options for saving
 class JpegDialog : public QDialog
@@ -90,6 +91,7 @@ public:
     QDoubleSpinBox *mainSpin;
     QDoubleSpinBox *edgeSpin;
     QDoubleSpinBox *zoomSpin;
+    LensMap lens_map;// reused while preview image size and values are same
 
     LensDialog(QLabel *parent, QImage img, float scale);
     QImage getResult(QImage img);
@@ -118,6 +120,25 @@ public:
 };
 
 
+class SharpenDialog : public PreviewDialog
+{
+public:
+    float amount = 1.0;
+    int thresh = 5;
+    int radius = 1;
+    bool gaussian = false;
+    // preview image is scaled, so radius is multiplied by this while previewing
+    float radius_scale = 1.0;
+    QDoubleSpinBox *amountSpin;
+    QSpinBox *threshSpin;
+    QSpinBox *radiusSpin;
+    QCheckBox *gaussianCheck;
+
+    SharpenDialog(QLabel *parent, QImage img, float scale);
+    QImage getResult(QImage img);
+};
+
+
 class LevelsWidget : public QLabel
 {
     Q_OBJECT
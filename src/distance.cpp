@@ -0,0 +1,158 @@
+// this file is part of photoquick program which is GPLv3 licensed
+#include "distance.h"
+#include "common.h"
+#include <cmath>
+#include <climits>
+
+// width of column strips processed by each thread in column pass
+#define DIST_STRIP 256
+
+typedef unsigned short ushort;
+
+QRect maskBoundingRect(const QImage &mask)
+{
+    int w = mask.width();
+    int h = mask.height();
+    int x1 = w, y1 = h, x2 = -1, y2 = -1;
+    ImageView view = constView(mask);
+    #pragma omp parallel for reduction(min:x1,y1) reduction(max:x2,y2)
+    for (int y=0; y<h; y++) {
+        uchar *row = view.row<uchar>(y);
+        int first = 0, last = w-1;
+        while (first<w and row[first]==0)
+            first++;
+        if (first==w)
+            continue;
+        while (row[last]==0)
+            last--;
+        x1 = MIN(x1, first);
+        x2 = MAX(x2, last);
+        y1 = MIN(y1, y);
+        y2 = MAX(y2, y);
+    }
+    if (x2<0)
+        return QRect();
+    return QRect(x1, y1, x2-x1+1, y2-y1+1);
+}
+
+// floor of a/b for b > 0
+static inline long long floor_div(long long a, long long b)
+{
+    return a>=0 ? a/b : -((b-1-a)/b);
+}
+
+// squared distance of each pixel of a row to the nearest target pixel, from
+// column distances g of the row. s and t are buffers of n ints, where s holds
+// the columns whose parabolas form the lower envelope, and t holds the first
+// x where each of those parabolas is the lowest. squares are calculated in
+// long long, as they overflow int in rows wider than 46340 pixels. distances
+// are capped at INT_MAX, which is much farther than feathering needs
+static void row_distance(const ushort *g, int n, int *dist, int *s, int *t)
+{
+#define DIST(x, i) (SQR((long long)(x)-(i)) + SQR((long long)g[i]))
+    int q = 0;
+    s[0] = t[0] = 0;
+    for (int u=1; u<n; u++) {
+        while (q>=0 and DIST(t[q], s[q]) > DIST(t[q], u))
+            q--;
+        if (q<0) {
+            q = 0;
+            s[0] = u;
+            continue;
+        }
+        // first x where parabola of u is lower than that of s[q]
+        int i = s[q];
+        long long x = 1 + floor_div((long long)u*u - (long long)i*i + SQR((long long)g[u])
+                                        - SQR((long long)g[i]), 2*(u-i));
+        if (x < n) {
+            q++;
+            s[q] = u;
+            t[q] = x;
+        }
+    }
+    for (int u=n-1; u>=0; u--) {
+        dist[u] = MIN(DIST(u, s[q]), (long long)INT_MAX);
+        if (u==t[q])
+            q--;
+    }
+#undef DIST
+}
+
+QRect featherMask(QImage &mask, float width)
+{
+    QRect rect = maskBoundingRect(mask);
+    if (rect.isNull() or width < 1)
+        return rect;
+    // distances beyond r are not needed, as feathering ends at width/2
+    int r = ceil(width/2) + 1;
+    rect = rect.adjusted(-r, -r, r, r).intersected(mask.rect());
+    int bx = rect.x(), by = rect.y();
+    int bw = rect.width(), bh = rect.height();
+    // column distance of each pixel to nearest unselected (g_out) and
+    // selected (g_in) pixel, capped at r
+    ushort *g_out = (ushort*) malloc(2*bw*bh*sizeof(ushort));
+    ushort *g_in = g_out + bw*bh;
+    ImageView view(mask);
+    int strip_count = (bw + DIST_STRIP - 1)/DIST_STRIP;
+    #pragma omp parallel for
+    for (int strip=0; strip<strip_count; strip++)
+    {
+        int x0 = strip*DIST_STRIP;
+        int n = MIN(DIST_STRIP, bw-x0);
+        for (int y=0; y<bh; y++) {
+            const uchar *row = view.row<uchar>(by+y) + bx + x0;
+            ushort *out = g_out + y*bw + x0;
+            ushort *in = g_in + y*bw + x0;
+            if (y==0) {
+                for (int x=0; x<n; x++) {
+                    out[x] = row[x] ? r : 0;
+                    in[x] = row[x] ? 0 : r;
+                }
+                continue;
+            }
+            ushort *out_prev = out - bw;
+            ushort *in_prev = in - bw;
+            #pragma omp simd
+            for (int x=0; x<n; x++) {
+                int d_out = MIN(out_prev[x]+1, r);
+                int d_in = MIN(in_prev[x]+1, r);
+                out[x] = row[x] ? d_out : 0;
+                in[x] = row[x] ? 0 : d_in;
+            }
+        }
+        for (int y=bh-2; y>=0; y--) {
+            ushort *out = g_out + y*bw + x0;
+            ushort *in = g_in + y*bw + x0;
+            ushort *out_next = out + bw;
+            ushort *in_next = in + bw;
+            #pragma omp simd
+            for (int x=0; x<n; x++) {
+                out[x] = MIN(out[x], out_next[x]+1);
+                in[x] = MIN(in[x], in_next[x]+1);
+            }
+        }
+    }
+    #pragma omp parallel
+    {
+        int *buf = (int*) malloc(4*bw*sizeof(int));
+        int *d_out = buf, *d_in = buf + bw;
+        int *s = buf + 2*bw, *t = buf + 3*bw;
+        #pragma omp for
+        for (int y=0; y<bh; y++) {
+            const ushort *out = g_out + y*bw;
+            row_distance(out, bw, d_out, s, t);
+            row_distance(g_in + y*bw, bw, d_in, s, t);
+            uchar *row = view.row<uchar>(by+y) + bx;
+            for (int x=0; x<bw; x++) {
+                // signed distance from boundary, which lies halfway between
+                // a selected pixel and its nearest unselected pixel
+                float d = out[x] ? sqrtf(d_out[x]) - 0.5f : 0.5f - sqrtf(d_in[x]);
+                float alpha = clamp(0.5f + d/width, 0.0f, 1.0f);
+                row[x] = 255*alpha + 0.5f;
+            }
+        }
+        free(buf);
+    }
+    free(g_out);
+    return rect;
+}
@@ -0,0 +1,18 @@
+#pragma once
+/* Euclidean distance transform of 8 bit (Grayscale8) masks, using Meijster's
+  separable algorithm, which takes linear time. Column distances are found by
+  scanning down and up, then each row takes lower envelope of the parabolas
+  (x-i)^2 + g(i)^2 of column distances g.
+  Distances are needed only upto a limit for feathering, so column distances
+  are capped, which keeps them in 16 bit and the cost independent of the limit.
+*/
+#include <QImage>
+
+// bounding rectangle of nonzero pixels of Grayscale8 mask, null if all are zero
+QRect maskBoundingRect(const QImage &mask);
+
+// Feather edges of Grayscale8 mask (0 = unselected, nonzero = selected), so that
+// mask value changes linearly from 0 to 255 over given width across the boundary.
+// Only the bounding rectangle of the mask expanded by width/2 is processed.
+// Returns that rectangle, mask is zero outside it.
+QRect featherMask(QImage &mask, float width);
@@ -1,7 +1,10 @@
 // this file is part of photoquick program which is GPLv3 licensed
 #include "filters.h"
 #include "common.h"
-#include <QPainter>
+#include "filters_simd.h"
+#include "histogram.h"
+#include "colorspace.h"
+#include "integral.h"
 #include <cmath>
 
 
@@ -116,13 +119,12 @@ void hsvImg(QImage &img)
 {
     int w = img.width();
     int h = img.height();
+    ImageView view(img);
     #pragma omp parallel for
     for (int y=0; y<h; y++)
     {
-        QHsv *row;
+        QHsv *row = view.row<QHsv>(y);
         int h=0,s=0,v=0;
-        #pragma omp critical
-        { row = (QHsv*)img.scanLine(y);}
         for (int x=0; x<w; x++) {
             rgbToHsv(row[x],h,s,v);
             row[x] = qHsv(h,s,v);
@@ -130,80 +132,14 @@ void hsvImg(QImage &img)
     }
 }
 
-// HCL <--> RGB colorspace conversion functions
-// Hue = 0->359, Chroma=0->131, Luminance = 0->100
+// HCL color is packed in 32 bit int like HSV color. Conversion is done in colorspace.cpp
+// Hue = 0->359, Chroma=0->134, Luminance = 0->100
 // it is same as CIE LCHab colorspace, but here components are in reverse order
 typedef unsigned int QHcl;
 #define qHcl qHsv
 #define qCro qGreen
 #define qLum qBlue
 
-// D65 standard referent
-#define LAB_Xn 0.950470f
-#define LAB_Yn 1
-#define LAB_Zn 1.088830f
-
-#define LAB_t0 0.137931f  // 16 / 116
-#define LAB_t1 0.206897f  // 24 / 116
-#define LAB_t2 0.128419f   // 3 * t1 * t1
-#define LAB_t3 0.008856f  // t1^3
-
-float xyz_lab(float t)
-{
-    if (t > LAB_t3)
-        return powf(t, 1.0f / 3);
-    return t / LAB_t2 + LAB_t0;
-}
-
-float lab_xyz(float t) {
-    return t > LAB_t1 ? t*t*t : LAB_t2 * (t - LAB_t0);
-};
-
-void rgbToHcl(QRgb rgb, int &h, int &c, int &l)
-{
-    float r,g,b, x,y,z,a;
-    // srgb to linear rgb float
-    r = srgb_to_linear(qRed(rgb)/255.0f);
-    g = srgb_to_linear(qGreen(rgb)/255.0f);
-    b = srgb_to_linear(qBlue(rgb)/255.0f);
-    // convert to xyz colorspace
-    x = xyz_lab((0.412456f * r + 0.357576f * g + 0.180437f * b) / LAB_Xn);
-    y = xyz_lab((0.212673f * r + 0.715152f * g + 0.072175f * b) / LAB_Yn);
-    z = xyz_lab((0.019334f * r + 0.119192f * g + 0.950304f * b) / LAB_Zn);
-    // convert to LAB colorspace
-    l = 116 * y - 16;
-    l = l < 0 ? 0 : l,
-    a = 500 * (x - y);
-    b = 200 * (y - z);
-    // convert to HCL colorspace
-    c = sqrtf(a*a + b*b);
-    h = (int)roundf(atan2f(b, a) * 180/PI + 360) % 360;
-}
-
-void hclToRgb(QHcl hcl, int &r, int &g, int &b_)
-{
-    float x,y,z, a,b, h,c,l;
-    h = qHue(hcl);
-    c = qCro(hcl);
-    l = qLum(hcl); // L=[0..100]
-    // convert lch to LAB colorspace
-    h *= PI/180;
-    a = cosf(h)*c; // A=[-100..100]
-    b = sinf(h)*c; // B=[-100..100]
-    // convert lab to xyz colorspace
-    y = (l + 16) / 116;
-    x = a==0 ? y : y + a/500;
-    z = b==0 ? y : y - b/200;
-
-    x = LAB_Xn * lab_xyz(x);
-    y = LAB_Yn * lab_xyz(y);
-    z = LAB_Zn * lab_xyz(z);
-    // convert xyz to srgb
-    r =  Clamp(255.0f * linear_to_srgb( 3.240454f*x - 1.537139f*y - 0.498531f*z));
-    g =  Clamp(255.0f * linear_to_srgb(-0.969266f*x + 1.876011f*y + 0.041556f*z));
-    b_ = Clamp(255.0f * linear_to_srgb( 0.055643f*x - 0.204026f*y + 1.057225f*z));
-}
-
 //______________________________ End of Color Utils ________________________________________
 
 
@@ -211,6 +147,7 @@ void hclToRgb(QHcl hcl, int &r, int &g, int &b_)
 // Expand each size of Image by certain amount of border
 QImage expandBorder(QImage img, int width)
 {
+    toRgbFormat(img);
     int w = img.width();
     int h = img.height();
     QImage dst = QImage(w+2*width, h+2*width, img.format());
@@ -271,22 +208,24 @@ QImage expandBorder(QImage img, int width)
 // border average of non transparent parts
 QRgb borderAverageForTransparent(QImage &img)
 {
-    QImage tmp = expandBorder(img, 1);
+    toRgbFormat(img);
     int w = img.width();
     int h = img.height();
 
     int sum_r=0, sum_g=0, sum_b=0, count=0;
 
-    for (int y=1; y<=h; y++)
+    for (int y=0; y<h; y++)
     {
-        QRgb *row = (QRgb*) tmp.constScanLine(y);
-        for (int x=1; x<=w; x++)
+        QRgb *row = (QRgb*) img.constScanLine(y);
+        for (int x=0; x<w; x++)
         {
             if (qAlpha(row[x])==255) {// pixel should be non transparent but has transparent neighbour
                 int sum_alpha = 0;
+                // neighbours outside the image are same as the edge pixels
                 for (int i=-1; i<=1; i++) {
+                    QRgb *nbr_row = (QRgb*) img.constScanLine(clamp(y+i, 0, h-1));
                     for (int j=-1; j<=1; j++) {
-                        sum_alpha += qAlpha(((QRgb*)tmp.constScanLine(y+i))[x+j]);
+                        sum_alpha += qAlpha(nbr_row[clamp(x+j, 0, w-1)]);
                     }
                 }
                 if (sum_alpha < 2295/* 255x9 */){// has transparent neighbour
@@ -304,28 +243,92 @@ QRgb borderAverageForTransparent(QImage &img)
 }
 
 //********** --------- Gray Scale Image --------- ********** //
+// Grayscale8 is kept, other formats are converted to RGB32 or ARGB32
+static void toGrayOrRgbFormat(QImage &img)
+{
+    if (img.format()!=QImage::Format_Grayscale8)
+        toRgbFormat(img);
+}
+
+// gray values of row y of a RGB32, ARGB32 or Grayscale8 image.
+// buf must be of image width, it is used only for 32 bit images
+static inline const uchar*
+gray_row(const ImageView &view, int y, uchar *buf)
+{
+    if (view.format==QImage::Format_Grayscale8)
+        return view.row<uchar>(y);
+    QRgb *row = view.row(y);
+    #pragma omp simd
+    for (int x=0; x<view.width; x++)
+        buf[x] = qGray(row[x]);
+    return buf;
+}
+
+// black & white image with same color table as QImage::convertToFormat() creates
+// (0 = white, 1 = black), which is expected by pdf writer
+static QImage newMonoImage(int w, int h)
+{
+    QImage img(w, h, QImage::Format_Mono);
+    img.setColorCount(2);
+    img.setColor(0, qRgb(255,255,255));
+    img.setColor(1, qRgb(0,0,0));
+    return img;
+}
+
+// pack a row of black (1) or white (0) pixels to a row of Format_Mono image
+static void pack_mono_row(const uchar *black, uchar *dst, int w)
+{
+    for (int x=0; x<w; x+=8) {
+        int n = MIN(8, w-x);
+        uchar byte = 0;
+        for (int i=0; i<n; i++)
+            byte |= black[x+i] << (7-i);
+        dst[x/8] = byte;
+    }
+}
+
+// opaque image is converted to Grayscale8, which takes 1/4th memory
 void grayScale(QImage &img)
 {
-    #pragma omp parallel for
-    for (int y=0;y<img.height();y++) {
-        QRgb* line;
-        #pragma omp critical
-        { line = ((QRgb*)img.scanLine(y));}
-        for (int x=0;x<img.width();x++) {
-            int val = rgb_to_Y(qRed(line[x]), qGreen(line[x]), qBlue(line[x]));
-            line[x] = qRgba(val,val,val, qAlpha(line[x]));
+    if (img.format()==QImage::Format_Grayscale8 or
+            (img.format()==QImage::Format_Mono and img.isGrayscale()))
+        return;
+    toRgbFormat(img);
+    int w = img.width();
+    int h = img.height();
+    if (img.hasAlphaChannel()) {
+        ImageView view(img);
+        #pragma omp parallel for
+        for (int y=0;y<h;y++) {
+            QRgb *line = view.row(y);
+            for (int x=0;x<w;x++) {
+                int val = rgb_to_Y(qRed(line[x]), qGreen(line[x]), qBlue(line[x]));
+                line[x] = qRgba(val,val,val, qAlpha(line[x]));
+            }
         }
+        return;
+    }
+    QImage gray(w, h, QImage::Format_Grayscale8);
+    ImageView view = constView(img);
+    ImageView gray_view(gray);
+    #pragma omp parallel for
+    for (int y=0;y<h;y++) {
+        QRgb *line = view.row(y);
+        uchar *gray_line = gray_view.row<uchar>(y);
+        for (int x=0;x<w;x++)
+            gray_line[x] = rgb_to_Y(qRed(line[x]), qGreen(line[x]), qBlue(line[x]));
     }
+    img = gray;
 }
 
 //********* ---------- Invert Colors or Negate --------- ********** //
 void invert(QImage &img)
 {
+    toRgbFormat(img);
+    ImageView view(img);
     #pragma omp parallel for
     for (int y=0;y<img.height();y++) {
-        QRgb* line;
-        #pragma omp critical
-        { line = ((QRgb*)img.scanLine(y));}
+        QRgb *line = view.row(y);
         for (int x=0;x<img.width();x++) {
             line[x] = qRgba(255-qRed(line[x]), 255-qGreen(line[x]), 255-qBlue(line[x]), qAlpha(line[x]));
         }
@@ -336,136 +339,473 @@ void invert(QImage &img)
 //********* --------- Global Threshold -------- ***********//
 #define HISTOGRAM_SIZE 256
 
-int calcOtsuThresh(QImage img)
+// maximizes between-class variance, which is same as maximizing sum of
+// (sum of class values)^2/(class pixel count) over all classes. For n classes
+// best partition of first j levels is found from best partition of first i
+// levels into n-1 classes, for each i < j.
+void calcMultiOtsuThresh(const QImage &img, int classes, int *thresh)
 {
-    // Compute number of pixels
-    int N = img.width()*img.height();
-
-    // Create Histogram
-    unsigned int histogram[HISTOGRAM_SIZE] = {};
-    int x, y;
-    for (y = 0; y < img.height(); ++y)
-    {
-        QRgb *row = (QRgb*)img.constScanLine(y);
-        for (x = 0; x < img.width(); x++)
-            ++histogram[qGray(row[x])];
-    }
-
-    // Calculate sum
-    int sum = 0;
-    for (int idx = 0; idx < HISTOGRAM_SIZE; ++idx)
-        sum += idx * histogram[idx];
-
-    // Compute threshold
-    int threshold = 0;
-    int sumB = 0;
-    int q1 = 0;
-    double max = 0;
-    for (int idx = 0; idx < HISTOGRAM_SIZE; ++idx)
-    {
-        q1 += histogram[idx]; // q1 = Weighted Background
-        if (q1 == 0)
-            continue;
-
-        const int q2 = N - q1; // q2 = Weighted Forground
-        if (q2 == 0)
-            break;
-
-        sumB += (idx * histogram[idx]);
-
-        const double m1m2 =
-            (double)sumB / q1 -         // Mean Background
-            (double)(sum - sumB) / q2;  // Mean Forground
+    classes = clamp(classes, 2, MULTI_OTSU_MAX_CLASSES);
+    ImageStats stats;
+    calcImageStats(img, stats, STATS_GRAY);
+    unsigned int *histogram = stats.gray;
+    // cumulative pixel count and sum of levels [0, i)
+    double count[HISTOGRAM_SIZE+1], sum[HISTOGRAM_SIZE+1];
+    count[0] = sum[0] = 0;
+    for (int i=0; i<HISTOGRAM_SIZE; i++) {
+        count[i+1] = count[i] + histogram[i];
+        sum[i+1] = sum[i] + (double)i*histogram[i];
+    }
+    // best[n][j] is best score of partition of levels [0, j) into n+1 classes,
+    // and start[n][j] is the starting level of the last class in it
+    double best[MULTI_OTSU_MAX_CLASSES][HISTOGRAM_SIZE+1];
+    int start[MULTI_OTSU_MAX_CLASSES][HISTOGRAM_SIZE+1];
+    for (int j=1; j<=HISTOGRAM_SIZE; j++)
+        best[0][j] = count[j]>0 ? sum[j]*sum[j]/count[j] : 0;
+    for (int n=1; n<classes; n++) {
+        // last class starts at level n or above, as each previous class has
+        // at least one level
+        for (int j=n+1; j<=HISTOGRAM_SIZE; j++) {
+            best[n][j] = -1;
+            for (int i=n; i<j; i++) {
+                double cnt = count[j] - count[i];
+                double s = sum[j] - sum[i];
+                double val = best[n-1][i] + (cnt>0 ? s*s/cnt : 0);
+                if (val > best[n][j]) {
+                    best[n][j] = val;
+                    start[n][j] = i;
+                }
+            }
+        }
+    }
+    // trace back the starting level of each class
+    int j = HISTOGRAM_SIZE;
+    for (int n=classes-1; n>0; n--) {
+        j = start[n][j];
+        thresh[n-1] = j-1;
+    }
+}
 
-        // Note - There is an insidious casting situation going on here.
-        // If one were to multiple by q1 or q2 first, an explicit cast would be required!
-        const double between = m1m2 * m1m2 * q1 * q2;
+int calcOtsuThresh(const QImage &img)
+{
+    int thresh;
+    calcMultiOtsuThresh(img, 2, &thresh);
+    return thresh;
+}
 
-        if (between > max)
-        {
-            threshold = idx;
-            max = between;
+// opaque image is converted to black & white image of Format_Mono
+void threshold(QImage &img, int thresh)
+{
+    if (img.hasAlphaChannel()) {
+        PointOps().threshold(thresh).apply(img);
+        return;
+    }
+    toGrayOrRgbFormat(img);
+    int w = img.width();
+    int h = img.height();
+    QImage dst = newMonoImage(w, h);
+    ImageView view = constView(img);
+    ImageView dst_view(dst);
+    #pragma omp parallel
+    {
+        uchar *buf = (uchar*) malloc(2*w);
+        uchar *black = buf + w;
+        #pragma omp for
+        for (int y=0; y<h; y++) {
+            const uchar *gray = gray_row(view, y, buf);
+            for (int x=0; x<w; x++)
+                black[x] = gray[x] <= thresh;
+            pack_mono_row(black, dst_view.row<uchar>(y), w);
         }
+        free(buf);
     }
-    return threshold;
+    img = dst;
 }
 
-void threshold(QImage &img, int thresh)
+// class index (number of thresholds below the gray value) scaled to 0-255.
+// comparisons are used instead of a lookup table, so that it is vectorized.
+// unused thresholds must be 255, and scale is 255*256/(number of thresholds)
+static void quantize_gray_row(const uchar *gray, uchar *dst, int w, const int *t, int scale)
 {
-    #pragma omp parallel for
-    for (int y=0;y<img.height();y++) {
-        QRgb* line;
-        #pragma omp critical
-        { line = ((QRgb*)img.scanLine(y)); }
-        for (int x=0;x<img.width();x++) {
-            int alpha = qAlpha(line[x]);
-            if (qGray(line[x]) > thresh)
-                line[x] = qRgba(255,255,255, alpha);
-            else
-                line[x] = qRgba(0,0,0, alpha);
+    const int t0 = t[0], t1 = t[1], t2 = t[2];
+    #pragma omp simd
+    for (int x=0; x<w; x++) {
+        int n = (gray[x] > t0) + (gray[x] > t1) + (gray[x] > t2);
+        dst[x] = (n*scale) >> 8;
+    }
+}
+
+// thresholds must be in ascending order. one threshold gives a Format_Mono
+// image, more thresholds give a Grayscale8 image if the image is opaque
+void multiThreshold(QImage &img, const int *thresh, int count)
+{
+    count = clamp(count, 1, MULTI_OTSU_MAX_CLASSES-1);
+    if (count==1) {
+        threshold(img, thresh[0]);
+        return;
+    }
+    int t[MULTI_OTSU_MAX_CLASSES-1];
+    for (int i=0; i<MULTI_OTSU_MAX_CLASSES-1; i++)
+        t[i] = i<count ? thresh[i] : 255;
+    const int scale = (255*256 + count-1)/count;
+    toGrayOrRgbFormat(img);
+    int w = img.width();
+    int h = img.height();
+    bool has_alpha = img.hasAlphaChannel();
+    QImage dst = has_alpha ? img : QImage(w, h, QImage::Format_Grayscale8);
+    ImageView view = constView(img);
+    ImageView dst_view(dst);
+    #pragma omp parallel
+    {
+        uchar *buf = (uchar*) malloc(2*w);
+        uchar *out = buf + w;
+        #pragma omp for
+        for (int y=0; y<h; y++) {
+            const uchar *gray = gray_row(view, y, buf);
+            if (not has_alpha) {
+                quantize_gray_row(gray, dst_view.row<uchar>(y), w, t, scale);
+                continue;
+            }
+            quantize_gray_row(gray, out, w, t, scale);
+            QRgb *row = dst_view.row(y);
+            for (int x=0; x<w; x++)
+                row[x] = qRgba(out[x], out[x], out[x], qAlpha(row[x]));
         }
+        free(buf);
     }
+    img = dst;
 }
 
 //*********---------- Adaptive Threshold ---------**********//
 // Apply Bradley threshold (to get desired output, tune value of T and s)
+// Result is a black & white image of Format_Mono
 void adaptiveThreshold(QImage &img, float T, int window_size)
 {
+    toGrayOrRgbFormat(img);
     int w = img.width();
     int h = img.height();
-    // Allocate memory for integral image
-    int len = sizeof(int *) * h + sizeof(int) * w * h;
-    unsigned **intImg = (unsigned **)malloc(len);
-
-    unsigned *ptr = (unsigned*)(intImg + h);
-    for (int i = 0; i < h; i++)
-        intImg[i] = (ptr + w * i);
+    IntegralImage intImg(img, CHANNEL_GRAY);
 
-    // Calculate integral image
-    for (int y=0; y<h; ++y)
-    {
-        QRgb *row = (QRgb*)img.constScanLine(y);
-        int sum=0;
-        for (int x=0;x<w;++x)
-        {
-            sum += qGray(row[x]);
-            if (y==0)
-                intImg[y][x] = qGray(row[x]);
-            else
-                intImg[y][x] = intImg[y-1][x] + sum;
-        }
-    }
     // Apply Bradley threshold
     if (window_size==0)
         window_size = MAX(16, w/32);
     int s2 = window_size/2;
-    #pragma omp parallel for
-    for (int i=0; i<h; ++i)
+    QImage dst = newMonoImage(w, h);
+    ImageView view = constView(img);
+    ImageView dst_view(dst);
+    #pragma omp parallel
     {
-        int x1,y1,x2,y2, count, sum;
-        y1 = ((i - s2)>0) ? (i - s2) : 0;
-        y2 = ((i + s2)<h) ? (i + s2) : h-1;
-        QRgb *row;
-        #pragma omp critical
-        { row = (QRgb*)img.scanLine(i); }
-        for (int j=0; j<w; ++j)
+        uchar *buf = (uchar*) malloc(2*w);
+        uchar *black = buf + w;
+        #pragma omp for
+        for (int i=0; i<h; ++i)
+        {
+            int x1,y1,x2,y2, count;
+            unsigned int sum;
+            y1 = ((i - s2)>0) ? (i - s2) : 0;
+            y2 = ((i + s2)<h) ? (i + s2) : h-1;
+            const uchar *row = gray_row(view, i, buf);
+            for (int j=0; j<w; ++j)
+            {
+                x1 = ((j - s2)>0) ? (j - s2) : 0;
+                x2 = ((j + s2)<w) ? (j + s2) : w-1;
+
+                // sum of pixels in x1 < x <= x2, y1 < y <= y2
+                count = (x2 - x1)*(y2 - y1);
+                sum = intImg.sum(x1+1, y1+1, x2+1, y2+1);
+
+                // threshold = mean*(1 - T) , where mean = sum/count, T = around 0.15
+                black[j] = (row[j] * count) < (int)(sum*(1.0 - T));
+            }
+            pack_mono_row(black, dst_view.row<uchar>(i), w);
+        }
+        free(buf);
+    }
+    img = dst;
+}
+
+
+//*********---------- Morphological Filters ---------**********//
+// Erosion (min) and dilation (max) by van Herk/Gil-Werman algorithm. The
+// row is split into blocks of window size, and running min/max is calculated
+// forward and backward within each block. Then min/max of any window is min/max
+// of two values, so cost does not depend on window size.
+
+// width of column strips (in bytes) processed by each thread in vertical pass
+#define MORPH_STRIP 256
+
+struct MinOp { uchar operator()(uchar a, uchar b) const { return a < b ? a : b; } };
+struct MaxOp { uchar operator()(uchar a, uchar b) const { return a > b ? a : b; } };
+// min and max of 8 pixels packed in a byte of Mono image
+struct AndOp { uchar operator()(uchar a, uchar b) const { return a & b; } };
+struct OrOp  { uchar operator()(uchar a, uchar b) const { return a | b; } };
+
+// min or max of windows of 2r+1 elements of a row, border elements are repeated.
+// each element has chans interleaved bytes. g and h must be of (n+2r)*chans size
+template<class Op> static void
+vhgw_row(const uchar *src, uchar *dst, int n, int chans, int r, uchar *g, uchar *h, Op op)
+{
+    int k = 2*r + 1;
+    int m = n + 2*r;
+    for (int j=0; j<m; j++) {
+        const uchar *p = src + clamp(j-r, 0, n-1)*chans;
+        uchar *gj = g + j*chans;
+        for (int c=0; c<chans; c++)
+            gj[c] = (j%k==0) ? p[c] : op(gj[c-chans], p[c]);
+    }
+    for (int j=m-1; j>=0; j--) {
+        const uchar *p = src + clamp(j-r, 0, n-1)*chans;
+        uchar *hj = h + j*chans;
+        for (int c=0; c<chans; c++)
+            hj[c] = (j%k==k-1 || j==m-1) ? p[c] : op(hj[c+chans], p[c]);
+    }
+    for (int i=0; i<n*chans; i++)
+        dst[i] = op(h[i], g[i + 2*r*chans]);
+}
+
+// same as vhgw_row() along columns of a strip of w bytes, result is written
+// in place. g and h must be of (rows+2r)*w size
+template<class Op> static void
+vhgw_columns(uchar *data, int stride, int w, int rows, int r, uchar *g, uchar *h, Op op)
+{
+    int k = 2*r + 1;
+    int m = rows + 2*r;
+    for (int j=0; j<m; j++) {
+        const uchar *p = data + clamp(j-r, 0, rows-1)*stride;
+        uchar *gj = g + j*w;
+        if (j%k==0)
+            memcpy(gj, p, w);
+        else
+            for (int x=0; x<w; x++)
+                gj[x] = op(gj[x-w], p[x]);
+    }
+    for (int j=m-1; j>=0; j--) {
+        const uchar *p = data + clamp(j-r, 0, rows-1)*stride;
+        uchar *hj = h + j*w;
+        if (j%k==k-1 || j==m-1)
+            memcpy(hj, p, w);
+        else
+            for (int x=0; x<w; x++)
+                hj[x] = op(hj[x+w], p[x]);
+    }
+    for (int i=0; i<rows; i++) {
+        uchar *row = data + i*stride;
+        const uchar *hi = h + i*w, *gi = g + (i+2*r)*w;
+        for (int x=0; x<w; x++)
+            row[x] = op(hi[x], gi[x]);
+    }
+}
+
+// horizontal pass on each row, and vertical pass on strips of columns.
+// ByteOp is applied on pixel values, BitOp on packed pixels of Mono image
+template<class ByteOp, class BitOp> static void
+morph_rect_op(QImage &img, int rx, int ry, ByteOp byte_op, BitOp bit_op)
+{
+    int w = img.width();
+    int h = img.height();
+    bool mono = img.format()==QImage::Format_Mono;
+    int chans = mono ? 1 : img.depth()/8;
+    int row_bytes = mono ? (w+7)/8 : w*chans;
+    ImageView view(img);
+    if (rx > 0) {
+        #pragma omp parallel
+        {
+            int len = (w + 2*rx)*chans;
+            uchar *buf = (uchar*) malloc(2*len + 2*w);
+            uchar *g = buf, *hbuf = buf + len;
+            uchar *bits = hbuf + len, *out = bits + w;
+            #pragma omp for
+            for (int y=0; y<h; y++) {
+                uchar *row = view.row<uchar>(y);
+                if (mono) {
+                    for (int x=0; x<w; x++)
+                        bits[x] = (row[x>>3] >> (7-(x&7))) & 1;
+                    vhgw_row(bits, out, w, 1, rx, g, hbuf, byte_op);
+                    pack_mono_row(out, row, w);
+                }
+                else {// result is written after whole row is read
+                    vhgw_row(row, row, w, chans, rx, g, hbuf, byte_op);
+                }
+            }
+            free(buf);
+        }
+    }
+    if (ry > 0) {
+        int strip_count = (row_bytes + MORPH_STRIP - 1)/MORPH_STRIP;
+        #pragma omp parallel
         {
-            x1 = ((j - s2)>0) ? (j - s2) : 0;
-            x2 = ((j + s2)<w) ? (j + s2) : w-1;
+            uchar *buf = (uchar*) malloc(2*(h + 2*ry)*MORPH_STRIP);
+            uchar *g = buf, *hbuf = buf + (h + 2*ry)*MORPH_STRIP;
+            #pragma omp for
+            for (int strip=0; strip<strip_count; strip++) {
+                int x0 = strip*MORPH_STRIP;
+                int strip_w = MIN(MORPH_STRIP, row_bytes - x0);
+                if (mono)
+                    vhgw_columns(view.data + x0, view.stride, strip_w, h, ry, g, hbuf, bit_op);
+                else
+                    vhgw_columns(view.data + x0, view.stride, strip_w, h, ry, g, hbuf, byte_op);
+            }
+            free(buf);
+        }
+    }
+}
 
-            count = (x2 - x1)*(y2 - y1);
-            sum = intImg[y2][x2] - intImg[y2][x1] - intImg[y1][x2] + intImg[y1][x1];
+// rectangle of (2rx+1)x(2ry+1) size as structuring element
+static void morph_rect(QImage &img, int rx, int ry, bool use_max)
+{
+    if (use_max)
+        morph_rect_op(img, rx, ry, MaxOp(), OrOp());
+    else
+        morph_rect_op(img, rx, ry, MinOp(), AndOp());
+}
 
-            // threshold = mean*(1 - T) , where mean = sum/count, T = around 0.15
-            if ((qGray(row[j]) * count) < (int)(sum*(1.0 - T)) )
-                row[j] = qRgb(0,0,0);
-            else
-                row[j] = qRgb(255,255,255);
+// disc as union of rectangles of (2rx[i]+1)x(2ry[i]+1) size. Dilation (or
+// erosion) by the union is max (or min) of dilations by each rectangle. Rows are
+// processed in bands, where each rectangle is applied on the band and its halo
+// rows, and combined into the result. So the result is the only buffer of
+// image size, and each rectangle costs about one pass over the image
+template<class ByteOp, class BitOp> static void
+morph_disc_op(QImage &img, const int *rx, const int *ry, int count, ByteOp byte_op, BitOp bit_op)
+{
+    int w = img.width();
+    int h = img.height();
+    bool mono = img.format()==QImage::Format_Mono;
+    int chans = mono ? 1 : img.depth()/8;
+    int row_bytes = mono ? (w+7)/8 : w*chans;
+    int max_rx = 0, max_ry = 0;
+    for (int i=0; i<count; i++) {
+        max_rx = MAX(max_rx, rx[i]);
+        max_ry = MAX(max_ry, ry[i]);
+    }
+    int band_h = MAX(64, 4*max_ry);
+    int band_count = (h + band_h - 1)/band_h;
+    QImage result(w, h, img.format());
+    if (mono)
+        result.setColorTable(img.colorTable());
+    ImageView src = constView(img);
+    ImageView dst(result);
+    #pragma omp parallel
+    {
+        int max_rows = band_h + 2*max_ry;
+        int len = (w + 2*max_rx)*chans;
+        uchar *band = (uchar*) malloc((size_t)max_rows*row_bytes);
+        uchar *line_buf = (uchar*) malloc(2*len + 2*w);
+        uchar *g = line_buf, *hbuf = line_buf + len;
+        uchar *bits = hbuf + len, *out = bits + w;
+        uchar *col_buf = (uchar*) malloc(2*(max_rows + 2*max_ry)*MORPH_STRIP);
+        uchar *col_g = col_buf, *col_h = col_buf + (max_rows + 2*max_ry)*MORPH_STRIP;
+        #pragma omp for schedule(dynamic)
+        for (int b=0; b<band_count; b++)
+        {
+            int y0 = b*band_h;
+            int rows = MIN(band_h, h - y0);
+            for (int i=0; i<count; i++)
+            {
+                // horizontal pass on rows of band and ry[i] rows above and below it
+                int n = rows + 2*ry[i];
+                for (int j=0; j<n; j++) {
+                    const uchar *row = src.row<uchar>(clamp(y0 - ry[i] + j, 0, h-1));
+                    uchar *band_row = band + j*row_bytes;
+                    if (rx[i]==0)
+                        memcpy(band_row, row, row_bytes);
+                    else if (mono) {
+                        for (int x=0; x<w; x++)
+                            bits[x] = (row[x>>3] >> (7-(x&7))) & 1;
+                        vhgw_row(bits, out, w, 1, rx[i], g, hbuf, byte_op);
+                        pack_mono_row(out, band_row, w);
+                    }
+                    else {
+                        vhgw_row(row, band_row, w, chans, rx[i], g, hbuf, byte_op);
+                    }
+                }
+                // vertical pass, rows ry[i] to ry[i]+rows-1 have complete windows
+                for (int x0=0; ry[i]>0 and x0<row_bytes; x0+=MORPH_STRIP) {
+                    int strip_w = MIN(MORPH_STRIP, row_bytes - x0);
+                    if (mono)
+                        vhgw_columns(band + x0, row_bytes, strip_w, n, ry[i], col_g, col_h, bit_op);
+                    else
+                        vhgw_columns(band + x0, row_bytes, strip_w, n, ry[i], col_g, col_h, byte_op);
+                }
+                for (int j=0; j<rows; j++) {
+                    const uchar *band_row = band + (j + ry[i])*row_bytes;
+                    uchar *dst_row = dst.row<uchar>(y0 + j);
+                    if (i==0)
+                        memcpy(dst_row, band_row, row_bytes);
+                    else if (mono)
+                        for (int x=0; x<row_bytes; x++)
+                            dst_row[x] = bit_op(dst_row[x], band_row[x]);
+                    else
+                        for (int x=0; x<row_bytes; x++)
+                            dst_row[x] = byte_op(dst_row[x], band_row[x]);
+                }
+            }
         }
+        free(band);
+        free(line_buf);
+        free(col_buf);
+    }
+    img = result;
+}
+
+static void morph(QImage &img, int radius, int shape, bool dilate)
+{
+    if (radius < 1)
+        return;
+    if (img.format()!=QImage::Format_Mono && img.format()!=QImage::Format_Grayscale8)
+        toRgbFormat(img);
+    // max of pixel values, or of bits in Mono image
+    bool use_max = dilate;
+    if (img.format()==QImage::Format_Mono && (img.color(1) & 0xffffff)==0)
+        use_max = not use_max;// bit 1 is black
+    if (shape==MORPH_RECT) {
+        morph_rect(img, radius, radius, use_max);
+        return;
     }
-    free(intImg);
+    // disc is approximated by union of rectangles whose corners are on the
+    // circle at 0, 22.5, 45, 67.5 and 90 degree
+    int rx[5], ry[5];
+    int count = 0;
+    for (int i=0; i<5; i++) {
+        rx[count] = roundf(radius*cosf(i*PI/8));
+        ry[count] = roundf(radius*sinf(i*PI/8));
+        // skip if it is inside another rectangle (happens for small radius)
+        bool inside = false;
+        for (int j=0; j<5; j++) {
+            int x = roundf(radius*cosf(j*PI/8));
+            int y = roundf(radius*sinf(j*PI/8));
+            if (j!=i && x>=rx[count] && y>=ry[count] && (j<i || x!=rx[count] || y!=ry[count]))
+                inside = true;
+        }
+        if (not inside)
+            count++;
+    }
+    if (use_max)
+        morph_disc_op(img, rx, ry, count, MaxOp(), OrOp());
+    else
+        morph_disc_op(img, rx, ry, count, MinOp(), AndOp());
+}
+
+void erode(QImage &img, int radius, int shape)
+{
+    morph(img, radius, shape, false);
+}
+
+void dilate(QImage &img, int radius, int shape)
+{
+    morph(img, radius, shape, true);
 }
 
+void morphologicalOpen(QImage &img, int radius, int shape)
+{
+    morph(img, radius, shape, false);
+    morph(img, radius, shape, true);
+}
+
+void morphologicalClose(QImage &img, int radius, int shape)
+{
+    morph(img, radius, shape, true);
+    morph(img, radius, shape, false);
+}
 
 //*********---------- Apply Convolution Matrix ---------**********//
 // Kernel Width Must Be An Odd Number
@@ -473,6 +813,7 @@ void adaptiveThreshold(QImage &img, float T, int window_size)
 #if (0)
 void convolve(QImage &img, float kernel[], int width/*of kernel*/)
 {
+    toRgbFormat(img);
     int radius = width/2;
     int w = img.width();
     int h = img.height();
@@ -520,9 +861,44 @@ void convolve(QImage &img, float kernel[], int width/*of kernel*/)
     }
 }
 #endif
+// Instead of expanding image border, rows are copied to buffer with border,
+// and row indices are clamped. In vertical pass, image is processed in strips
+// of columns from top to bottom. As output is written to the same image, a ring
+// buffer keeps the original pixels of last few rows, which are still needed.
+// width of column strips processed by each thread in vertical pass
+#define CONVOLVE_STRIP 128
+
+// copy a row to buf, with r pixels border on both sides filled by edge pixels
+static void copyRowWithBorder(const QRgb *row, int w, int r, QRgb *buf)
+{
+    for (int x=0; x<r; x++) {
+        buf[x] = row[0];
+        buf[r+w+x] = row[w-1];
+    }
+    memcpy(buf+r, row, w*sizeof(QRgb));
+}
+
+// Keeps a copy of last n rows of a strip, row y is stored at y%n
+class RowRing
+{
+public:
+    RowRing(int n, int w) : n(n), w(w) {
+        data = (QRgb*) malloc(n*w*sizeof(QRgb));
+    }
+    ~RowRing() { free(data); }
+    void save(int y, const QRgb *row) {
+        memcpy(data + (y%n)*w, row, w*sizeof(QRgb));
+    }
+    const QRgb* row(int y) { return data + (y%n)*w; }
+private:
+    int n, w;
+    QRgb *data;
+};
+
 // convolve a 1D kernel first left to right and then top to bottom
 void convolve1D(QImage &img, float kernel[], int width/*of kernel*/)
 {
+    toRgbFormat(img);
     /* Build normalized kernel */
     float normal_kernel[width]; // = {}; // Throws error in C99 compiler
     memset(normal_kernel, 0, width * sizeof(float));
@@ -539,53 +915,42 @@ void convolve1D(QImage &img, float kernel[], int width/*of kernel*/)
     int radius = width/2;
     int w = img.width();
     int h = img.height();
-    /* Convolve image */
-    QImage src_img = expandBorder(img, radius);
-    int src_w = src_img.width();
-
-    QRgb *data_src = (QRgb*)src_img.constScanLine(0);
-    QRgb *data_dst = (QRgb*)img.scanLine(0);
+    QRgb *data = (QRgb*)img.scanLine(0);
 
-    #pragma omp parallel for
-    for (int y=0; y < h; y++)
+    /* Convolve image */
+    #pragma omp parallel
     {
-        QRgb *row_dst = data_dst + (y*w);
-        QRgb *row_src = data_src + (src_w*(y+radius));
-
-        for (int x=0; x < w; x++)
+        QRgb *buf = (QRgb*) malloc((w+2*radius)*sizeof(QRgb));
+        #pragma omp for
+        for (int y=0; y < h; y++)
         {
-            float r=0, g=0, b=0;
+            copyRowWithBorder(data + (y*w), w, radius, buf);
+            const QRgb *taps[width];
             for (int i=0; i < width; i++)
-            {
-                QRgb clr = row_src[x+i];
-                r += normal_kernel[i] * qRed(clr);
-                g += normal_kernel[i] * qGreen(clr);
-                b += normal_kernel[i] * qBlue(clr);
-            }
-            row_dst[x] = qRgba(round(r), round(g), round(b), qAlpha(row_dst[x]));
+                taps[i] = buf + i;
+            convolveRow(taps, normal_kernel, width, data + (y*w), w);
         }
+        free(buf);
     }
     // Convolve from top to bottom
-    src_img = expandBorder(img, radius);
-    data_src = (QRgb*)src_img.constScanLine(0);
-
+    int strip_count = (w + CONVOLVE_STRIP - 1)/CONVOLVE_STRIP;
     #pragma omp parallel for
-    for (int y=0; y < h; y++)
+    for (int strip=0; strip<strip_count; strip++)
     {
-        QRgb *row_dst = data_dst + (y*w);
-
-        for (int x=0; x < w; x++)
+        int x0 = strip*CONVOLVE_STRIP;
+        int strip_w = MIN(CONVOLVE_STRIP, w-x0);
+        RowRing ring(radius+1, strip_w);
+        QRgb *col = data + x0;
+        for (int y=0; y < h; y++)
         {
-            float r=0, g=0, b=0;
-            for (int i=0; i < width; i++)
-            {
-                QRgb *row_src = data_src + (src_w*(y+i));
-                QRgb clr = row_src[x+radius];
-                r += normal_kernel[i] * qRed(clr);
-                g += normal_kernel[i] * qGreen(clr);
-                b += normal_kernel[i] * qBlue(clr);
+            // rows above y are already overwritten, so they are taken from ring
+            ring.save(y, col + (y*w));
+            const QRgb *taps[width];
+            for (int i=0; i < width; i++) {
+                int j = y+i-radius;
+                taps[i] = j <= y ? ring.row(MAX(j, 0)) : col + (MIN(j, h-1)*w);
             }
-            row_dst[x] = qRgba( round(r), round(g), round(b), qAlpha(row_dst[x]) );
+            convolveRow(taps, normal_kernel, width, col + (y*w), strip_w);
         }
     }
 }
@@ -594,9 +959,163 @@ void convolve1D(QImage &img, float kernel[], int width/*of kernel*/)
 // 1D Gaussian kernel -> g(x)   = 1/{sqrt(2.pi)*sigma} * e^{-(x^2)/(2.sigma^2)}
 // 2D Gaussian kernel -> g(x,y) = 1/(2.pi.sigma^2) * e^{-(x^2 +y^2)/(2.sigma^2)}
 
+// Recursive Gaussian filter of Young & van Vliet ("Recursive implementation of
+// the Gaussian filter", 1995). A 3rd order causal pass followed by an anticausal
+// pass approximates the gaussian, so the cost per pixel does not depend on sigma.
+// Above this radius gaussianBlur() uses the recursive filter instead of convolution
+#define RECURSIVE_GAUSSIAN_MIN_RADIUS 8
+// width of column strips processed by each thread in vertical pass
+#define RECURSIVE_GAUSSIAN_STRIP 64
+
+typedef struct {
+    float B, b1, b2, b3;// normalized coefficients, B + b1 + b2 + b3 = 1
+    float M[9];// matrix for initializing anticausal pass
+} RecursiveGaussCoeffs;
+
+static RecursiveGaussCoeffs
+recursive_gauss_coeffs(float sigma)
+{
+    double q;
+    if (sigma >= 2.5)
+        q = 0.98711*sigma - 0.96330;
+    else
+        q = 3.97156 - 4.14554*sqrt(1.0 - 0.26891*sigma);
+    double q2 = q*q, q3 = q2*q;
+    double b0 = 1.57825 + 2.44413*q + 1.4281*q2 + 0.422205*q3;
+    double a1 = (2.44413*q + 2.85619*q2 + 1.26661*q3)/b0;
+    double a2 = -(1.4281*q2 + 1.26661*q3)/b0;
+    double a3 = 0.422205*q3/b0;
+    RecursiveGaussCoeffs c;
+    c.b1 = a1;
+    c.b2 = a2;
+    c.b3 = a3;
+    c.B = 1.0 - (a1 + a2 + a3);
+    // Triggs & Sdika, "Boundary conditions for Young-van Vliet recursive filtering"
+    double scale = 1.0/((1.0 + a1 - a2 + a3) * (1.0 - a1 - a2 - a3) * (1.0 + a2 + (a1 - a3)*a3));
+    c.M[0] = scale * (-a3*a1 + 1.0 - a3*a3 - a2);
+    c.M[1] = scale * (a3 + a1) * (a2 + a3*a1);
+    c.M[2] = scale * a3 * (a1 + a3*a2);
+    c.M[3] = scale * (a1 + a3*a2);
+    c.M[4] = -scale * (a2 - 1.0) * (a2 + a3*a1);
+    c.M[5] = -scale * a3 * (a3*a1 + a3*a3 + a2 - 1.0);
+    c.M[6] = scale * (a3*a1 + a2 + a1*a1 - a2*a2);
+    c.M[7] = scale * (a1*a2 + a3*a2*a2 - a1*a3*a3 - a3*a3*a3 - a3*a2 + a3);
+    c.M[8] = scale * a3 * (a1 + a3*a2);
+    return c;
+}
+
+// filter n rows of 'lanes' floats along the rows, each lane independently.
+// edges are extended. lanes must not exceed 3*RECURSIVE_GAUSSIAN_STRIP
+static void
+recursive_gauss_lanes(float *data, int n, int lanes, const RecursiveGaussCoeffs &c)
+{
+    float last[3*RECURSIVE_GAUSSIAN_STRIP];// input value at the end edge
+    memcpy(last, data + (n-1)*lanes, lanes*sizeof(float));
+    // causal pass (top to bottom), previous outputs before first row are
+    // in steady state, so they are same as first input
+    for (int y=0; y<n; y++) {
+        float *row = data + y*lanes;
+        float *p1 = data + MAX(y-1, 0)*lanes;
+        float *p2 = data + MAX(y-2, 0)*lanes;
+        float *p3 = data + MAX(y-3, 0)*lanes;
+        for (int k=0; k<lanes; k++)
+            row[k] = c.B*row[k] + c.b1*p1[k] + c.b2*p2[k] + c.b3*p3[k];
+    }
+    // anticausal pass (bottom to top). outputs after the last row are
+    // calculated from last three causal outputs and the edge input
+    float next[2][3*RECURSIVE_GAUSSIAN_STRIP];// anticausal output at n and n+1
+    float *w0 = data + (n-1)*lanes;
+    float *w1 = data + MAX(n-2, 0)*lanes;
+    float *w2 = data + MAX(n-3, 0)*lanes;
+    for (int k=0; k<lanes; k++) {
+        float d0 = w0[k]-last[k], d1 = w1[k]-last[k], d2 = w2[k]-last[k];
+        float out = c.B*(c.M[0]*d0 + c.M[1]*d1 + c.M[2]*d2) + last[k];
+        next[0][k] = c.B*(c.M[3]*d0 + c.M[4]*d1 + c.M[5]*d2) + last[k];
+        next[1][k] = c.B*(c.M[6]*d0 + c.M[7]*d1 + c.M[8]*d2) + last[k];
+        w0[k] = out;
+    }
+    for (int y=n-2; y>=0; y--) {
+        float *row = data + y*lanes;
+        float *p1 = data + (y+1)*lanes;
+        float *p2 = y+2 < n ? data + (y+2)*lanes : next[y+2-n];
+        float *p3 = y+3 < n ? data + (y+3)*lanes : next[y+3-n];
+        for (int k=0; k<lanes; k++)
+            row[k] = c.B*row[k] + c.b1*p1[k] + c.b2*p2[k] + c.b3*p3[k];
+    }
+}
+
+void recursiveGaussianBlur(QImage &img, float sigma)
+{
+    toRgbFormat(img);
+    int w = img.width();
+    int h = img.height();
+    RecursiveGaussCoeffs c = recursive_gauss_coeffs(sigma);
+
+    QRgb *data = (QRgb*)img.scanLine(0);
+    // blur from left to right, each row is a line of 3 lanes (r,g,b)
+    #pragma omp parallel
+    {
+        float *buf = (float*) malloc(3*w*sizeof(float));
+        #pragma omp for
+        for (int y=0; y<h; y++)
+        {
+            QRgb *row = data + (y*w);
+            for (int x=0; x<w; x++) {
+                buf[3*x]   = qRed(row[x]);
+                buf[3*x+1] = qGreen(row[x]);
+                buf[3*x+2] = qBlue(row[x]);
+            }
+            recursive_gauss_lanes(buf, w, 3, c);
+            for (int x=0; x<w; x++) {
+                row[x] = qRgba(Clamp(buf[3*x]+0.5f), Clamp(buf[3*x+1]+0.5f),
+                               Clamp(buf[3*x+2]+0.5f), qAlpha(row[x]));
+            }
+        }
+        free(buf);
+    }
+    // blur from top to bottom, a strip of columns is filtered at a time
+    // so that all lanes of a row are processed together
+    int strip_count = (w + RECURSIVE_GAUSSIAN_STRIP - 1)/RECURSIVE_GAUSSIAN_STRIP;
+    #pragma omp parallel
+    {
+        float *buf = (float*) malloc(3*RECURSIVE_GAUSSIAN_STRIP*h*sizeof(float));
+        #pragma omp for
+        for (int strip=0; strip<strip_count; strip++)
+        {
+            int x0 = strip*RECURSIVE_GAUSSIAN_STRIP;
+            int strip_w = MIN(RECURSIVE_GAUSSIAN_STRIP, w-x0);
+            int lanes = 3*strip_w;
+            for (int y=0; y<h; y++) {
+                QRgb *row = data + (y*w + x0);
+                float *buf_row = buf + y*lanes;
+                for (int x=0; x<strip_w; x++) {
+                    buf_row[3*x]   = qRed(row[x]);
+                    buf_row[3*x+1] = qGreen(row[x]);
+                    buf_row[3*x+2] = qBlue(row[x]);
+                }
+            }
+            recursive_gauss_lanes(buf, h, lanes, c);
+            for (int y=0; y<h; y++) {
+                QRgb *row = data + (y*w + x0);
+                float *buf_row = buf + y*lanes;
+                for (int x=0; x<strip_w; x++) {
+                    row[x] = qRgba(Clamp(buf_row[3*x]+0.5f), Clamp(buf_row[3*x+1]+0.5f),
+                                   Clamp(buf_row[3*x+2]+0.5f), qAlpha(row[x]));
+                }
+            }
+        }
+        free(buf);
+    }
+}
+
 void gaussianBlur(QImage &img, int radius, float sigma/*standard deviation*/)
 {
     if (sigma==0)  sigma = radius/2.0 ;
+    // the recursive filter approximates a gaussian only for sigma >= 0.5
+    if (radius > RECURSIVE_GAUSSIAN_MIN_RADIUS and sigma >= 0.5) {
+        recursiveGaussianBlur(img, sigma);
+        return;
+    }
     int kernel_width = 2*radius + 1;
     // build 1D gaussian kernel
     float kernel[kernel_width];
@@ -613,62 +1132,51 @@ void gaussianBlur(QImage &img, int radius, float sigma/*standard deviation*/)
 
 //**********----------- Box Blur -----------*************//
 // also called mean blur
+// width of column strips processed by each thread in vertical pass
+#define BOX_FILTER_STRIP 256
+
 void boxFilter(QImage &img, int r/*blur radius*/)
 {
+    toRgbFormat(img);
     int w = img.width();
     int h = img.height();
     int kernel_w = 2*r + 1;
 
-    QImage src_img = expandBorder(img, r);
-    int src_w = src_img.width();
-    QRgb *data_src = (QRgb*) src_img.constScanLine(0);
-    QRgb *data_dst = (QRgb*) img.scanLine(0);
+    QRgb *data = (QRgb*) img.scanLine(0);
 
-    #pragma omp parallel for
-    for (int y=0; y<h; ++y)
+    #pragma omp parallel
     {
-        QRgb *row_dst = data_dst + (y*w);
-        QRgb *row_src = data_src + ((y+r)*src_w);
-
-        int sum_r = 0, sum_g = 0, sum_b = 0;
-        for (int x=0; x<kernel_w; x++) {
-            int clr = row_src[x];
-            sum_r += qRed(clr); sum_g += qGreen(clr); sum_b += qBlue(clr);
-        }
-        row_dst[0] = qRgba(sum_r/kernel_w, sum_g/kernel_w, sum_b/kernel_w, qAlpha(row_dst[0]));
-
-        for (int x=1; x<w; x++) {
-            int left = row_src[x-1];
-            int right = row_src[x+r+r];
-            sum_r += qRed(right) - qRed(left);
-            sum_g += qGreen(right) - qGreen(left);
-            sum_b += qBlue(right) - qBlue(left);
-            row_dst[x] = qRgba(sum_r/kernel_w, sum_g/kernel_w, sum_b/kernel_w, qAlpha(row_dst[x]));
+        QRgb *buf = (QRgb*) malloc((w+2*r)*sizeof(QRgb));
+        #pragma omp for
+        for (int y=0; y<h; ++y)
+        {
+            copyRowWithBorder(data + (y*w), w, r, buf);
+            boxBlurRow(buf, r, data + (y*w), w);
         }
+        free(buf);
     }
-    src_img = expandBorder(img, r);
-    data_src = (QRgb*) src_img.constScanLine(0);
 
+    // blur from top to bottom, a strip of columns at a time, so that
+    // running sums of a whole row of the strip are updated together
+    int strip_count = (w + BOX_FILTER_STRIP - 1)/BOX_FILTER_STRIP;
     #pragma omp parallel for
-    for (int x=0; x<w; ++x)
+    for (int strip=0; strip<strip_count; strip++)
     {
-        int sum_r = 0, sum_g = 0, sum_b = 0;
-
-        for (int y=0; y<kernel_w; y++) {
-            int clr = (data_src + (y*src_w))[x+r];
-            sum_r += qRed(clr); sum_g += qGreen(clr); sum_b += qBlue(clr);
-        }
-        (data_dst)[x] = qRgba(sum_r/kernel_w, sum_g/kernel_w, sum_b/kernel_w,
-                                qAlpha((data_dst)[x]));//first row
-
-        for (int y=1; y<h; y++) {
-            int clr_top = (data_src + ((y-1)*src_w))[x+r];
-            int clr_btm = (data_src + ((y+r+r)*src_w))[x+r];
-            sum_r += qRed(clr_btm) - qRed(clr_top);
-            sum_g += qGreen(clr_btm) - qGreen(clr_top);
-            sum_b += qBlue(clr_btm) - qBlue(clr_top);
-            (data_dst + (y*w))[x] = qRgba(sum_r/kernel_w, sum_g/kernel_w, sum_b/kernel_w,
-                                        qAlpha((data_dst + (y*w))[x]));
+        int x0 = strip*BOX_FILTER_STRIP;
+        int strip_w = MIN(BOX_FILTER_STRIP, w-x0);
+        int sums[4*BOX_FILTER_STRIP] = {};
+        // the row leaving the window is already overwritten, it is taken from ring
+        RowRing ring(r+1, strip_w);
+        QRgb *col = data + x0;
+
+        for (int y=-r; y<=r; y++)
+            boxAccumulateRow(sums, col + (clamp(y, 0, h-1)*w), NULL, strip_w);
+
+        for (int y=0; y<h; y++) {
+            if (y > 0)
+                boxAccumulateRow(sums, col + (MIN(y+r, h-1)*w), ring.row(MAX(y-r-1, 0)), strip_w);
+            ring.save(y, col + (y*w));
+            boxDivideRow(sums, kernel_w, col + (y*w), col + (y*w), strip_w);
         }
     }
 }
@@ -677,32 +1185,138 @@ void boxFilter(QImage &img, int r/*blur radius*/)
 //*************------------ Sharpen ------------****************
 // Using unsharp masking
 // output_image = input_image + factor*(input_image - blur_image)
+// Image is processed in bands of rows. Each thread keeps a ring of horizontally
+// blurred rows of its band, and writes sharpened rows directly to the image.
+// Rows around band boundaries are needed by both bands, so they are copied first.
+#define UNSHARP_BAND 64
+
+// original pixels of row j (clamped) for the band of rows y0 to y1-1
+static inline const QRgb*
+unsharp_band_row(const QRgb *data, const QRgb *halo_top, const QRgb *halo_bottom,
+                 int w, int h, int r, int y0, int y1, int j)
+{
+    j = clamp(j, 0, h-1);
+    if (j < y0)
+        return halo_top + (j - (y0-r))*w;
+    if (j >= y1)
+        return halo_bottom + (j - (y1-r))*w;
+    return data + j*w;
+}
+
+// blur a row horizontally by box filter, or gaussian if kernel is not NULL.
+// buf must have space for w+2r pixels
+static void
+unsharp_hblur(const QRgb *row, int w, int r, const float *kernel, QRgb *buf, QRgb *dst)
+{
+    copyRowWithBorder(row, w, r, buf);
+    if (kernel==NULL) {
+        boxBlurRow(buf, r, dst, w);
+        return;
+    }
+    int kernel_w = 2*r + 1;
+    const QRgb *taps[kernel_w];
+    for (int i=0; i<kernel_w; i++)
+        taps[i] = buf + i;
+    convolveRow(taps, kernel, kernel_w, dst, w);
+}
 
-void unsharpMask(QImage &img, float factor, int thresh)
+static void
+sharpenRow(QRgb *row, const QRgb *row_mask, int w, float factor, int thresh)
 {
-    QImage mask = img.copy();
-    boxFilter(mask, 1);
+    for (int x=0; x<w; x++)
+    {
+        int r_diff = (qRed(row[x]) - qRed(row_mask[x]));
+        int g_diff = (qGreen(row[x]) - qGreen(row_mask[x]));
+        int b_diff = (qBlue(row[x]) - qBlue(row_mask[x]));
+        // default threshold = 5, factor = 1.0
+        int r = r_diff > thresh? qRed(row[x])   + factor*r_diff : qRed(row[x]);
+        int g = g_diff > thresh? qGreen(row[x]) + factor*g_diff : qGreen(row[x]);
+        int b = b_diff > thresh? qBlue(row[x])  + factor*b_diff : qBlue(row[x]);
+        row[x] = qRgba(Clamp(r), Clamp(g), Clamp(b), qAlpha(row[x]));
+    }
+}
+
+void unsharpMask(QImage &img, float factor, int thresh, int radius, bool gaussian)
+{
+    toRgbFormat(img);
     int w = img.width();
     int h = img.height();
+    int r = MAX(radius, 1);
+    int kernel_w = 2*r + 1;
+    float kernel[kernel_w];
+    if (gaussian) {
+        float sigma = r/2.0;
+        float sum = 0;
+        for (int i=0; i<kernel_w; i++) {
+            kernel[i] = exp(-((i-r)*(i-r))/(2.0*sigma*sigma));
+            sum += kernel[i];
+        }
+        for (int i=0; i<kernel_w; i++)
+            kernel[i] /= sum;
+    }
+    int band_h = MAX(UNSHARP_BAND, 4*kernel_w);
+    int band_count = (h + band_h - 1)/band_h;
+    QRgb *data = (QRgb*) img.scanLine(0);
+
+    // original rows from r rows above to r rows below each band boundary
+    QRgb *halo = (QRgb*) malloc(MAX(band_count-1, 1)*2*r*w*sizeof(QRgb));
     #pragma omp parallel for
-    for (int y=0; y<h; y++)
+    for (int b=1; b<band_count; b++) {
+        for (int i=0; i<2*r; i++) {
+            int y = clamp(b*band_h - r + i, 0, h-1);
+            memcpy(halo + ((b-1)*2*r + i)*w, data + y*w, w*sizeof(QRgb));
+        }
+    }
+
+    #pragma omp parallel
     {
-        QRgb *row, *row_mask;
-        #pragma omp critical
-        { row_mask = (QRgb*)mask.constScanLine(y);
-          row = (QRgb*)img.scanLine(y); }
-        for (int x=0; x<w; x++)
+        int ring_n = kernel_w + 1;
+        QRgb *buf = (QRgb*) malloc((w+2*r)*sizeof(QRgb));
+        QRgb *ring = (QRgb*) malloc(ring_n*w*sizeof(QRgb));
+        QRgb *mask = (QRgb*) malloc(w*sizeof(QRgb));
+        int *sums = (int*) malloc(4*w*sizeof(int));
+        const QRgb *taps[kernel_w];
+        #pragma omp for schedule(dynamic)
+        for (int b=0; b<band_count; b++)
         {
-            int r_diff = (qRed(row[x]) - qRed(row_mask[x]));
-            int g_diff = (qGreen(row[x]) - qGreen(row_mask[x]));
-            int b_diff = (qBlue(row[x]) - qBlue(row_mask[x]));
-            // default threshold = 5, factor = 1.0
-            int r = r_diff > thresh? qRed(row[x])   + factor*r_diff : qRed(row[x]);
-            int g = g_diff > thresh? qGreen(row[x]) + factor*g_diff : qGreen(row[x]);
-            int b = b_diff > thresh? qBlue(row[x])  + factor*b_diff : qBlue(row[x]);
-            row[x] = qRgba(Clamp(r), Clamp(g), Clamp(b), qAlpha(row[x]));
+            int y0 = b*band_h;
+            int y1 = MIN(y0 + band_h, h);
+            const QRgb *halo_top = b > 0 ? halo + (b-1)*2*r*w : NULL;
+            const QRgb *halo_bottom = b < band_count-1 ? halo + b*2*r*w : NULL;
+            // horizontally blurred row j is saved at (j+r+1)%ring_n, as j >= y0-r-1
+            #define RING_ROW(j) (ring + (((j)+r+1) % ring_n)*w)
+            #define BAND_ROW(j) unsharp_band_row(data, halo_top, halo_bottom, w, h, r, y0, y1, j)
+            for (int j=y0-r; j<y0+r; j++)
+                unsharp_hblur(BAND_ROW(j), w, r, gaussian ? kernel : NULL, buf, RING_ROW(j));
+            if (not gaussian) {
+                memset(sums, 0, 4*w*sizeof(int));
+                for (int j=y0-r; j<y0+r; j++)
+                    boxAccumulateRow(sums, RING_ROW(j), NULL, w);
+            }
+            for (int y=y0; y<y1; y++)
+            {
+                // blur vertically, then sharpen the row
+                unsharp_hblur(BAND_ROW(y+r), w, r, gaussian ? kernel : NULL, buf, RING_ROW(y+r));
+                if (gaussian) {
+                    for (int i=0; i<kernel_w; i++)
+                        taps[i] = RING_ROW(y-r+i);
+                    convolveRow(taps, kernel, kernel_w, mask, w);
+                }
+                else {
+                    boxAccumulateRow(sums, RING_ROW(y+r), y>y0 ? RING_ROW(y-r-1) : NULL, w);
+                    boxDivideRow(sums, kernel_w, RING_ROW(y), mask, w);
+                }
+                sharpenRow(data + y*w, mask, w, factor, thresh);
+            }
+            #undef BAND_ROW
+            #undef RING_ROW
         }
+        free(sums);
+        free(mask);
+        free(ring);
+        free(buf);
     }
+    free(halo);
 }
 
 
@@ -711,26 +1325,7 @@ void unsharpMask(QImage &img, float factor, int thresh)
 void levelImageChannel(QImage &img, int channel, float black_pt, float white_pt,
                         float out_black, float out_white)
 {
-    int w = img.width();
-    int h = img.height();
-    // pre-calculate output values for all input values
-    uchar output_val[256]={};
-    for (int i=0; i<256; i++){
-        float lin_val = 255.0*srgb_to_linear(i/255.0);
-        lin_val = out_black + (out_white-out_black)*(lin_val-black_pt)/(white_pt-black_pt);
-        int val = 255.0*linear_to_srgb(lin_val/255.0);
-        output_val[i] = Clamp(val);
-    }
-    #pragma omp parallel for
-    for (int y=0; y<h; y++)
-    {
-        uchar *row;
-        #pragma omp critical
-        { row = (uchar*) img.scanLine(y); }
-        for (int x=0; x<w; x++) {
-            row[4*x+channel] = output_val[row[4*x+channel]];
-        }
-    }
+    PointOps().levelChannel(channel, black_pt, white_pt, out_black, out_white).apply(img);
 }
 
 #define ScaleColor(x, mini, maxi) (255.0*((x)-(mini))/((maxi)-(mini)))
@@ -739,25 +1334,7 @@ void levelImageChannel(QImage &img, int channel, float black_pt, float white_pt,
 // black_pt and white_pt must be within 0-1.0 range
 void levelImage(QImage &img, float black_pt, float white_pt)
 {
-    black_pt *= 255;
-    white_pt *= 255;
-
-    int w = img.width();
-    int h = img.height();
-
-    #pragma omp parallel for
-    for (int y=0; y<h; y++)
-    {
-        QRgb *row;
-        #pragma omp critical
-        { row = (QRgb*) img.scanLine(y); }
-        for (int x=0; x<w; x++) {
-            int r = ScaleColor(qRed(row[x]), black_pt, white_pt);
-            int g = ScaleColor(qGreen(row[x]), black_pt, white_pt);
-            int b = ScaleColor(qBlue(row[x]), black_pt, white_pt);
-            row[x] = qRgb(Clamp(r), Clamp(g), Clamp(b));
-        }
-    }
+    PointOps().level(black_pt, white_pt).apply(img);
 }
 
 
@@ -765,35 +1342,16 @@ void levelImage(QImage &img, float black_pt, float white_pt)
 // Sigmoidal Contrast Image to enhance low contrast image
 
 #define Sigmoidal(a,b,x) ( tanh((0.5*(a))*((x)-(b))) )
-
-#define ScaledSigmoidal(a,b,x,min,max) (                    \
-  (Sigmoidal((a),(b),(x))-Sigmoidal((a),(b),(min))) / \
-  (Sigmoidal((a),(b),(max))-Sigmoidal((a),(b),(min))) )
-
-// midpoint => range = 0.0 -> 1.0 , default = 0.5
-// contrast => range =   1 -> 20,   default = 3
-void sigmoidalContrast(QImage &img, float midpoint)
-{
-    int w = img.width();
-    int h = img.height();
-    uchar histogram[256];
-    for (int i=0; i<256; i++) {
-        histogram[i] = 255*ScaledSigmoidal(3, midpoint, i/255.0, 0.0,1.0);
-    }
-    #pragma omp parallel for
-    for (int y=0; y<h; y++)
-    {
-        QRgb *row;
-        #pragma omp critical
-        { row = (QRgb*)img.scanLine(y); }
-        for (int x=0; x<w; x++) {
-            int clr = row[x];
-            int r = histogram[qRed(clr)];
-            int g = histogram[qGreen(clr)];
-            int b = histogram[qBlue(clr)];
-            row[x] = qRgba(r,g,b, qAlpha(clr));
-        }
-    }
+
+#define ScaledSigmoidal(a,b,x,min,max) (                    \
+  (Sigmoidal((a),(b),(x))-Sigmoidal((a),(b),(min))) / \
+  (Sigmoidal((a),(b),(max))-Sigmoidal((a),(b),(min))) )
+
+// midpoint => range = 0.0 -> 1.0 , default = 0.5
+// contrast => range =   1 -> 20,   default = 3
+void sigmoidalContrast(QImage &img, float midpoint)
+{
+    PointOps().sigmoidalContrast(midpoint).apply(img);
 }
 
 /*********** ---------- Stretch Contrast ------------- ***************/
@@ -810,32 +1368,26 @@ int percentile(unsigned int histogram[], float perc, int N)
 
 void autoStretchContrast(QImage &img)
 {
+    toRgbFormat(img);
     int w = img.width();
     int h = img.height();
     hsvImg(img);
-    // Calculate percentile
-    unsigned int histogram[256] = {};
-    for (int y=0; y<h; y++)
-    {
-        QRgb *row;
-        row = (QRgb*)img.constScanLine(y);
-        for (int x=0; x<w; x++) {
-            ++histogram[qVal(row[x])];
-        }
-    }
+    // Calculate percentile of value channel (which is in place of blue)
+    ImageStats stats;
+    calcImageStats(img, stats, STATS_RGB);
+    unsigned int *histogram = stats.blue;
     int min = percentile(histogram, 0.5, w*h);
     int max = percentile(histogram, 99.5, w*h);
     for (int i=0; i<256; i++) {
         int val = ScaleColor(i, min, max);
         histogram[i] = Clamp(val);
     }
+    ImageView view(img);
     #pragma omp parallel for
     for (int y=0; y<h; y++)
     {
         int r=0,g=0,b=0;
-        QRgb *row;
-        #pragma omp critical
-        { row = (QRgb*)img.scanLine(y); }
+        QRgb *row = view.row(y);
         for (int x=0; x<w; x++) {
             int clr = row[x];
             int hsv = qHsv(qHue(clr), qSat(clr), histogram[qVal(clr)]);
@@ -847,6 +1399,7 @@ void autoStretchContrast(QImage &img)
 
 void stretchContrast(QImage &img, int min, int max)
 {
+    toRgbFormat(img);
     int w = img.width();
     int h = img.height();
     hsvImg(img);
@@ -857,13 +1410,12 @@ void stretchContrast(QImage &img, int min, int max)
         int val = ScaleColor(i, min, max);
         histogram[i] = Clamp(val);
     }
+    ImageView view(img);
     #pragma omp parallel for
     for (int y=0; y<h; y++)
     {
         int r=0,g=0,b=0;
-        QRgb *row;
-        #pragma omp critical
-        { row = (QRgb*)img.scanLine(y); }
+        QRgb *row = view.row(y);
         for (int x=0; x<w; x++) {
             int clr = row[x];
             int hsv = qHsv(qHue(clr), qSat(clr), histogram[qVal(clr)]);
@@ -879,20 +1431,145 @@ void stretchContrast(QImage &img, int min, int max)
 //#define DecodeGamma(x) (255 * pow((x)/255.0f, gamma))
 
 // acceptable values are between 0.1 and 10.0. But in practice values between
-// 0.8 and 2.3 are suitable. this function can be optimized by precalculting 256 values
+// 0.8 and 2.3 are suitable.
 void applyGamma(QImage &img, float gamma)
 {
+    PointOps().gamma(gamma).apply(img);
+}
+
+
+// ************* ------------ Point Operations -------------************
+// Each operation maps a channel value to a new value independent of other pixels.
+// They are composed into one lookup table per byte of pixel, so that a chain
+// of operations is applied in a single pass.
+
+PointOps:: PointOps() : thresh(-1)
+{
+    for (int k=0; k<4; k++) {
+        for (int i=0; i<256; i++) {
+            lut[k][i] = i;
+            post_lut[k][i] = i;
+        }
+    }
+}
+
+// apply the table to the output of previous operations of a channel
+void
+PointOps:: map(int channel, const uchar *table)
+{
+    uchar *dst = thresh<0 ? lut[channel] : post_lut[channel];
+    for (int i=0; i<256; i++)
+        dst[i] = table[dst[i]];
+}
+
+PointOps&
+PointOps:: gamma(float gamma)
+{
+    uchar table[256];
+    for (int i=0; i<256; i++)
+        table[i] = int(EncodeGamma(i));
+    map(CHANNEL_R, table);
+    map(CHANNEL_G, table);
+    map(CHANNEL_B, table);
+    return *this;
+}
+
+PointOps&
+PointOps:: sigmoidalContrast(float midpoint)
+{
+    uchar table[256];
+    for (int i=0; i<256; i++)
+        table[i] = 255*ScaledSigmoidal(3, midpoint, i/255.0, 0.0,1.0);
+    map(CHANNEL_R, table);
+    map(CHANNEL_G, table);
+    map(CHANNEL_B, table);
+    return *this;
+}
+
+PointOps&
+PointOps:: levelChannel(int channel, float black_pt, float white_pt,
+                                    float out_black, float out_white)
+{
+    uchar table[256];
+    for (int i=0; i<256; i++){
+        float lin_val = 255.0*srgb_to_linear(i/255.0);
+        lin_val = out_black + (out_white-out_black)*(lin_val-black_pt)/(white_pt-black_pt);
+        int val = 255.0*linear_to_srgb(lin_val/255.0);
+        table[i] = Clamp(val);
+    }
+    map(channel, table);
+    return *this;
+}
+
+PointOps&
+PointOps:: level(float black_pt, float white_pt)
+{
+    black_pt *= 255;
+    white_pt *= 255;
+    uchar table[256];
+    for (int i=0; i<256; i++) {
+        int val = ScaleColor(i, black_pt, white_pt);
+        table[i] = Clamp(val);
+    }
+    map(CHANNEL_R, table);
+    map(CHANNEL_G, table);
+    map(CHANNEL_B, table);
+    // levelImage() makes the image opaque
+    uchar opaque[256];
+    memset(opaque, 255, 256);
+    map(CHANNEL_A, opaque);
+    return *this;
+}
+
+PointOps&
+PointOps:: invert()
+{
+    uchar table[256];
+    for (int i=0; i<256; i++)
+        table[i] = 255-i;
+    map(CHANNEL_R, table);
+    map(CHANNEL_G, table);
+    map(CHANNEL_B, table);
+    return *this;
+}
+
+PointOps&
+PointOps:: threshold(int thresh)
+{
+    this->thresh = thresh;
+    return *this;
+}
+
+void
+PointOps:: apply(QImage &img)
+{
+    toRgbFormat(img);
     int w = img.width();
     int h = img.height();
+    const uchar *lut0 = lut[0], *lut1 = lut[1], *lut2 = lut[2], *lut3 = lut[3];
+    ImageView view(img);
     #pragma omp parallel for
-    for (int y=0; y < h; y++) {
-        QRgb *row;
-        #pragma omp critical
-        { row = (QRgb*) img.scanLine(y); }
-        for (int x=0; x < w; x++) {
-            int clr = row[x];
-            row[x] = qRgba(EncodeGamma(qRed(clr)), EncodeGamma(qGreen(clr)),
-                            EncodeGamma(qBlue(clr)), qAlpha(clr));
+    for (int y=0; y<h; y++)
+    {
+        uchar *row = view.row<uchar>(y);
+        for (int x=0; x<4*w; x+=4) {
+            row[x]   = lut0[row[x]];
+            row[x+1] = lut1[row[x+1]];
+            row[x+2] = lut2[row[x+2]];
+            row[x+3] = lut3[row[x+3]];
+        }
+        if (thresh < 0)
+            continue;
+        QRgb *line = (QRgb*) row;
+        for (int x=0; x<w; x++) {
+            int val = qGray(line[x]) > thresh ? 255 : 0;
+            line[x] = qRgba(val,val,val, qAlpha(line[x]));
+        }
+        for (int x=0; x<4*w; x+=4) {
+            row[x]   = post_lut[0][row[x]];
+            row[x+1] = post_lut[1][row[x+1]];
+            row[x+2] = post_lut[2][row[x+2]];
+            row[x+3] = post_lut[3][row[x+3]];
         }
     }
 }
@@ -902,33 +1579,26 @@ void applyGamma(QImage &img, float gamma)
 
 void autoWhiteBalance(QImage &img)
 {
+    toRgbFormat(img);
     int w = img.width();
     int h = img.height();
     // Calculate percentile
-    unsigned int histogram_r[256] = {};
-    unsigned int histogram_g[256] = {};
-    unsigned int histogram_b[256] = {};
-    for (int y=0; y<h; y++)
-    {
-        QRgb *row = (QRgb*)img.constScanLine(y);
-        for (int x=0; x<w; x++) {
-            ++histogram_r[qRed(row[x])];
-            ++histogram_g[qGreen(row[x])];
-            ++histogram_b[qBlue(row[x])];
-        }
-    }
+    ImageStats stats;
+    calcImageStats(img, stats, STATS_RGB);
+    unsigned int *histogram_r = stats.red;
+    unsigned int *histogram_g = stats.green;
+    unsigned int *histogram_b = stats.blue;
     int min_r = percentile(histogram_r, 0.5, w*h);
     int min_g = percentile(histogram_g, 0.5, w*h);
     int min_b = percentile(histogram_b, 0.5, w*h);
     int max_r = percentile(histogram_r, 99.5, w*h);
     int max_g = percentile(histogram_g, 99.5, w*h);
     int max_b = percentile(histogram_b, 99.5, w*h);
+    ImageView view(img);
     #pragma omp parallel for
     for (int y=0; y<h; y++)
     {
-        QRgb *row;
-        #pragma omp critical
-        { row = (QRgb*)img.scanLine(y);}
+        QRgb *row = view.row(y);
         for (int x=0; x<w; x++) {
             int r = 255.0*(qRed(row[x]) - min_r)/(max_r-min_r);// stretch contrast
             int g = 255.0*(qGreen(row[x]) - min_g)/(max_g-min_g);
@@ -943,21 +1613,14 @@ void autoWhiteBalance(QImage &img)
 // each pixel by avg/avg_i (avg= illumination estimate, avg_i= mean of channel i)
 void grayWorld(QImage &img)
 {
-    long long sum_r = 0, sum_g = 0, sum_b = 0;
+    toRgbFormat(img);
     float a0r = 0.0, a0g = 0.0, a0b = 0.0;
     float a1r = 1.0, a1g = 1.0, a1b = 1.0;
     int pix_count = img.width() * img.height();
 
-    for (int y = 0; y < img.height(); y++)
-    {
-        QRgb *line = (QRgb*) img.constScanLine(y);
-        for (int x = 0; x < img.width(); x++)
-        {
-            sum_r += qRed(line[x]);
-            sum_g += qGreen(line[x]);
-            sum_b += qBlue(line[x]);
-        }
-    }
+    ImageStats stats;
+    calcImageStats(img, stats, STATS_SUMS);
+    long long sum_r = stats.sum_red, sum_g = stats.sum_green, sum_b = stats.sum_blue;
     double mean_rgb = (sum_r + sum_g + sum_b)/3;
 
     if (sum_r > 0)
@@ -975,12 +1638,11 @@ void grayWorld(QImage &img)
     else
         a0b = mean_rgb / pix_count;
 
+    ImageView view(img);
     #pragma omp parallel for
     for (int y = 0; y < img.height(); y++)
     {
-        QRgb *line;
-        #pragma omp critical
-        { line = (QRgb*) img.scanLine(y); }
+        QRgb *line = view.row(y);
         for (int x = 0; x < img.width(); x++)
         {
             int clr = line[x];
@@ -996,163 +1658,141 @@ void grayWorld(QImage &img)
 // Convert to CIE LCH colorspace, and stretch the chroma
 void enhanceColor(QImage &img)
 {
+    toRgbFormat(img);
     int w = img.width();
     int h = img.height();
     // convert to HCL colorspace
-    #pragma omp parallel for
-    for (int y=0; y<h; y++)
-    {
-        QHcl *row;
-        int h=0,c=0,l=0;
-        #pragma omp critical
-        { row = (QHcl*)img.scanLine(y);}
-        for (int x=0; x<w; x++) {
-            rgbToHcl(row[x],h,c,l);
-            row[x] = qHcl(h,c,l);
-        }
-    }
-    // Calculate percentile
-    unsigned int histogram[132] = {};
-    for (int y=0; y<h; y++)
+    ImageView view(img);
+    #pragma omp parallel
     {
-        QRgb *row;
-        row = (QRgb*)img.constScanLine(y);
-        for (int x=0; x<w; x++) {
-            ++histogram[qCro(row[x])];
+        float *buf = (float*) malloc(3*w*sizeof(float));
+        float *L = buf, *C = buf+w, *H = buf+2*w;
+        #pragma omp for
+        for (int y=0; y<h; y++)
+        {
+            QHcl *row = view.row<QHcl>(y);
+            rgbToLchRow(row, L, C, H, w);
+            for (int x=0; x<w; x++) {
+                row[x] = qHcl((int)roundf(H[x]) % 360, C[x], L[x]);
+            }
         }
+        free(buf);
     }
+    // Calculate percentile of chroma (which is in place of green)
+    ImageStats stats;
+    calcImageStats(img, stats, STATS_RGB);
+    unsigned int *histogram = stats.green;
     int min = percentile(histogram, 0, w*h);
     int max = percentile(histogram, 100, w*h);
     if (max==0) // in case of all gray pixels
         max = 100;
-    #pragma omp parallel for
-    for (int y=0; y<h; y++)
+    #pragma omp parallel
     {
-        int r=0,g=0,b=0,c=0;
-        QRgb *row;
-        #pragma omp critical
-        { row = (QRgb*)img.scanLine(y); }
-        for (int x=0; x<w; x++) {
-            int clr = row[x];
-            c = 100*(qCro(clr)-min)/(max-min);
-            hclToRgb(qHcl(qHue(clr),c,qLum(clr)), r,g,b);
-            row[x] = qRgb(r,g,b);
+        float *buf = (float*) malloc(3*w*sizeof(float));
+        float *L = buf, *C = buf+w, *H = buf+2*w;
+        #pragma omp for
+        for (int y=0; y<h; y++)
+        {
+            QRgb *row = view.row(y);
+            for (int x=0; x<w; x++) {
+                int clr = row[x];
+                H[x] = qHue(clr);
+                C[x] = 100*(qCro(clr)-min)/(max-min);
+                L[x] = qLum(clr);
+            }
+            lchToRgbRow(L, C, H, row, w);
         }
+        free(buf);
     }
 }
 
 // ********* ---------- Despecle ---------- ***********
 // Crimmins speckle removal
 
+// Each Hull() call changes a pixel depending on pixels upto 2 rows away. So the
+// image is processed in strips of rows, each with 32 extra rows (for 16 Hull calls)
+// above and below it, and the strips are independent of each other.
+#define DESPECKLE_STRIP 256
+#define DESPECKLE_HALO 32
+
+// f and g contain 1 pixel border, which must be zero
 void Hull(int x_offset, int y_offset, int w, int h, int polarity, uchar *f, uchar *g)
 {
-    uchar *p, *q, *r, *s, v;
-    p = f + w+2;
-    q = g + w+2;
-    r = p + (y_offset*(w+2)+x_offset);
+    int stride = w+2;
+    int offset = y_offset*stride + x_offset;
+    uchar *p = f + stride + 1; // first pixel
+    uchar *q = g + stride + 1;
     for (int y=0; y < h; y++)
     {
-        int i=(2*y+1)+y*w;
-        if (polarity > 0)
-            for (int x=0; x < w; x++)
-            {
-                v = p[i];
-                if (r[i] >= (v+2)) //increase color by 2 unit
-                    v+=1;
-                q[i] = v;
-                i++;
-            }
-        else
-            for (int x=0; x < w; x++)
-            {
-                v= p[i];
-                if ( r[i] <= (v-2))
-                    v-=1;
-                q[i]= v;
-                i++;
-            }
+        int i = y*stride;
+        // increase (or decrease) color by 1 unit if neighbour is larger by 2 units
+        hullRow(p+i, p+i+offset, NULL, q+i, polarity, w);
     }
-
-    p = f + (w+2);
-    q = g + (w+2);
-    r = q + (y_offset*(w+2)+x_offset);
-    s = q - (y_offset*(w+2)+x_offset);
     for (int y=0; y < h; y++)
     {
-        int i=(2*y+1)+y*w;
-        if (polarity > 0)
-            for (int x=0; x < w; x++)
-            {
-                v=q[i];
-                if ((s[i] >= (v+2)) &&
-                    ( r[i] > v))
-                    v+=1;
-                p[i]=v;
-                i++;
-            }
-        else
-            for (int x=0; x < w; x++)
-            {
-                v=q[i];
-                if ((s[i] <= (v-2)) &&
-                    ( r[i] < v))
-                    v-=1;
-                p[i] = v;
-                i++;
-            }
+        int i = y*stride;
+        hullRow(q+i, q+i-offset, q+i+offset, p+i, polarity, w);
     }
 }
 
 void despeckle(QImage &img)
 {
+    toRgbFormat(img);
     int w = img.width();
     int h = img.height();
     int X[4] = {0, 1, 1,-1}, Y[4] = {1, 0, 1, 1};
-    int length = (w+2)*(h+2); // temp buffers contain 1 pixel border
-    #pragma omp parallel for
-    for (int i=0; i < 4; i++) // 4 channels ARGB32 image
+    int strip_count = (h + DESPECKLE_STRIP-1)/DESPECKLE_STRIP;
+    // halo rows are read from original image, as other strips may be modified
+    const QImage src = img.copy();
+    ImageView src_view = constView(src);
+    ImageView view(img);
+    #pragma omp parallel
     {
-        if (i==0 and isBigEndian()) continue;  // skip Alpha for ARGB order
-        if (i==3 and not isBigEndian()) continue;  // BGRA order
-        // allocate memory for pixels array
+        // temp buffers contain 1 pixel border, and are reused for all strips
+        int length = (w+2)*(DESPECKLE_STRIP + 2*DESPECKLE_HALO + 2);
         uchar *pixels = (uchar*)calloc(1,length);
         uchar *buffer = (uchar*)calloc(1,length);
-        // draw image inside pixels array
-        int j = w+2;    // leave first row
-        for (int y=0; y < h; y++)
-        {
-            uchar *row;
-            #pragma omp critical
-            { row = (uchar*)img.constScanLine(y); }
 
-            j++; //leave first column
-            for (int x=0; x < w; x++)
-            {
-                pixels[j++] = row[x*4+i]; // clone image
-            }
-            j++; // leave last column
-        }
-        // reduce speckle noise
-        for (int k=0; k < 4; k++)
-        {
-            Hull( X[k], Y[k], w,h, 1,pixels,buffer);
-            Hull(-X[k],-Y[k], w,h, 1,pixels,buffer);
-            Hull(-X[k],-Y[k], w,h,-1,pixels,buffer);
-            Hull( X[k], Y[k], w,h,-1,pixels,buffer);
-        }
-        // draw pixels array over original image
-        j=w+2;
-        for (int y=0; y < h; y++)
+        #pragma omp for schedule(dynamic)
+        for (int strip=0; strip < strip_count; strip++)
         {
-            uchar *row;
-            #pragma omp critical
-            { row = (uchar*)img.scanLine(y); }
-            j++;
-            for (int x=0; x < w; x++)
+            int y0 = strip*DESPECKLE_STRIP;
+            int y1 = MIN(y0 + DESPECKLE_STRIP, h);
+            int top = MAX(y0 - DESPECKLE_HALO, 0);
+            int rows = MIN(y1 + DESPECKLE_HALO, h) - top;
+            // bottom border may contain rows of previous strip
+            memset(pixels + (rows+1)*(w+2), 0, w+2);
+            memset(buffer + (rows+1)*(w+2), 0, w+2);
+
+            for (int i=0; i < 4; i++) // 4 channels ARGB32 image
             {
-                row[x*4+i] = pixels[j++];
+                if (i==0 and isBigEndian()) continue;  // skip Alpha for ARGB order
+                if (i==3 and not isBigEndian()) continue;  // BGRA order
+                // draw strip inside pixels array
+                for (int y=0; y < rows; y++)
+                {
+                    uchar *row = src_view.row<uchar>(top+y);
+                    uchar *dst = pixels + (y+1)*(w+2) + 1;
+                    for (int x=0; x < w; x++)
+                        dst[x] = row[x*4+i];
+                }
+                // reduce speckle noise
+                for (int k=0; k < 4; k++)
+                {
+                    Hull( X[k], Y[k], w,rows, 1,pixels,buffer);
+                    Hull(-X[k],-Y[k], w,rows, 1,pixels,buffer);
+                    Hull(-X[k],-Y[k], w,rows,-1,pixels,buffer);
+                    Hull( X[k], Y[k], w,rows,-1,pixels,buffer);
+                }
+                // draw pixels array (except halo rows) over original image
+                for (int y=y0; y < y1; y++)
+                {
+                    uchar *row = view.row<uchar>(y);
+                    uchar *src = pixels + (y-top+1)*(w+2) + 1;
+                    for (int x=0; x < w; x++)
+                        row[x*4+i] = src[x];
+                }
             }
-            j++;
         }
         free(buffer);
         free(pixels);
@@ -1162,179 +1802,336 @@ void despeckle(QImage &img)
 
 // ******** ---------- Median Filter ---------**********//
 // Edge preserving noise reduction filter to Reduce Salt & Pepper noise.
-// Algorithm implemented from graphicsmagick source which is based on the
-// paper "Skip Lists: A probabilistic Alternative to Balanced Trees"
-// by William Pugh (1990)
-typedef struct
-{
-  unsigned int
-    next[9],
-    count,
-    signature;
-} MedianListNode;
+// For radius 1, median of 9 values is found using a sorting network.
+// For larger radius, constant time median filter is used, from the paper
+// "Median Filtering in Constant Time" by Perreault and Hebert (2007).
+// Each column keeps a histogram of 2r+1 pixels, and the kernel histogram is
+// updated by adding and subtracting column histograms. Histograms are two level
+// (16 coarse bins, 256 fine bins), fine bins are updated only when required.
 
-typedef struct
-{
-  MedianListNode *nodes;
-  int level;
-} MedianSkipList;
-
-typedef struct
-{
-  MedianSkipList list;
+// size of tiles processed by each thread
+#define MEDIAN_TILE_W 512
+#define MEDIAN_TILE_H 128
 
-  unsigned int
-    center,
-    seed,
-    signature;
-} MedianPixelList;
+#define PIX_SORT(a,b) { uchar t = MIN((a),(b)); (b) = MAX((a),(b)); (a) = t; }
 
+static inline uchar
+median9(uchar p0, uchar p1, uchar p2, uchar p3, uchar p4, uchar p5, uchar p6, uchar p7, uchar p8)
+{
+    PIX_SORT(p1, p2); PIX_SORT(p4, p5); PIX_SORT(p7, p8);
+    PIX_SORT(p0, p1); PIX_SORT(p3, p4); PIX_SORT(p6, p7);
+    PIX_SORT(p1, p2); PIX_SORT(p4, p5); PIX_SORT(p7, p8);
+    PIX_SORT(p0, p3); PIX_SORT(p5, p8); PIX_SORT(p4, p7);
+    PIX_SORT(p3, p6); PIX_SORT(p1, p4); PIX_SORT(p2, p5);
+    PIX_SORT(p4, p7); PIX_SORT(p4, p2); PIX_SORT(p6, p4);
+    PIX_SORT(p4, p2);
+    return p4;
+}
 
-void AddNodeMedianList(MedianPixelList *pixel_list, unsigned int color)
+static void median3x3(QImage &img)
 {
-    MedianSkipList list = pixel_list->list;
-    int level;
-    unsigned int search, update[9];
+    int w = img.width();
+    int h = img.height();
+    QImage dst(w, h, img.format());
+    ImageView src_view = constView(img);
+    ImageView dst_view(dst);
 
-    list.nodes[color].signature = pixel_list->signature;
-    list.nodes[color].count = 1;
-    // Determine where it belongs in the list.
-    // This loop consumes most of the time.
-    search = 256;
-    for (level=list.level; level >= 0; level--)
-    {
-        while (list.nodes[search].next[level] < color)
-            search = list.nodes[search].next[level];
-        update[level] = search;
-    }
-    // Generate a pseudo-random level for this node.
-    for (level=0; ; level++)
-    {
-        pixel_list->seed = (pixel_list->seed*42893621u)+1u;
-        if ((pixel_list->seed & 0x300) != 0x300)
-            break;
-    }
-    if (level > 8)
-        level = 8;
-    if (level > (list.level+2))
-        level = list.level+2;
-    // If we're raising the list's level, link back to the root node.
-    while (level > list.level)
+    #pragma omp parallel
     {
-        list.level++;
-        update[list.level] = 256;
-    }
-    //Link the node into the skip-list.
-    do
-    {
-        list.nodes[color].next[level] = list.nodes[update[level]].next[level];
-        list.nodes[update[level]].next[level] = color;
+        // 3 rows, each having 1 pixel border at left and right
+        int len = 4*(w+2);
+        uchar *buf = (uchar*) malloc(3*len);
+        #pragma omp for
+        for (int y=0; y<h; y++)
+        {
+            for (int i=0; i<3; i++) {
+                const uchar *row = src_view.row<uchar>(clamp(y+i-1, 0, h-1));
+                uchar *buf_row = buf + i*len;
+                memcpy(buf_row+4, row, 4*w);
+                memcpy(buf_row, row, 4);
+                memcpy(buf_row+4*(w+1), row+4*(w-1), 4);
+            }
+            uchar *t = buf, *m = buf + len, *b = buf + 2*len;
+            uchar *row = dst_view.row<uchar>(y);
+            // each byte is processed independently, so it can be vectorized
+            for (int i=0; i<4*w; i++) {
+                row[i] = median9(t[i], t[i+4], t[i+8], m[i], m[i+4], m[i+8],
+                                 b[i], b[i+4], b[i+8]);
+            }
+        }
+        free(buf);
     }
-    while (level-- > 0);
+    img = dst;
 }
 
-inline
-void InsertMedianList(MedianPixelList *pixel_list, uchar pixel)
-{
-    unsigned int index = (unsigned short)(pixel);
-    if (pixel_list->list.nodes[index].signature == pixel_list->signature)
-        pixel_list->list.nodes[index].count++;
-    else
-        AddNodeMedianList(pixel_list, index);
-}
+typedef struct {
+    unsigned short coarse[16];
+    unsigned short fine[256];
+} ColumnHistogram;
 
-void ResetMedianList(MedianPixelList *pixel_list)
+static inline void
+add_column(unsigned int *hist, const unsigned short *col, int n)
 {
-    MedianListNode *root;
-    MedianSkipList list;
-
-    list = pixel_list->list;
-    root = list.nodes+256;
-    list.level = 0;
-    for (int level=0; level < 9; level++)
-        root->next[level] = 256;
-
-    pixel_list->seed = pixel_list->signature++;
+    for (int i=0; i<n; i++)
+        hist[i] += col[i];
 }
 
-void DestroyMedianList(void *pixel_list)
+static inline void
+sub_column(unsigned int *hist, const unsigned short *col, int n)
 {
-    MedianPixelList *skiplist = (MedianPixelList *) pixel_list;
-
-    if (skiplist != (void *) NULL)
-        free(skiplist->list.nodes);
-    free(skiplist);
+    for (int i=0; i<n; i++)
+        hist[i] -= col[i];
 }
 
-MedianPixelList* AllocateMedianList(const int width)
+// apply median filter to one channel of the tile. tile is the output area,
+// column histograms include r extra columns on both sides
+static void
+median_filter_tile(const ImageView &src, const ImageView &dst, int channel, int r,
+                   int tile_x, int tile_y, int tile_w, int tile_h, ColumnHistogram *cols)
 {
-    MedianPixelList *skiplist;
-
-    skiplist = (MedianPixelList *) calloc(1,sizeof(MedianPixelList));//TODO:align to 64
-    if (skiplist == (MedianPixelList *) NULL)
-        return skiplist;
-
-    skiplist->center=width*width/2;
-    skiplist->signature = 0xabacadabUL; //MagickSignature;
-    skiplist->list.nodes = (MedianListNode*) calloc(1, 257*sizeof(MedianListNode));
-    if (skiplist->list.nodes == (MedianListNode *) NULL)
+    int w = src.width;
+    int h = src.height;
+    int n_cols = tile_w + 2*r;
+    int center = (2*r+1)*(2*r+1)/2;// index of the median in the sorted window
+    // position of the column in the image
+    int col_x[n_cols];
+    for (int j=0; j<n_cols; j++)
+        col_x[j] = 4*clamp(tile_x-r+j, 0, w-1) + channel;
+
+    memset(cols, 0, n_cols*sizeof(ColumnHistogram));
+    for (int y=tile_y-r; y<tile_y+r; y++) {
+        const uchar *row = src.row<uchar>(clamp(y, 0, h-1));
+        for (int j=0; j<n_cols; j++) {
+            uchar v = row[col_x[j]];
+            cols[j].coarse[v>>4]++;
+            cols[j].fine[v]++;
+        }
+    }
+    for (int y=tile_y; y<tile_y+tile_h; y++)
     {
-        DestroyMedianList(skiplist);
-        skiplist=(MedianPixelList *) NULL;
+        // move each column histogram one row down
+        const uchar *add_row = src.row<uchar>(MIN(y+r, h-1));
+        if (y-r-1 >= tile_y-r) {
+            const uchar *sub_row = src.row<uchar>(MAX(y-r-1, 0));
+            for (int j=0; j<n_cols; j++) {
+                uchar v = sub_row[col_x[j]];
+                cols[j].coarse[v>>4]--;
+                cols[j].fine[v]--;
+            }
+        }
+        for (int j=0; j<n_cols; j++) {
+            uchar v = add_row[col_x[j]];
+            cols[j].coarse[v>>4]++;
+            cols[j].fine[v]++;
+        }
+        // kernel histogram of first pixel of the row
+        unsigned int coarse[16] = {};
+        unsigned int fine[256] = {};
+        int fine_pos[16];// fine bins of segment i are valid for kernel at fine_pos[i]
+        for (int j=0; j<=2*r; j++)
+            add_column(coarse, cols[j].coarse, 16);
+        for (int i=0; i<16; i++)
+            fine_pos[i] = -1;
+
+        uchar *dst_row = dst.row<uchar>(y);
+        for (int x=0; x<tile_w; x++)
+        {
+            // columns x to x+2r are in the kernel
+            if (x > 0) {
+                add_column(coarse, cols[x+2*r].coarse, 16);
+                sub_column(coarse, cols[x-1].coarse, 16);
+            }
+            // find the coarse bin containing the median
+            int k = 0, sum = 0;
+            while (sum + (int)coarse[k] <= center)
+                sum += coarse[k++];
+            // update fine bins of this segment
+            unsigned int *seg = fine + 16*k;
+            if (fine_pos[k] < 0 or x - fine_pos[k] > 2*r) {
+                memset(seg, 0, 16*sizeof(unsigned int));
+                for (int j=x; j<=x+2*r; j++)
+                    add_column(seg, cols[j].fine + 16*k, 16);
+            }
+            else {
+                for (int j=fine_pos[k]; j<x; j++) {
+                    sub_column(seg, cols[j].fine + 16*k, 16);
+                    add_column(seg, cols[j+2*r+1].fine + 16*k, 16);
+                }
+            }
+            fine_pos[k] = x;
+            // find the median in fine bins
+            int b = 0;
+            while ((sum += seg[b]) <= center)
+                b++;
+            dst_row[4*(tile_x+x)+channel] = 16*k + b;
+        }
     }
-    return skiplist;
 }
 
-QRgb GetMedian(MedianPixelList *pixel_list)
+void medianFilter(QImage &img, int radius)
 {
-    MedianSkipList list=pixel_list->list;
-
-    unsigned int center,color,count;
-
-    // Finds the median value
-    center = pixel_list->center;
-    color = 256;
-    count = 0;
-    do
+    toRgbFormat(img);
+    if (radius==1)
+        return median3x3(img);
+    int w = img.width();
+    int h = img.height();
+    QImage dst(w, h, img.format());
+    // tiles are much taller than the kernel, so that filling the column
+    // histograms takes small time compared to filtering
+    int tile_h = MAX(MEDIAN_TILE_H, 4*(2*radius+1));
+    int tiles_x = (w + MEDIAN_TILE_W - 1)/MEDIAN_TILE_W;
+    int tiles_y = (h + tile_h - 1)/tile_h;
+    ImageView src_view = constView(img);
+    ImageView dst_view(dst);
+
+    #pragma omp parallel
     {
-        color = list.nodes[color].next[0];
-        count += list.nodes[color].count;
+        ColumnHistogram *cols = (ColumnHistogram*) malloc(
+                                    (MEDIAN_TILE_W + 2*radius)*sizeof(ColumnHistogram));
+        #pragma omp for schedule(dynamic)
+        for (int tile=0; tile<tiles_x*tiles_y; tile++)
+        {
+            int tile_x = (tile % tiles_x) * MEDIAN_TILE_W;
+            int tile_y = (tile / tiles_x) * tile_h;
+            int tile_w = MIN(MEDIAN_TILE_W, w - tile_x);
+            int tile_hh = MIN(tile_h, h - tile_y);
+            for (int channel=0; channel<4; channel++)
+                median_filter_tile(src_view, dst_view, channel, radius, tile_x, tile_y,
+                                    tile_w, tile_hh, cols);
+        }
+        free(cols);
     }
-    while (count <= center);
-    return color;
+    img = dst;
 }
 
+//*********---------- Guided Filter ---------**********//
+// Edge preserving smoothing by guided filter (He et al, "Guided Image Filtering",
+// 2010), where each channel is its own guide. In each window output is a*I + b,
+// where a = var/(var + eps) and b = (1-a)*mean. So flat areas (var << eps)
+// are smoothed, while edges (var >> eps) are kept. All means are box filters
+// calculated with running sums, so time does not depend on radius.
+// Image is processed in bands of rows, with 2*radius extra rows on each side,
+// so that each thread needs only small buffers.
+#define GUIDED_BAND 64
+
+// box filter mean of rows x w plane, border values are repeated.
+// tmp is of same size as src, and sums is of w size
+static void
+box_mean_band(const float *src, float *dst, float *tmp, float *sums, int w, int rows, int r)
+{
+    float norm = 1.0f/((2*r+1)*(2*r+1));
+    // horizontal running sums of 4 rows together, as independent chains of
+    // additions run in parallel in cpu. last rows are repeated if rows < 4
+    for (int y=0; y<rows; y+=4) {
+        const float *row[4];
+        float *out[4];
+        float sum[4];
+        for (int k=0; k<4; k++) {
+            row[k] = src + MIN(y+k, rows-1)*w;
+            out[k] = tmp + MIN(y+k, rows-1)*w;
+            sum[k] = 0;
+            for (int x=-r; x<=r; x++)
+                sum[k] += row[k][clamp(x, 0, w-1)];
+            out[k][0] = sum[k];
+        }
+        for (int x=1; x<w; x++) {
+            int add = MIN(x+r, w-1), sub = MAX(x-r-1, 0);
+            for (int k=0; k<4; k++) {
+                sum[k] += row[k][add] - row[k][sub];
+                out[k][x] = sum[k];
+            }
+        }
+    }
+    // vertical running sums of all columns together
+    memset(sums, 0, w*sizeof(float));
+    for (int y=-r; y<=r; y++) {
+        const float *row = tmp + clamp(y, 0, rows-1)*w;
+        #pragma omp simd
+        for (int x=0; x<w; x++)
+            sums[x] += row[x];
+    }
+    for (int y=0; y<rows; y++) {
+        if (y > 0) {
+            const float *add = tmp + MIN(y+r, rows-1)*w;
+            const float *sub = tmp + MAX(y-r-1, 0)*w;
+            #pragma omp simd
+            for (int x=0; x<w; x++)
+                sums[x] += add[x] - sub[x];
+        }
+        float *out = dst + y*w;
+        #pragma omp simd
+        for (int x=0; x<w; x++)
+            out[x] = sums[x]*norm;
+    }
+}
 
-void medianFilter(QImage &img, int radius)
+void guidedFilter(QImage &img, int radius, float eps)
 {
+    toGrayOrRgbFormat(img);
     int w = img.width();
     int h = img.height();
-    QImage tmp = expandBorder(img, radius);
-    int tmp_w = tmp.width();
-
-    uchar *data = (uchar*)img.scanLine(0);
-    uchar *tmpData = (uchar*)tmp.constScanLine(0);
-
-    #pragma omp parallel for
-    for (int channel=0; channel<4; channel++) {
-        MedianPixelList *skiplist = AllocateMedianList(2*radius+1);
-
-        for (int y=0; y < h; y++)
+    int r = MAX(radius, 1);
+    bool gray = img.format()==QImage::Format_Grayscale8;
+    int chans = gray ? 1 : 3;
+    int channels[3] = {CHANNEL_R, CHANNEL_G, CHANNEL_B};
+    if (gray)
+        channels[0] = 0;
+    int bpp = gray ? 1 : 4;
+    int halo = 2*r;
+    int band_h = MAX(GUIDED_BAND, 2*halo);
+    int band_count = (h + band_h - 1)/band_h;
+    // halo rows of a band are read from the copy, as other bands modify them
+    const QImage src = img.copy();
+    ImageView src_view = constView(src);
+    ImageView view(img);
+
+    #pragma omp parallel
+    {
+        size_t plane = (size_t)(band_h + 2*halo)*w;
+        float *buf = (float*) malloc((5*plane + w)*sizeof(float));
+        float *I = buf, *A = I + plane, *B = A + plane, *T = B + plane;
+        float *tmp = T + plane, *sums = tmp + plane;
+        #pragma omp for
+        for (int band=0; band<band_count; band++)
         {
-            uchar *row = data + (y*w*4);
-            for (int x=0; x < w; x++)
-            {
-                ResetMedianList(skiplist);
-                for (int i=y-radius; i <= y+radius; i++)
-                {
-                    uchar *tmpRow = tmpData + ((i+radius)*tmp_w*4);
-                    for (int j=x-radius; j<=x+radius; j++)
-                        InsertMedianList(skiplist, tmpRow[4*(j+radius)+channel]);
+            int y0 = band*band_h;
+            int out_rows = MIN(band_h, h-y0);
+            int rows = out_rows + 2*halo;
+            int n = rows*w;
+            for (int k=0; k<chans; k++) {
+                int ch = channels[k];
+                for (int i=0; i<rows; i++) {
+                    const uchar *row = src_view.row<uchar>(clamp(y0-halo+i, 0, h-1));
+                    float *dst = I + i*w;
+                    for (int x=0; x<w; x++)
+                        dst[x] = row[x*bpp+ch]*(1.0f/255);
+                }
+                box_mean_band(I, A, tmp, sums, w, rows, r);// mean of I
+                #pragma omp simd
+                for (int i=0; i<n; i++)
+                    T[i] = I[i]*I[i];
+                box_mean_band(T, B, tmp, sums, w, rows, r);// mean of I*I
+                #pragma omp simd
+                for (int i=0; i<n; i++) {
+                    float var = B[i] - A[i]*A[i];
+                    var = var > 0 ? var : 0;
+                    float a = var/(var + eps);
+                    T[i] = a;
+                    A[i] = (1-a)*A[i];// b
+                }
+                box_mean_band(T, B, tmp, sums, w, rows, r);// mean of a
+                box_mean_band(A, T, tmp, sums, w, rows, r);// mean of b
+                for (int i=0; i<out_rows; i++) {
+                    int offset = (i+halo)*w;
+                    uchar *row = view.row<uchar>(y0+i);
+                    for (int x=0; x<w; x++) {
+                        float q = B[offset+x]*I[offset+x] + T[offset+x];
+                        row[x*bpp+ch] = clamp(q, 0.0f, 1.0f)*255 + 0.5f;
+                    }
                 }
-                row[4*x+channel] = GetMedian(skiplist);
             }
         }
-        DestroyMedianList(skiplist);
+        free(buf);
     }
 }
 
@@ -1398,215 +2195,243 @@ lens_get_source_coord (float       i,// pos in dest image
 }
 
 
-/*
- * Catmull-Rom cubic interpolation
- *
- * equally spaced points p0, p1, p2, p3
- * interpolate u between p1 and p2
- *
- * (1 u u^2 u^3) (  0.0  1.0  0.0  0.0 ) (p0)
- *               ( -0.5  0.0  0.5  0.0 ) (p1)
- *               (  1.0 -2.5  2.0 -0.5 ) (p2)
- *               ( -0.5  1.5 -1.5  0.5 ) (p3)
- */
-// pixel values are in 0-255 range.
-// To use with pixels in 0-1.0 range change only the CLAMP range
+// source positions outside this range of image are clamped, as all 16 pixels
+// used for interpolation are background at those positions
+#define LENS_MAP_MARGIN 4
+// larger images are not stored in map, but calculated row by row while applying
+#define LENS_MAP_MAX_PIXELS (4*1024*1024)
 
+// source positions of pixels of row y, in 24.8 fixed point
 static void
-interpolateCubic (float  *src,// 16 pixels array
-                  float  *dst,// one pixel array
-                  float  dx,
-                  float  dy)
-{
-    float um1, u, up1, up2;
-    float vm1, v, vp1, vp2;
-    int   row_stride = 16;
-    float verts[16];
-
-    um1 = ((-0.5 * dx + 1.0) * dx - 0.5) * dx;
-    u = (1.5 * dx - 2.5) * dx * dx + 1.0;
-    up1 = ((-1.5 * dx + 2.0) * dx + 0.5) * dx;
-    up2 = (0.5 * dx - 0.5) * dx * dx;
-
-    vm1 = ((-0.5 * dy + 1.0) * dy - 0.5) * dy;
-    v = (1.5 * dy - 2.5) * dy * dy + 1.0;
-    vp1 = ((-1.5 * dy + 2.0) * dy + 0.5) * dy;
-    vp2 = (0.5 * dy - 0.5) * dy * dy;
-    // interpolate along y-axis
-    for (int c=0; c < 4*4; ++c)
-    {
-        verts[c] = vm1 * src[c]  +  v * src[c + row_stride] +
-            vp1 * src[c + row_stride * 2]  +  vp2 * src[ c  +  row_stride * 3];
-    }
-    // interpolate along x-axis and put the result in dst buffer
-    for (int c=0; c<4; ++c)
+lens_row_coords(LensValues &lens, int y, int w, int h, int *row)
+{
+    for (int x=0; x<w; x++)
     {
-        float result;
-
-        result = um1 * verts[c]  +  u * verts[c + 4] +
-                up1 * verts[c + 4 * 2]  +  up2 * verts[c + 4 * 3];
-
-        dst[c] = Clamp(result);// 0-255 range
+        float sx, sy;
+        lens_get_source_coord(x, y, sx, sy, lens);
+        sx = clamp(sx, -1.0f*LENS_MAP_MARGIN, float(w + LENS_MAP_MARGIN));
+        sy = clamp(sy, -1.0f*LENS_MAP_MARGIN, float(h + LENS_MAP_MARGIN));
+        row[2*x]   = floorf(sx*256 + 0.5f);
+        row[2*x+1] = floorf(sy*256 + 0.5f);
     }
 }
 
-static void
-lens_distort_pixel(uchar        *src_buf,
-                   uchar        *dst_buf,
-                   Size          img_size,
-                   LensValues   &lens,
-                   int           xx,
-                   int           yy,
-                   uchar        *background)
+LensMap:: LensMap() : coords(NULL), w(0), h(0), main(0), edge(0), zoom(0)
 {
-    float  sx, sy;
-    float  pixel_buffer [16 * 4];// 16 pixels array used for cubic interpolation
-    int    offset = 0;
-
-    lens_get_source_coord (xx, yy, sx, sy, lens);
+}
 
-    int x_int = floor (sx);
-    int y_int = floor (sy);
+LensMap:: ~LensMap()
+{
+    free(coords);
+}
 
-    float dx = sx - x_int;
-    float dy = sy - y_int;
+void
+LensMap:: update(int w, int h, float main, float edge, float zoom)
+{
+    if (w==this->w and h==this->h and main==this->main
+                and edge==this->edge and zoom==this->zoom)
+        return;
+    if (coords and (long long)w*h != (long long)this->w*this->h) {
+        free(coords);
+        coords = NULL;
+    }
+    this->w = w;
+    this->h = h;
+    this->main = main;
+    this->edge = edge;
+    this->zoom = zoom;
+    if ((long long)w*h > LENS_MAP_MAX_PIXELS)
+        return;
+    if (not coords)
+        coords = (int*) malloc(2*w*h*sizeof(int));
+
+    Size img_size = {w, h};
+    LensValues lens = lens_setup_calc(main, edge, zoom, img_size);
+    #pragma omp parallel for
+    for (int y=0; y<h; y++)
+        lens_row_coords(lens, y, w, h, coords + 2*y*w);
+}
 
-    for (int y = y_int-1; y <= y_int+2; y++)
+void
+LensMap:: apply(QImage &img)
+{
+    toRgbFormat(img);
+    QRgb background = 0xffffffff;
+    const QImage src = img.copy();
+    ImageView src_view = constView(src);
+    ImageView view(img);
+    if (coords) {
+        #pragma omp parallel for
+        for (int y=0; y<h; y++) {
+            remapRowCubic(src_view.row(0), w, h, coords + 2*y*w, background, view.row(y), w);
+        }
+        return;
+    }
+    Size img_size = {w, h};
+    LensValues lens = lens_setup_calc(main, edge, zoom, img_size);
+    #pragma omp parallel
     {
-        for (int x = x_int-1; x <= x_int+2; x++)
-        {
-            // if outside image, put background color
-            if (x < 0 || x >=  img_size.width ||
-                y < 0 || y >=  img_size.height )
-            {
-                for (int c=0; c<4; c++)
-                    pixel_buffer[offset++] = background[c];
-            }
-            else
-            {
-                int src_off = (img_size.width * y + x) * 4;
-
-                for (int c=0; c<4; c++)
-                    pixel_buffer[offset++] = src_buf[src_off++];
-            }
+        int *row_coords = (int*) malloc(2*w*sizeof(int));
+        #pragma omp for
+        for (int y=0; y<h; y++) {
+            lens_row_coords(lens, y, w, h, row_coords);
+            remapRowCubic(src_view.row(0), w, h, row_coords, background, view.row(y), w);
         }
+        free(row_coords);
     }
-    float temp[4];
-    interpolateCubic (pixel_buffer, temp, dx, dy);
-
-    offset = (img_size.width * yy + xx) * 4;
-
-    for (int c=0; c<4; c++)
-        dst_buf[offset++] = temp[c];
 }
 
 // default : main=20.0, edge=0, zoom=0
 void lensDistortion (QImage &image, float main, float edge, float zoom)
 {
-    uchar  background[4] = {255, 255, 255, 255};
-
-    Size  img_size = {image.width(), image.height()};
-
-    QImage tmpImg = image.copy();
-    uchar *src_buf = (uchar*) tmpImg.bits();
-
-    uchar *dst_buf = (uchar*) image.bits();
-
-    LensValues lens = lens_setup_calc (main, edge, zoom, img_size);
-
-    #pragma omp parallel for
-    for (int y = 0; y < img_size.height; y++) {
-        for (int x = 0; x < img_size.width; x++)
-        {
-            lens_distort_pixel (src_buf, dst_buf, img_size, lens, x, y, background);
-        }
-    }
+    LensMap lens_map;
+    lens_map.update(image.width(), image.height(), main, edge, zoom);
+    lens_map.apply(image);
 }
 
 
 // *********** ------------ Vignette Filter -------------************
-// darken the outside of the image in a radial gradient
+// darken the outside of the image in a radial gradient.
+// Distance from centre is measured in fraction of width and height, so the gradient
+// is elliptical for non-square image. Brightness is unchanged upto distance
+// 0.4*radius, then decreases linearly, and is reduced by 'strength' at 'radius'.
 
-void vignette (QImage &img)
+void vignette (QImage &img, float strength, float radius)
 {
+    toRgbFormat(img);
     int w = img.width();
     int h = img.height();
-
-    int grad_w = MIN(w,h);
-    QImage gradImg(grad_w,grad_w, QImage::Format_RGB32);
-    QRadialGradient radialGrad(grad_w/2,  grad_w/2, 0.75*grad_w);
-    radialGrad.setColorAt(0, Qt::white);
-    //radialGrad.setColorAt(0.2, Qt::white);
-    radialGrad.setColorAt(1.0, Qt::black);
-    QBrush brush(radialGrad);
-    QPainter painter(&gradImg);
-    painter.setPen(Qt::NoPen);
-    painter.setBrush(brush);
-    painter.drawRect(0,0, img.width()-1, img.height()-1);
-    painter.end();
-    gradImg = gradImg.scaled(w,h, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
-    levelImage(gradImg, 0, 0.6);
-    // use gradient image as alpha channel and
-    // compose the main image against black background
+    radius = MAX(radius, 0.01f);
+    float inner = 0.4f*radius;
+    // distance is separable, squared horizontal distance is same for all rows
+    float *dx2 = (float*) malloc(w*sizeof(float));
+    for (int x=0; x<w; x++) {
+        float dx = (x+0.5f)/w - 0.5f;
+        dx2[x] = dx*dx;
+    }
+    // compose the image against black background using gradient as alpha
+    ImageView view(img);
     #pragma omp parallel for
     for (int y=0; y<h; y++)
     {
-        QRgb *row, *gradRow;
-        #pragma omp critical
-        { row = (QRgb*) img.scanLine(y);
-          gradRow = (QRgb*) gradImg.constScanLine(y);
-        }
+        float dy = (y+0.5f)/h - 0.5f;
+        float dy2 = dy*dy;
+        QRgb *row = view.row(y);
         for (int x=0; x<w; x++) {
-            float alpha = qRed(gradRow[x])/255.0;
+            float dist = sqrtf(dx2[x] + dy2);
+            float alpha = clamp((radius - dist)/(radius - inner), 0.0f, 1.0f);
+            alpha = 1.0f - strength*(1.0f - alpha);
             int r = alpha*qRed(row[x]);// + (1.0-alpha)*bg_r where bg_r=0
             int g = alpha*qGreen(row[x]);
             int b = alpha*qBlue(row[x]);
             row[x] = qRgb(r,g,b);
         }
     }
+    free(dx2);
 }
 
 
 // *********** ------------ Pencil Sketch -------------************
 
+// Luma is calculated once into a plane, which gives the Bradley threshold (like
+// adaptiveThreshold()) for strokes, and the bottom layer of color dodge blend for
+// shades. The top layer is the inverted luma plane, box blurred.
+// width of column strips processed by each thread in vertical pass of box blur
+#define SKETCH_STRIP 256
+
 void pencilSketch(QImage &img)
 {
-    QImage threshImg = img.copy();
-    int win_size = MAX(8, img.width()/50);
-    adaptiveThreshold(threshImg, 0.15, win_size);
-
-    grayScale(img);
-    QImage topImg = img.copy();
-    invert(topImg);
-    boxFilter(topImg, img.width()/20);
-
+    toRgbFormat(img);
+    int w = img.width();
+    int h = img.height();
+    int r = w/20;
+    int kernel_w = 2*r + 1;
+    ImageView view(img);
+    uchar *gray = (uchar*) malloc(w*h);
+    uchar *top = (uchar*) malloc(w*h);
+    // luma plane, and inverted luma blurred left to right
     #pragma omp parallel for
-    for (int y=0; y<img.height(); y++) {
-        QRgb *line, *top_line, *thresh_line;
-        #pragma omp critical
+    for (int y=0; y<h; y++) {
+        QRgb *line = view.row(y);
+        uchar *gray_line = gray + y*w;
+        uchar *top_line = top + y*w;
+        for (int x=0; x<w; x++)
+            gray_line[x] = rgb_to_Y(qRed(line[x]), qGreen(line[x]), qBlue(line[x]));
+        int sum = 0;
+        for (int x=-r; x<=r; x++)
+            sum += 255 - gray_line[clamp(x, 0, w-1)];
+        top_line[0] = sum/kernel_w;
+        for (int x=1; x<w; x++) {
+            sum += gray_line[MAX(x-r-1, 0)] - gray_line[MIN(x+r, w-1)];
+            top_line[x] = sum/kernel_w;
+        }
+    }
+    // blur top layer from top to bottom, a strip of columns at a time. the row
+    // leaving the window is already overwritten, it is taken from ring of r+1 rows
+    int strip_count = (w + SKETCH_STRIP - 1)/SKETCH_STRIP;
+    #pragma omp parallel
+    {
+        uchar *ring = (uchar*) malloc((r+1)*SKETCH_STRIP);
+        #pragma omp for
+        for (int strip=0; strip<strip_count; strip++)
         {
-          line = (QRgb*)img.scanLine(y);// grayscale image line
-          top_line = (QRgb*)topImg.scanLine(y);// grayed, inverted and blurred image
-          thresh_line = (QRgb*)threshImg.scanLine(y);
+            int x0 = strip*SKETCH_STRIP;
+            int strip_w = MIN(SKETCH_STRIP, w-x0);
+            int sums[SKETCH_STRIP] = {};
+            uchar *col = top + x0;
+            for (int y=-r; y<=r; y++) {
+                const uchar *row = col + clamp(y, 0, h-1)*w;
+                for (int x=0; x<strip_w; x++)
+                    sums[x] += row[x];
+            }
+            for (int y=0; y<h; y++) {
+                uchar *out = col + y*w;
+                if (y > 0) {
+                    const uchar *add = col + MIN(y+r, h-1)*w;
+                    const uchar *sub = ring + (MAX(y-r-1, 0)%(r+1))*SKETCH_STRIP;
+                    for (int x=0; x<strip_w; x++)
+                        sums[x] += add[x] - sub[x];
+                }
+                memcpy(ring + (y%(r+1))*SKETCH_STRIP, out, strip_w);
+                for (int x=0; x<strip_w; x++)
+                    out[x] = sums[x]/kernel_w;
+            }
         }
-        for (int val, x=0; x<img.width(); x++)
+        free(ring);
+    }
+    IntegralImage intImg(gray, w, h);
+
+    float T = 0.15;
+    int s2 = MAX(8, w/50)/2;
+    #pragma omp parallel for
+    for (int y=0; y<h; y++) {
+        QRgb *line = view.row(y);
+        const uchar *gray_line = gray + y*w;
+        const uchar *top_line = top + y*w;
+        int y1 = MAX(y - s2, 0);
+        int y2 = MIN(y + s2, h-1);
+        for (int x=0; x<w; x++)
         {
-            if (qRed(thresh_line[x])==0) {// draw strokes
+            int x1 = MAX(x - s2, 0);
+            int x2 = MIN(x + s2, w-1);
+            // Bradley threshold, pixel is darker than mean*(1 - T) of window
+            int count = (x2 - x1)*(y2 - y1);
+            unsigned int sum = intImg.sum(x1+1, y1+1, x2+1, y2+1);
+            int back = gray_line[x];
+            int val = back;
+            if ((back * count) < (int)(sum*(1.0 - T))) {// draw strokes
                 val = 100;// pencil strokes are not full dark
             }
-            else {// draw shades
-                // blend topImg and img using color dodge blend
+            else if (back!=255 && top_line[x]!=0) {// draw shades
+                // blend top layer and grayscale image using color dodge blend
                 // i.e divide the top layer by inverted bottom layer
-                int back = qRed(line[x]);
-                int top = qRed(top_line[x]);
-
-                if (back==255 || top==0)
-                    continue;
-                val = MIN(255, (255*top)/(255-back));
+                val = MIN(255, (255*top_line[x])/(255-back));
             }
             line[x] = qRgba(val,val,val, qAlpha(line[x]));
         }
     }
+    free(gray);
+    free(top);
 }
 
 
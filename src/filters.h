@@ -1,29 +1,60 @@
 #pragma once
 #include <QImage>
+/* Filters accept image of any format. grayScale() and threshold filters keep
+  Grayscale8 images, and give Grayscale8 or Mono images respectively, if the
+  image is opaque. Other filters convert the image to RGB32 or ARGB32.
+*/
 
 // Convert image to grayscale
 void grayScale(QImage &img);
 
 // Calculate otsu threshold value
-int calcOtsuThresh(QImage img);
+int calcOtsuThresh(const QImage &img);
+
+// Calculate thresholds that divide image into given number of classes (2 to 4)
+// using multi-level otsu method. thresh must have room for classes-1 values,
+// which are ascending. Pixels with gray value <= thresh[0] are first class.
+#define MULTI_OTSU_MAX_CLASSES 4
+void calcMultiOtsuThresh(const QImage &img, int classes, int *thresh);
 
 // Apply threshold for given global threshold value
 void threshold(QImage &img, int thresh);
 
+// Apply multiple thresholds (1 to 3), each class gets an evenly spaced gray level
+void multiThreshold(QImage &img, const int *thresh, int count);
+
 // Apply adaptive integral threshold using bradley's method
 void adaptiveThreshold(QImage &img, float T=0.15, int window_size=0);
 
+// Morphological filters. Time does not depend on radius. Structuring element is
+// a square of (2*radius+1) width, or a disc approximated by rectangles.
+// Erosion spreads darker pixels, dilation spreads brighter pixels.
+enum { MORPH_RECT, MORPH_DISC };
+void erode(QImage &img, int radius=1, int shape=MORPH_RECT);
+void dilate(QImage &img, int radius=1, int shape=MORPH_RECT);
+// opening (erosion then dilation) removes bright specks smaller than the element
+void morphologicalOpen(QImage &img, int radius=1, int shape=MORPH_RECT);
+// closing (dilation then erosion) removes dark specks, e.g dust in scanned pages
+void morphologicalClose(QImage &img, int radius=1, int shape=MORPH_RECT);
+
 // Gaussian Blur
 void gaussianBlur(QImage &img, int radius=1, float sigma=0);
 
+// Gaussian Blur using recursive filter, time does not depend on sigma
+void recursiveGaussianBlur(QImage &img, float sigma);
+
 // Apply Box Blur
 void boxFilter(QImage &img, int radius=1);
 
 // Apply Median Filter (Remove salt and pepper noise)
 void medianFilter(QImage &img, int radius=1);
 
+// Edge preserving smoothing (remove gaussian noise) using guided filter.
+// eps is in 0-1.0 range, details with variance lower than eps are smoothed
+void guidedFilter(QImage &img, int radius=4, float eps=0.005);
+
 // Sharpen by Unsharp masking
-void unsharpMask(QImage &img, float factor=1.0, int thresh=5);
+void unsharpMask(QImage &img, float factor=1.0, int thresh=5, int radius=1, bool gaussian=false);
 
 // remove speckle noise using crimmins speckle removal
 void despeckle(QImage &img);
@@ -56,8 +87,54 @@ void enhanceColor(QImage &img);
 // Correct Lens Distortion
 void lensDistortion(QImage &image, float main, float edge, float zoom);
 
+// Source position of each pixel of lens distortion corrected image. It is
+// recalculated only when image size or parameters change, so that it can be
+// reused for previews of same size image. Large images are not stored, their
+// positions are calculated row by row while applying.
+class LensMap
+{
+public:
+    LensMap();
+    ~LensMap();
+    // recalculates the map if size or any parameter is changed
+    void update(int w, int h, float main, float edge, float zoom);
+    // image must be of same size as the map
+    void apply(QImage &img);
+private:
+    LensMap(const LensMap&);// not copyable
+    LensMap& operator=(const LensMap&);
+    int *coords;// x and y of source position in 24.8 fixed point, or NULL
+    int w, h;
+    float main, edge, zoom;
+};
+
 // Vignette filter : darken edges in radial gradient
-void vignette(QImage &img);
+// strength = 0 -> 1.0, radius (where darkening is full) is in fraction of image size
+void vignette(QImage &img, float strength=1.0, float radius=0.75);
+
+// A chain of point operations (operations that map each channel value to
+// a new value). All are composed into lookup tables, and applied in one pass.
+// e.g PointOps().level(0.1, 0.9).gamma(1.6).sigmoidalContrast(0.5).apply(img);
+class PointOps
+{
+public:
+    PointOps();
+    PointOps& gamma(float gamma);
+    PointOps& sigmoidalContrast(float midpoint);
+    PointOps& levelChannel(int channel, float black_pt, float white_pt,
+                                        float out_black, float out_white);
+    PointOps& level(float black_pt, float white_pt);
+    PointOps& invert();
+    // converts to black and white, following operations apply on the result
+    PointOps& threshold(int thresh);
+    void apply(QImage &img);
+private:
+    void map(int channel, const uchar *table);
+    // one table for each byte of pixel in memory order
+    uchar lut[4][256];
+    uchar post_lut[4][256];// applied after threshold
+    int thresh;// -1 if no threshold
+};
 
 // Pencil Sketch effect
 void pencilSketch(QImage &img);
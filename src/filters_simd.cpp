@@ -0,0 +1,850 @@
+// this file is part of photoquick program which is GPLv3 licensed
+#include "filters_simd.h"
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define SIMD_X86
+  #include <immintrin.h>
+  #define TARGET_SSE2 __attribute__((target("sse2")))
+  #define TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(__aarch64__)
+  #define SIMD_NEON
+#elif defined(__arm__) && defined(__ARM_PCS_VFP) && defined(__GNUC__) && !defined(__clang__)
+  // armhf is built without neon by default. only the NEON section below is
+  // compiled with neon, and it is used if the cpu supports it
+  #define SIMD_NEON
+  #define SIMD_NEON_ARMHF
+  #include <sys/auxv.h>
+  #ifndef HWCAP_NEON
+  #define HWCAP_NEON (1 << 12)
+  #endif
+#endif
+
+typedef unsigned char uchar;
+
+// ------------------------ Plain C versions ---------------------------
+
+static void convolveRow_c(const QRgb **taps, const float *kernel, int kernel_w, QRgb *dst, int n)
+{
+    const QRgb *center = taps[kernel_w/2];
+    for (int x=0; x < n; x++)
+    {
+        float r=0, g=0, b=0;
+        for (int i=0; i < kernel_w; i++)
+        {
+            QRgb clr = taps[i][x];
+            r += kernel[i] * qRed(clr);
+            g += kernel[i] * qGreen(clr);
+            b += kernel[i] * qBlue(clr);
+        }
+        dst[x] = qRgba(round(r), round(g), round(b), qAlpha(center[x]));
+    }
+}
+
+static void boxBlurRow_c(const QRgb *src, int r, QRgb *dst, int n)
+{
+    int kernel_w = 2*r + 1;
+    int sum_r = 0, sum_g = 0, sum_b = 0;
+    for (int x=0; x<kernel_w; x++) {
+        QRgb clr = src[x];
+        sum_r += qRed(clr); sum_g += qGreen(clr); sum_b += qBlue(clr);
+    }
+    dst[0] = qRgba(sum_r/kernel_w, sum_g/kernel_w, sum_b/kernel_w, qAlpha(src[r]));
+
+    for (int x=1; x<n; x++) {
+        QRgb left = src[x-1];
+        QRgb right = src[x+r+r];
+        sum_r += qRed(right) - qRed(left);
+        sum_g += qGreen(right) - qGreen(left);
+        sum_b += qBlue(right) - qBlue(left);
+        dst[x] = qRgba(sum_r/kernel_w, sum_g/kernel_w, sum_b/kernel_w, qAlpha(src[x+r]));
+    }
+}
+
+static void boxAccumulateRow_c(int *sums, const QRgb *add, const QRgb *sub, int n)
+{
+    const uchar *a = (const uchar*) add;
+    const uchar *s = (const uchar*) sub;
+    if (sub==NULL) {
+        for (int i=0; i<4*n; i++)
+            sums[i] += a[i];
+        return;
+    }
+    for (int i=0; i<4*n; i++)
+        sums[i] += a[i] - s[i];
+}
+
+static void boxDivideRow_c(const int *sums, int count, const QRgb *alpha_src, QRgb *dst, int n)
+{
+    for (int x=0; x<n; x++) {
+        uchar bytes[4];
+        for (int k=0; k<4; k++)
+            bytes[k] = sums[4*x+k]/count;
+        QRgb clr;
+        memcpy(&clr, bytes, 4);
+        dst[x] = (clr & 0x00ffffffu) | (alpha_src[x] & 0xff000000u);
+    }
+}
+
+static void hullRow_c(const uchar *src, const uchar *cmp2, const uchar *cmp1, uchar *dst,
+                      int polarity, int n)
+{
+    for (int x=0; x<n; x++)
+    {
+        int v = src[x];
+        int d2 = polarity > 0 ? cmp2[x] - v : v - cmp2[x];
+        int d1 = cmp1==NULL ? 1 : (polarity > 0 ? cmp1[x] - v : v - cmp1[x]);
+        if (d2 >= 2 && d1 >= 1)
+            v += polarity > 0 ? 1 : -1;
+        dst[x] = v;
+    }
+}
+
+// Catmull-Rom weights of 4 pixels for each 1/256 fraction of position
+typedef struct CubicWeights {
+    float w[256][4];
+    CubicWeights() {
+        for (int i=0; i<256; i++) {
+            double d = i/256.0;
+            w[i][0] = ((-0.5 * d + 1.0) * d - 0.5) * d;
+            w[i][1] = (1.5 * d - 2.5) * d * d + 1.0;
+            w[i][2] = ((-1.5 * d + 2.0) * d + 0.5) * d;
+            w[i][3] = (0.5 * d - 0.5) * d * d;
+        }
+    }
+} CubicWeights;
+
+static const CubicWeights& cubicWeights()
+{
+    static const CubicWeights weights;
+    return weights;
+}
+
+// interpolates one pixel, checking each of 16 pixels whether inside image
+static QRgb remapPixelCubic_c(const QRgb *src, int src_w, int src_h, int sx, int sy,
+                              QRgb background)
+{
+    const float *wx = cubicWeights().w[sx & 255];
+    const float *wy = cubicWeights().w[sy & 255];
+    int x0 = (sx >> 8) - 1;
+    int y0 = (sy >> 8) - 1;
+    float sum[4] = {0, 0, 0, 0};
+    for (int j=0; j<4; j++)
+    {
+        int y = y0 + j;
+        float row[4] = {0, 0, 0, 0};
+        for (int k=0; k<4; k++) {
+            int x = x0 + k;
+            QRgb clr = (x < 0 || x >= src_w || y < 0 || y >= src_h) ? background
+                                                                     : src[y*src_w + x];
+            uchar bytes[4];
+            memcpy(bytes, &clr, 4);
+            for (int c=0; c<4; c++)
+                row[c] += wx[k] * bytes[c];
+        }
+        for (int c=0; c<4; c++)
+            sum[c] += wy[j] * row[c];
+    }
+    uchar bytes[4];
+    for (int c=0; c<4; c++) {
+        int val = sum[c];
+        bytes[c] = val < 0 ? 0 : (val > 255 ? 255 : val);
+    }
+    QRgb clr;
+    memcpy(&clr, bytes, 4);
+    return clr;
+}
+
+static void remapRowCubic_c(const QRgb *src, int src_w, int src_h, const int *coords,
+                            QRgb background, QRgb *dst, int n)
+{
+    for (int x=0; x<n; x++)
+        dst[x] = remapPixelCubic_c(src, src_w, src_h, coords[2*x], coords[2*x+1], background);
+}
+
+/* To be bit-identical with plain C versions, the SIMD versions follow these rules
+ - float sums are calculated in same order, and multiply and add are not fused.
+ - round() rounds half away from zero, so truncated value is adjusted by the
+   fractional part (which is exact) instead of using round-to-nearest-even.
+ - results are masked with 0xff like qRgba() does, instead of saturating.
+ - integer division is done by multiplying with reciprocal, and then the quotient
+   is corrected by +/-1. This is exact as long as sums are less than 2^24.
+*/
+#define MAX_EXACT_DIVISOR 65535
+
+// ---------------------------- SSE2 ----------------------------------
+#ifdef SIMD_X86
+
+// round half away from zero, and keep the lowest byte
+TARGET_SSE2 static inline __m128i
+round_to_byte_sse2(__m128 v)
+{
+    __m128i t = _mm_cvttps_epi32(v);
+    __m128 frac = _mm_sub_ps(v, _mm_cvtepi32_ps(t));
+    // comparison results are -1 when true
+    t = _mm_sub_epi32(t, _mm_castps_si128(_mm_cmpge_ps(frac, _mm_set1_ps(0.5f))));
+    t = _mm_add_epi32(t, _mm_castps_si128(_mm_cmple_ps(frac, _mm_set1_ps(-0.5f))));
+    return _mm_and_si128(t, _mm_set1_epi32(0xff));
+}
+
+// exact quotient of non-negative integers less than 2^24, lowest byte is kept
+TARGET_SSE2 static inline __m128i
+divide_sse2(__m128i sum, __m128 divisor, __m128 inv_divisor)
+{
+    __m128 s = _mm_cvtepi32_ps(sum);
+    __m128 q = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(s, inv_divisor)));
+    __m128 prod = _mm_mul_ps(q, divisor);
+    __m128i qi = _mm_cvttps_epi32(q);
+    qi = _mm_add_epi32(qi, _mm_castps_si128(_mm_cmpgt_ps(prod, s)));
+    qi = _mm_sub_epi32(qi, _mm_castps_si128(_mm_cmple_ps(_mm_add_ps(prod, divisor), s)));
+    return _mm_and_si128(qi, _mm_set1_epi32(0xff));
+}
+
+// pack 4 vectors of 4 bytes each (in lower byte of each 32 bit lane) to 4 pixels
+TARGET_SSE2 static inline __m128i
+pack_pixels_sse2(__m128i p0, __m128i p1, __m128i p2, __m128i p3)
+{
+    return _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3));
+}
+
+// replace alpha of pixels by alpha of alpha_src pixels
+TARGET_SSE2 static inline __m128i
+copy_alpha_sse2(__m128i pixels, __m128i alpha_src)
+{
+    __m128i alpha_mask = _mm_set1_epi32(0xff000000);
+    return _mm_or_si128(_mm_andnot_si128(alpha_mask, pixels), _mm_and_si128(alpha_mask, alpha_src));
+}
+
+TARGET_SSE2 static void
+convolveRow_sse2(const QRgb **taps, const float *kernel, int kernel_w, QRgb *dst, int n)
+{
+    const QRgb *center = taps[kernel_w/2];
+    __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    for (; x+4 <= n; x+=4)
+    {
+        // one accumulator per pixel, each has 4 channels
+        __m128 acc0 = _mm_setzero_ps(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+        for (int i=0; i < kernel_w; i++)
+        {
+            __m128 k = _mm_set1_ps(kernel[i]);
+            __m128i px = _mm_loadu_si128((const __m128i*)(taps[i]+x));
+            __m128i lo = _mm_unpacklo_epi8(px, zero);
+            __m128i hi = _mm_unpackhi_epi8(px, zero);
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(k, _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero))));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(k, _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero))));
+            acc2 = _mm_add_ps(acc2, _mm_mul_ps(k, _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero))));
+            acc3 = _mm_add_ps(acc3, _mm_mul_ps(k, _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero))));
+        }
+        __m128i pixels = pack_pixels_sse2(round_to_byte_sse2(acc0), round_to_byte_sse2(acc1),
+                                          round_to_byte_sse2(acc2), round_to_byte_sse2(acc3));
+        pixels = copy_alpha_sse2(pixels, _mm_loadu_si128((const __m128i*)(center+x)));
+        _mm_storeu_si128((__m128i*)(dst+x), pixels);
+    }
+    if (x < n) {
+        const QRgb *rest[kernel_w];
+        for (int i=0; i < kernel_w; i++)
+            rest[i] = taps[i] + x;
+        convolveRow_c(rest, kernel, kernel_w, dst+x, n-x);
+    }
+}
+
+TARGET_SSE2 static void
+boxBlurRow_sse2(const QRgb *src, int r, QRgb *dst, int n)
+{
+    int kernel_w = 2*r + 1;
+    if (kernel_w > MAX_EXACT_DIVISOR)
+        return boxBlurRow_c(src, r, dst, n);
+    __m128i zero = _mm_setzero_si128();
+    __m128 divisor = _mm_set1_ps(kernel_w);
+    __m128 inv_divisor = _mm_set1_ps(1.0f/kernel_w);
+    // the 4 channels of a pixel are summed in the 4 lanes
+    __m128i sum = zero;
+    for (int x=0; x<kernel_w; x++) {
+        __m128i px = _mm_unpacklo_epi8(_mm_cvtsi32_si128(src[x]), zero);
+        sum = _mm_add_epi32(sum, _mm_unpacklo_epi16(px, zero));
+    }
+    for (int x=0; x<n; x++) {
+        if (x > 0) {
+            __m128i px = _mm_unpacklo_epi8(_mm_cvtsi32_si128(src[x+r+r]), zero);
+            px = _mm_sub_epi16(px, _mm_unpacklo_epi8(_mm_cvtsi32_si128(src[x-1]), zero));
+            // sign extend 16 bit difference
+            sum = _mm_add_epi32(sum, _mm_srai_epi32(_mm_unpacklo_epi16(px, px), 16));
+        }
+        __m128i q = divide_sse2(sum, divisor, inv_divisor);
+        q = _mm_packus_epi16(_mm_packs_epi32(q, q), zero);
+        QRgb clr = _mm_cvtsi128_si32(q);
+        dst[x] = (clr & 0x00ffffffu) | (src[x+r] & 0xff000000u);
+    }
+}
+
+TARGET_SSE2 static void
+boxAccumulateRow_sse2(int *sums, const QRgb *add, const QRgb *sub, int n)
+{
+    __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    for (; x+4 <= n; x+=4)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(add+x));
+        __m128i lo = _mm_unpacklo_epi8(a, zero);
+        __m128i hi = _mm_unpackhi_epi8(a, zero);
+        if (sub) {
+            __m128i s = _mm_loadu_si128((const __m128i*)(sub+x));
+            lo = _mm_sub_epi16(lo, _mm_unpacklo_epi8(s, zero));
+            hi = _mm_sub_epi16(hi, _mm_unpackhi_epi8(s, zero));
+        }
+        // sign extend 16 bit differences and add to sums
+        __m128i *dst = (__m128i*)(sums + 4*x);
+        _mm_storeu_si128(dst,   _mm_add_epi32(_mm_loadu_si128(dst),
+                                    _mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16)));
+        _mm_storeu_si128(dst+1, _mm_add_epi32(_mm_loadu_si128(dst+1),
+                                    _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16)));
+        _mm_storeu_si128(dst+2, _mm_add_epi32(_mm_loadu_si128(dst+2),
+                                    _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16)));
+        _mm_storeu_si128(dst+3, _mm_add_epi32(_mm_loadu_si128(dst+3),
+                                    _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16)));
+    }
+    if (x < n)
+        boxAccumulateRow_c(sums+4*x, add+x, sub ? sub+x : NULL, n-x);
+}
+
+TARGET_SSE2 static void
+boxDivideRow_sse2(const int *sums, int count, const QRgb *alpha_src, QRgb *dst, int n)
+{
+    if (count > MAX_EXACT_DIVISOR)
+        return boxDivideRow_c(sums, count, alpha_src, dst, n);
+    __m128 divisor = _mm_set1_ps(count);
+    __m128 inv_divisor = _mm_set1_ps(1.0f/count);
+    int x = 0;
+    for (; x+4 <= n; x+=4)
+    {
+        const __m128i *src = (const __m128i*)(sums + 4*x);
+        __m128i pixels = pack_pixels_sse2(
+                divide_sse2(_mm_loadu_si128(src),   divisor, inv_divisor),
+                divide_sse2(_mm_loadu_si128(src+1), divisor, inv_divisor),
+                divide_sse2(_mm_loadu_si128(src+2), divisor, inv_divisor),
+                divide_sse2(_mm_loadu_si128(src+3), divisor, inv_divisor));
+        pixels = copy_alpha_sse2(pixels, _mm_loadu_si128((const __m128i*)(alpha_src+x)));
+        _mm_storeu_si128((__m128i*)(dst+x), pixels);
+    }
+    if (x < n)
+        boxDivideRow_c(sums+4*x, count, alpha_src+x, dst+x, n-x);
+}
+
+// Differences in hullRow() are calculated with saturating subtraction. The
+// value is changed by min(d2-1, d1, 1), which is 1 only if d2>=2 and d1>=1
+TARGET_SSE2 static void
+hullRow_sse2(const uchar *src, const uchar *cmp2, const uchar *cmp1, uchar *dst,
+             int polarity, int n)
+{
+    __m128i one = _mm_set1_epi8(1);
+    int x = 0;
+    for (; x+16 <= n; x+=16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src+x));
+        __m128i c2 = _mm_loadu_si128((const __m128i*)(cmp2+x));
+        __m128i d2 = polarity > 0 ? _mm_subs_epu8(c2, v) : _mm_subs_epu8(v, c2);
+        __m128i step = _mm_min_epu8(_mm_subs_epu8(d2, one), one);
+        if (cmp1) {
+            __m128i c1 = _mm_loadu_si128((const __m128i*)(cmp1+x));
+            __m128i d1 = polarity > 0 ? _mm_subs_epu8(c1, v) : _mm_subs_epu8(v, c1);
+            step = _mm_min_epu8(step, d1);
+        }
+        v = polarity > 0 ? _mm_adds_epu8(v, step) : _mm_subs_epu8(v, step);
+        _mm_storeu_si128((__m128i*)(dst+x), v);
+    }
+    if (x < n)
+        hullRow_c(src+x, cmp2+x, cmp1 ? cmp1+x : NULL, dst+x, polarity, n-x);
+}
+
+// only the pixels whose all 16 source pixels are inside image are interpolated
+// here, each pixel is one vector of 4 channels
+TARGET_SSE2 static void
+remapRowCubic_sse2(const QRgb *src, int src_w, int src_h, const int *coords,
+                   QRgb background, QRgb *dst, int n)
+{
+    const CubicWeights &weights = cubicWeights();
+    __m128i zero = _mm_setzero_si128();
+    for (int x=0; x<n; x++)
+    {
+        int sx = coords[2*x], sy = coords[2*x+1];
+        int x0 = (sx >> 8) - 1;
+        int y0 = (sy >> 8) - 1;
+        if (x0 < 0 || x0+3 >= src_w || y0 < 0 || y0+3 >= src_h) {
+            dst[x] = remapPixelCubic_c(src, src_w, src_h, sx, sy, background);
+            continue;
+        }
+        const float *wx = weights.w[sx & 255];
+        const float *wy = weights.w[sy & 255];
+        __m128 sum = _mm_setzero_ps();
+        for (int j=0; j<4; j++)
+        {
+            __m128i px = _mm_loadu_si128((const __m128i*)(src + (y0+j)*src_w + x0));
+            __m128i lo = _mm_unpacklo_epi8(px, zero);
+            __m128i hi = _mm_unpackhi_epi8(px, zero);
+            __m128 p0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+            __m128 p1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+            __m128 p2 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+            __m128 p3 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+            __m128 row = _mm_mul_ps(_mm_set1_ps(wx[0]), p0);
+            row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(wx[1]), p1));
+            row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(wx[2]), p2));
+            row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(wx[3]), p3));
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(wy[j]), row));
+        }
+        // truncate and saturate to 0-255
+        __m128i val = _mm_cvttps_epi32(sum);
+        val = _mm_packs_epi32(val, val);
+        val = _mm_packus_epi16(val, val);
+        dst[x] = _mm_cvtsi128_si32(val);
+    }
+}
+
+// ---------------------------- AVX2 ----------------------------------
+
+TARGET_AVX2 static inline __m256i
+round_to_byte_avx2(__m256 v)
+{
+    __m256i t = _mm256_cvttps_epi32(v);
+    __m256 frac = _mm256_sub_ps(v, _mm256_cvtepi32_ps(t));
+    t = _mm256_sub_epi32(t, _mm256_castps_si256(_mm256_cmp_ps(frac, _mm256_set1_ps(0.5f), _CMP_GE_OQ)));
+    t = _mm256_add_epi32(t, _mm256_castps_si256(_mm256_cmp_ps(frac, _mm256_set1_ps(-0.5f), _CMP_LE_OQ)));
+    return _mm256_and_si256(t, _mm256_set1_epi32(0xff));
+}
+
+TARGET_AVX2 static inline __m256i
+divide_avx2(__m256i sum, __m256 divisor, __m256 inv_divisor)
+{
+    __m256 s = _mm256_cvtepi32_ps(sum);
+    __m256 q = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(_mm256_mul_ps(s, inv_divisor)));
+    __m256 prod = _mm256_mul_ps(q, divisor);
+    __m256i qi = _mm256_cvttps_epi32(q);
+    qi = _mm256_add_epi32(qi, _mm256_castps_si256(_mm256_cmp_ps(prod, s, _CMP_GT_OQ)));
+    qi = _mm256_sub_epi32(qi, _mm256_castps_si256(
+                _mm256_cmp_ps(_mm256_add_ps(prod, divisor), s, _CMP_LE_OQ)));
+    return _mm256_and_si256(qi, _mm256_set1_epi32(0xff));
+}
+
+// p0 contains pixels 0 and 1, p1 contains 2 and 3 and so on. Packing works
+// within 128 bit lanes, so the order of pixels is restored by a permute
+TARGET_AVX2 static inline __m256i
+pack_pixels_avx2(__m256i p0, __m256i p1, __m256i p2, __m256i p3)
+{
+    __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(p0, p1), _mm256_packs_epi32(p2, p3));
+    return _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0,4,1,5,2,6,3,7));
+}
+
+TARGET_AVX2 static inline __m256i
+copy_alpha_avx2(__m256i pixels, __m256i alpha_src)
+{
+    __m256i alpha_mask = _mm256_set1_epi32(0xff000000);
+    return _mm256_or_si256(_mm256_andnot_si256(alpha_mask, pixels), _mm256_and_si256(alpha_mask, alpha_src));
+}
+
+// 2 pixels (8 bytes) to 8 ints
+TARGET_AVX2 static inline __m256i
+load_2_pixels_avx2(const QRgb *p)
+{
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)p));
+}
+
+TARGET_AVX2 static void
+convolveRow_avx2(const QRgb **taps, const float *kernel, int kernel_w, QRgb *dst, int n)
+{
+    const QRgb *center = taps[kernel_w/2];
+    int x = 0;
+    for (; x+8 <= n; x+=8)
+    {
+        __m256 acc0 = _mm256_setzero_ps(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+        for (int i=0; i < kernel_w; i++)
+        {
+            __m256 k = _mm256_set1_ps(kernel[i]);
+            const QRgb *src = taps[i] + x;
+            acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(k, _mm256_cvtepi32_ps(load_2_pixels_avx2(src))));
+            acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(k, _mm256_cvtepi32_ps(load_2_pixels_avx2(src+2))));
+            acc2 = _mm256_add_ps(acc2, _mm256_mul_ps(k, _mm256_cvtepi32_ps(load_2_pixels_avx2(src+4))));
+            acc3 = _mm256_add_ps(acc3, _mm256_mul_ps(k, _mm256_cvtepi32_ps(load_2_pixels_avx2(src+6))));
+        }
+        __m256i pixels = pack_pixels_avx2(round_to_byte_avx2(acc0), round_to_byte_avx2(acc1),
+                                          round_to_byte_avx2(acc2), round_to_byte_avx2(acc3));
+        pixels = copy_alpha_avx2(pixels, _mm256_loadu_si256((const __m256i*)(center+x)));
+        _mm256_storeu_si256((__m256i*)(dst+x), pixels);
+    }
+    if (x < n) {
+        const QRgb *rest[kernel_w];
+        for (int i=0; i < kernel_w; i++)
+            rest[i] = taps[i] + x;
+        convolveRow_sse2(rest, kernel, kernel_w, dst+x, n-x);
+    }
+}
+
+TARGET_AVX2 static void
+boxAccumulateRow_avx2(int *sums, const QRgb *add, const QRgb *sub, int n)
+{
+    int x = 0;
+    for (; x+8 <= n; x+=8)
+    {
+        __m256i *dst = (__m256i*)(sums + 4*x);
+        for (int i=0; i<4; i++) {
+            __m256i diff = load_2_pixels_avx2(add+x+2*i);
+            if (sub)
+                diff = _mm256_sub_epi32(diff, load_2_pixels_avx2(sub+x+2*i));
+            _mm256_storeu_si256(dst+i, _mm256_add_epi32(_mm256_loadu_si256(dst+i), diff));
+        }
+    }
+    if (x < n)
+        boxAccumulateRow_sse2(sums+4*x, add+x, sub ? sub+x : NULL, n-x);
+}
+
+TARGET_AVX2 static void
+boxDivideRow_avx2(const int *sums, int count, const QRgb *alpha_src, QRgb *dst, int n)
+{
+    if (count > MAX_EXACT_DIVISOR)
+        return boxDivideRow_c(sums, count, alpha_src, dst, n);
+    __m256 divisor = _mm256_set1_ps(count);
+    __m256 inv_divisor = _mm256_set1_ps(1.0f/count);
+    int x = 0;
+    for (; x+8 <= n; x+=8)
+    {
+        const __m256i *src = (const __m256i*)(sums + 4*x);
+        __m256i pixels = pack_pixels_avx2(
+                divide_avx2(_mm256_loadu_si256(src),   divisor, inv_divisor),
+                divide_avx2(_mm256_loadu_si256(src+1), divisor, inv_divisor),
+                divide_avx2(_mm256_loadu_si256(src+2), divisor, inv_divisor),
+                divide_avx2(_mm256_loadu_si256(src+3), divisor, inv_divisor));
+        pixels = copy_alpha_avx2(pixels, _mm256_loadu_si256((const __m256i*)(alpha_src+x)));
+        _mm256_storeu_si256((__m256i*)(dst+x), pixels);
+    }
+    if (x < n)
+        boxDivideRow_sse2(sums+4*x, count, alpha_src+x, dst+x, n-x);
+}
+
+TARGET_AVX2 static void
+hullRow_avx2(const uchar *src, const uchar *cmp2, const uchar *cmp1, uchar *dst,
+             int polarity, int n)
+{
+    __m256i one = _mm256_set1_epi8(1);
+    int x = 0;
+    for (; x+32 <= n; x+=32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src+x));
+        __m256i c2 = _mm256_loadu_si256((const __m256i*)(cmp2+x));
+        __m256i d2 = polarity > 0 ? _mm256_subs_epu8(c2, v) : _mm256_subs_epu8(v, c2);
+        __m256i step = _mm256_min_epu8(_mm256_subs_epu8(d2, one), one);
+        if (cmp1) {
+            __m256i c1 = _mm256_loadu_si256((const __m256i*)(cmp1+x));
+            __m256i d1 = polarity > 0 ? _mm256_subs_epu8(c1, v) : _mm256_subs_epu8(v, c1);
+            step = _mm256_min_epu8(step, d1);
+        }
+        v = polarity > 0 ? _mm256_adds_epu8(v, step) : _mm256_subs_epu8(v, step);
+        _mm256_storeu_si256((__m256i*)(dst+x), v);
+    }
+    if (x < n)
+        hullRow_sse2(src+x, cmp2+x, cmp1 ? cmp1+x : NULL, dst+x, polarity, n-x);
+}
+
+#endif // SIMD_X86
+
+// ---------------------------- NEON ----------------------------------
+// NEON in 32 bit arm flushes denormals to zero. It does not change the
+// result, as the denormal products are far below the rounding precision
+#ifdef SIMD_NEON
+#ifdef SIMD_NEON_ARMHF
+  #pragma GCC push_options
+  #pragma GCC target("fpu=neon")
+#endif
+#include <arm_neon.h>
+
+static inline uint32x4_t
+round_to_byte_neon(float32x4_t v)
+{
+    int32x4_t t = vcvtq_s32_f32(v);
+    float32x4_t frac = vsubq_f32(v, vcvtq_f32_s32(t));
+    t = vsubq_s32(t, vreinterpretq_s32_u32(vcgeq_f32(frac, vdupq_n_f32(0.5f))));
+    t = vaddq_s32(t, vreinterpretq_s32_u32(vcleq_f32(frac, vdupq_n_f32(-0.5f))));
+    return vandq_u32(vreinterpretq_u32_s32(t), vdupq_n_u32(0xff));
+}
+
+static inline uint32x4_t
+divide_neon(int32x4_t sum, float32x4_t divisor, float32x4_t inv_divisor)
+{
+    float32x4_t s = vcvtq_f32_s32(sum);
+    float32x4_t q = vcvtq_f32_s32(vcvtq_s32_f32(vmulq_f32(s, inv_divisor)));
+    float32x4_t prod = vmulq_f32(q, divisor);
+    int32x4_t qi = vcvtq_s32_f32(q);
+    qi = vaddq_s32(qi, vreinterpretq_s32_u32(vcgtq_f32(prod, s)));
+    qi = vsubq_s32(qi, vreinterpretq_s32_u32(vcleq_f32(vaddq_f32(prod, divisor), s)));
+    return vandq_u32(vreinterpretq_u32_s32(qi), vdupq_n_u32(0xff));
+}
+
+static inline uint32x4_t
+pack_pixels_neon(uint32x4_t p0, uint32x4_t p1, uint32x4_t p2, uint32x4_t p3)
+{
+    uint8x8_t lo = vmovn_u16(vcombine_u16(vmovn_u32(p0), vmovn_u32(p1)));
+    uint8x8_t hi = vmovn_u16(vcombine_u16(vmovn_u32(p2), vmovn_u32(p3)));
+    return vreinterpretq_u32_u8(vcombine_u8(lo, hi));
+}
+
+static inline uint32x4_t
+copy_alpha_neon(uint32x4_t pixels, uint32x4_t alpha_src)
+{
+    return vbslq_u32(vdupq_n_u32(0xff000000), alpha_src, pixels);
+}
+
+static void convolveRow_neon(const QRgb **taps, const float *kernel, int kernel_w, QRgb *dst, int n)
+{
+    const QRgb *center = taps[kernel_w/2];
+    int x = 0;
+    for (; x+4 <= n; x+=4)
+    {
+        float32x4_t acc0 = vdupq_n_f32(0), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+        for (int i=0; i < kernel_w; i++)
+        {
+            float32x4_t k = vdupq_n_f32(kernel[i]);
+            uint8x16_t px = vld1q_u8((const uint8_t*)(taps[i]+x));
+            uint16x8_t lo = vmovl_u8(vget_low_u8(px));
+            uint16x8_t hi = vmovl_u8(vget_high_u8(px));
+            // multiply and add separately, vmlaq_f32 may be fused
+            acc0 = vaddq_f32(acc0, vmulq_f32(k, vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo)))));
+            acc1 = vaddq_f32(acc1, vmulq_f32(k, vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo)))));
+            acc2 = vaddq_f32(acc2, vmulq_f32(k, vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi)))));
+            acc3 = vaddq_f32(acc3, vmulq_f32(k, vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi)))));
+        }
+        uint32x4_t pixels = pack_pixels_neon(round_to_byte_neon(acc0), round_to_byte_neon(acc1),
+                                             round_to_byte_neon(acc2), round_to_byte_neon(acc3));
+        pixels = copy_alpha_neon(pixels, vld1q_u32(center+x));
+        vst1q_u32(dst+x, pixels);
+    }
+    if (x < n) {
+        const QRgb *rest[kernel_w];
+        for (int i=0; i < kernel_w; i++)
+            rest[i] = taps[i] + x;
+        convolveRow_c(rest, kernel, kernel_w, dst+x, n-x);
+    }
+}
+
+static void boxBlurRow_neon(const QRgb *src, int r, QRgb *dst, int n)
+{
+    int kernel_w = 2*r + 1;
+    if (kernel_w > MAX_EXACT_DIVISOR)
+        return boxBlurRow_c(src, r, dst, n);
+    float32x4_t divisor = vdupq_n_f32(kernel_w);
+    float32x4_t inv_divisor = vdupq_n_f32(1.0f/kernel_w);
+    int32x4_t sum = vdupq_n_s32(0);
+    for (int x=0; x<kernel_w; x++) {
+        uint16x8_t px = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(src[x])));
+        sum = vaddq_s32(sum, vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(px))));
+    }
+    for (int x=0; x<n; x++) {
+        if (x > 0) {
+            uint16x8_t right = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(src[x+r+r])));
+            uint16x8_t left = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(src[x-1])));
+            int16x4_t diff = vreinterpret_s16_u16(vget_low_u16(vsubq_u16(right, left)));
+            sum = vaddq_s32(sum, vmovl_s16(diff));
+        }
+        uint32x4_t q = divide_neon(sum, divisor, inv_divisor);
+        uint8x8_t bytes = vmovn_u16(vcombine_u16(vmovn_u32(q), vmovn_u32(q)));
+        QRgb clr = vget_lane_u32(vreinterpret_u32_u8(bytes), 0);
+        dst[x] = (clr & 0x00ffffffu) | (src[x+r] & 0xff000000u);
+    }
+}
+
+static void boxAccumulateRow_neon(int *sums, const QRgb *add, const QRgb *sub, int n)
+{
+    int x = 0;
+    for (; x+4 <= n; x+=4)
+    {
+        uint8x16_t a = vld1q_u8((const uint8_t*)(add+x));
+        int16x8_t lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(a)));
+        int16x8_t hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(a)));
+        if (sub) {
+            uint8x16_t s = vld1q_u8((const uint8_t*)(sub+x));
+            lo = vsubq_s16(lo, vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(s))));
+            hi = vsubq_s16(hi, vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(s))));
+        }
+        int *dst = sums + 4*x;
+        vst1q_s32(dst,    vaddq_s32(vld1q_s32(dst),    vmovl_s16(vget_low_s16(lo))));
+        vst1q_s32(dst+4,  vaddq_s32(vld1q_s32(dst+4),  vmovl_s16(vget_high_s16(lo))));
+        vst1q_s32(dst+8,  vaddq_s32(vld1q_s32(dst+8),  vmovl_s16(vget_low_s16(hi))));
+        vst1q_s32(dst+12, vaddq_s32(vld1q_s32(dst+12), vmovl_s16(vget_high_s16(hi))));
+    }
+    if (x < n)
+        boxAccumulateRow_c(sums+4*x, add+x, sub ? sub+x : NULL, n-x);
+}
+
+static void boxDivideRow_neon(const int *sums, int count, const QRgb *alpha_src, QRgb *dst, int n)
+{
+    if (count > MAX_EXACT_DIVISOR)
+        return boxDivideRow_c(sums, count, alpha_src, dst, n);
+    float32x4_t divisor = vdupq_n_f32(count);
+    float32x4_t inv_divisor = vdupq_n_f32(1.0f/count);
+    int x = 0;
+    for (; x+4 <= n; x+=4)
+    {
+        const int *src = sums + 4*x;
+        uint32x4_t pixels = pack_pixels_neon(
+                divide_neon(vld1q_s32(src),    divisor, inv_divisor),
+                divide_neon(vld1q_s32(src+4),  divisor, inv_divisor),
+                divide_neon(vld1q_s32(src+8),  divisor, inv_divisor),
+                divide_neon(vld1q_s32(src+12), divisor, inv_divisor));
+        pixels = copy_alpha_neon(pixels, vld1q_u32(alpha_src+x));
+        vst1q_u32(dst+x, pixels);
+    }
+    if (x < n)
+        boxDivideRow_c(sums+4*x, count, alpha_src+x, dst+x, n-x);
+}
+
+static void hullRow_neon(const uchar *src, const uchar *cmp2, const uchar *cmp1, uchar *dst,
+                         int polarity, int n)
+{
+    uint8x16_t one = vdupq_n_u8(1);
+    int x = 0;
+    for (; x+16 <= n; x+=16)
+    {
+        uint8x16_t v = vld1q_u8(src+x);
+        uint8x16_t c2 = vld1q_u8(cmp2+x);
+        uint8x16_t d2 = polarity > 0 ? vqsubq_u8(c2, v) : vqsubq_u8(v, c2);
+        uint8x16_t step = vminq_u8(vqsubq_u8(d2, one), one);
+        if (cmp1) {
+            uint8x16_t c1 = vld1q_u8(cmp1+x);
+            uint8x16_t d1 = polarity > 0 ? vqsubq_u8(c1, v) : vqsubq_u8(v, c1);
+            step = vminq_u8(step, d1);
+        }
+        v = polarity > 0 ? vqaddq_u8(v, step) : vqsubq_u8(v, step);
+        vst1q_u8(dst+x, v);
+    }
+    if (x < n)
+        hullRow_c(src+x, cmp2+x, cmp1 ? cmp1+x : NULL, dst+x, polarity, n-x);
+}
+
+static void remapRowCubic_neon(const QRgb *src, int src_w, int src_h, const int *coords,
+                               QRgb background, QRgb *dst, int n)
+{
+    const CubicWeights &weights = cubicWeights();
+    for (int x=0; x<n; x++)
+    {
+        int sx = coords[2*x], sy = coords[2*x+1];
+        int x0 = (sx >> 8) - 1;
+        int y0 = (sy >> 8) - 1;
+        if (x0 < 0 || x0+3 >= src_w || y0 < 0 || y0+3 >= src_h) {
+            dst[x] = remapPixelCubic_c(src, src_w, src_h, sx, sy, background);
+            continue;
+        }
+        const float *wx = weights.w[sx & 255];
+        const float *wy = weights.w[sy & 255];
+        float32x4_t sum = vdupq_n_f32(0);
+        for (int j=0; j<4; j++)
+        {
+            uint8x16_t px = vld1q_u8((const uint8_t*)(src + (y0+j)*src_w + x0));
+            uint16x8_t lo = vmovl_u8(vget_low_u8(px));
+            uint16x8_t hi = vmovl_u8(vget_high_u8(px));
+            float32x4_t p0 = vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo)));
+            float32x4_t p1 = vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo)));
+            float32x4_t p2 = vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi)));
+            float32x4_t p3 = vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi)));
+            float32x4_t row = vmulq_n_f32(p0, wx[0]);
+            row = vaddq_f32(row, vmulq_n_f32(p1, wx[1]));
+            row = vaddq_f32(row, vmulq_n_f32(p2, wx[2]));
+            row = vaddq_f32(row, vmulq_n_f32(p3, wx[3]));
+            sum = vaddq_f32(sum, vmulq_n_f32(row, wy[j]));
+        }
+        // truncate and saturate to 0-255
+        int32x4_t val = vcvtq_s32_f32(sum);
+        uint16x4_t val16 = vqmovun_s32(val);
+        uint8x8_t val8 = vqmovn_u16(vcombine_u16(val16, val16));
+        dst[x] = vget_lane_u32(vreinterpret_u32_u8(val8), 0);
+    }
+}
+
+#ifdef SIMD_NEON_ARMHF
+  #pragma GCC pop_options
+#endif
+#endif // SIMD_NEON
+
+// --------------------------- Dispatch --------------------------------
+
+typedef struct {
+    const char *name;
+    void (*convolveRow)(const QRgb **, const float *, int, QRgb *, int);
+    void (*boxBlurRow)(const QRgb *, int, QRgb *, int);
+    void (*boxAccumulateRow)(int *, const QRgb *, const QRgb *, int);
+    void (*boxDivideRow)(const int *, int, const QRgb *, QRgb *, int);
+    void (*hullRow)(const uchar *, const uchar *, const uchar *, uchar *, int, int);
+    void (*remapRowCubic)(const QRgb *, int, int, const int *, QRgb, QRgb *, int);
+} SimdFunctions;
+
+static SimdFunctions detectSimd()
+{
+    SimdFunctions funcs = {"C", convolveRow_c, boxBlurRow_c, boxAccumulateRow_c, boxDivideRow_c,
+                            hullRow_c, remapRowCubic_c};
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        SimdFunctions avx2 = {"AVX2", convolveRow_avx2, boxBlurRow_sse2,
+                                boxAccumulateRow_avx2, boxDivideRow_avx2, hullRow_avx2,
+                                remapRowCubic_sse2};
+        return avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        SimdFunctions sse2 = {"SSE2", convolveRow_sse2, boxBlurRow_sse2,
+                                boxAccumulateRow_sse2, boxDivideRow_sse2, hullRow_sse2,
+                                remapRowCubic_sse2};
+        return sse2;
+    }
+#elif defined(SIMD_NEON)
+  #ifdef __arm__
+    if (not (getauxval(AT_HWCAP) & HWCAP_NEON))
+        return funcs;
+  #endif
+    SimdFunctions neon = {"NEON", convolveRow_neon, boxBlurRow_neon,
+                            boxAccumulateRow_neon, boxDivideRow_neon, hullRow_neon,
+                            remapRowCubic_neon};
+    return neon;
+#endif
+    return funcs;
+}
+
+// detected only once, static local initialization is thread safe
+static const SimdFunctions& simd()
+{
+    static const SimdFunctions funcs = detectSimd();
+    return funcs;
+}
+
+const char* simdName()
+{
+    return simd().name;
+}
+
+void convolveRow(const QRgb **taps, const float *kernel, int kernel_w, QRgb *dst, int n)
+{
+    simd().convolveRow(taps, kernel, kernel_w, dst, n);
+}
+
+void boxBlurRow(const QRgb *src, int r, QRgb *dst, int n)
+{
+    simd().boxBlurRow(src, r, dst, n);
+}
+
+void boxAccumulateRow(int *sums, const QRgb *add, const QRgb *sub, int n)
+{
+    simd().boxAccumulateRow(sums, add, sub, n);
+}
+
+void boxDivideRow(const int *sums, int count, const QRgb *alpha_src, QRgb *dst, int n)
+{
+    simd().boxDivideRow(sums, count, alpha_src, dst, n);
+}
+
+void hullRow(const uchar *src, const uchar *cmp2, const uchar *cmp1, uchar *dst,
+             int polarity, int n)
+{
+    simd().hullRow(src, cmp2, cmp1, dst, polarity, n);
+}
+
+void remapRowCubic(const QRgb *src, int src_w, int src_h, const int *coords,
+                   QRgb background, QRgb *dst, int n)
+{
+    simd().remapRowCubic(src, src_w, src_h, coords, background, dst, n);
+}
@@ -0,0 +1,38 @@
+#pragma once
+/* SIMD implementations of inner loops of filters. The best implementation
+  (AVX2, SSE2, NEON or plain C) is chosen at runtime by cpu feature detection.
+  All of them give bit-identical results to the plain C versions.
+*/
+#include <QRgb>
+
+// name of the instruction set being used
+const char* simdName();
+
+// Convolve n pixels. taps[i][x] is the pixel which is multiplied by kernel[i] to
+// calculate dst[x]. Result is rounded, and alpha is copied from taps[kernel_w/2][x]
+void convolveRow(const QRgb **taps, const float *kernel, int kernel_w, QRgb *dst, int n);
+
+// Horizontal box blur of a row. src must contain r extra pixels on both sides,
+// i.e dst[x] is mean of src[x]...src[x+2r]. Alpha is copied from src[x+r]
+void boxBlurRow(const QRgb *src, int r, QRgb *dst, int n);
+
+// For vertical box blur. Each pixel has 4 sums (one per byte in memory order).
+// adds channel values of pixels of 'add' row and subtracts those of 'sub' row.
+// sub can be NULL, then pixels are only added
+void boxAccumulateRow(int *sums, const QRgb *add, const QRgb *sub, int n);
+
+// dst[x] = sums/count for each color channel, alpha is copied from alpha_src[x].
+// sums must not exceed 255*65535. alpha_src can be same as dst
+void boxDivideRow(const int *sums, int count, const QRgb *alpha_src, QRgb *dst, int n);
+
+// One step of Crimmins hull for a row of bytes. If polarity>0, dst[x] = src[x]+1 when
+// cmp2[x] >= src[x]+2 and cmp1[x] > src[x], otherwise dst[x] = src[x]. If polarity<0,
+// value is decreased in the same way. cmp1 can be NULL, then it is not compared
+void hullRow(const uchar *src, const uchar *cmp2, const uchar *cmp1, uchar *dst,
+             int polarity, int n);
+
+// Bicubic (Catmull-Rom) interpolation of n pixels of a remapped image. coords
+// contains x and y of source position of each pixel in 24.8 fixed point. Pixels
+// outside src image are taken as background. Result is truncated, not rounded
+void remapRowCubic(const QRgb *src, int src_w, int src_h, const int *coords,
+                   QRgb background, QRgb *dst, int n);
@@ -0,0 +1,104 @@
+// this file is part of photoquick program which is GPLv3 licensed
+#include "histogram.h"
+#include "common.h"
+#include <cstring>
+
+// adds histograms and sums of a row to stats
+static void
+count_row(const QRgb *row, int w, int step, int flags, ImageStats &stats)
+{
+    if (flags & STATS_RGB) {
+        for (int x=0; x<w; x+=step) {
+            ++stats.red[qRed(row[x])];
+            ++stats.green[qGreen(row[x])];
+            ++stats.blue[qBlue(row[x])];
+        }
+    }
+    if (flags & STATS_GRAY) {
+        for (int x=0; x<w; x+=step)
+            ++stats.gray[qGray(row[x])];
+    }
+    if (flags & STATS_SUMS) {
+        // a row sum fits in int for rows shorter than 8 million pixels
+        int sum_r = 0, sum_g = 0, sum_b = 0;
+        for (int x=0; x<w; x+=step) {
+            sum_r += qRed(row[x]);
+            sum_g += qGreen(row[x]);
+            sum_b += qBlue(row[x]);
+        }
+        stats.sum_red += sum_r;
+        stats.sum_green += sum_g;
+        stats.sum_blue += sum_b;
+    }
+    stats.count += (w + step - 1)/step;
+}
+
+// same as count_row() for a row of Grayscale8 image, where r = g = b = gray
+static void
+count_gray_row(const uchar *row, int w, int step, int flags, ImageStats &stats)
+{
+    int sum = 0;
+    for (int x=0; x<w; x+=step) {
+        if (flags & STATS_RGB) {
+            ++stats.red[row[x]];
+            ++stats.green[row[x]];
+            ++stats.blue[row[x]];
+        }
+        if (flags & STATS_GRAY)
+            ++stats.gray[row[x]];
+        sum += row[x];
+    }
+    if (flags & STATS_SUMS) {
+        stats.sum_red += sum;
+        stats.sum_green += sum;
+        stats.sum_blue += sum;
+    }
+    stats.count += (w + step - 1)/step;
+}
+
+static void
+add_stats(ImageStats &dst, const ImageStats &src)
+{
+    for (int i=0; i<256; i++) {
+        dst.red[i] += src.red[i];
+        dst.green[i] += src.green[i];
+        dst.blue[i] += src.blue[i];
+        dst.gray[i] += src.gray[i];
+    }
+    dst.sum_red += src.sum_red;
+    dst.sum_green += src.sum_green;
+    dst.sum_blue += src.sum_blue;
+    dst.count += src.count;
+}
+
+void calcImageStats(const QImage &img, ImageStats &stats, int flags, int step)
+{
+    if (img.format()!=QImage::Format_RGB32 && img.format()!=QImage::Format_ARGB32
+            && img.format()!=QImage::Format_Grayscale8) {
+        QImage rgb_img = img;
+        toRgbFormat(rgb_img);
+        return calcImageStats(rgb_img, stats, flags, step);
+    }
+    memset(&stats, 0, sizeof(ImageStats));
+    bool gray = img.format()==QImage::Format_Grayscale8;
+    int w = img.width();
+    int h = img.height();
+    if (step < 1)
+        step = 1;
+    ImageView view = constView(img);
+
+    #pragma omp parallel
+    {
+        ImageStats local;
+        memset(&local, 0, sizeof(ImageStats));
+        #pragma omp for nowait
+        for (int y=0; y<h; y+=step) {
+            if (gray)
+                count_gray_row(view.row<uchar>(y), w, step, flags, local);
+            else
+                count_row(view.row(y), w, step, flags, local);
+        }
+        #pragma omp critical
+        { add_stats(stats, local); }
+    }
+}
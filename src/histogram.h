@@ -0,0 +1,28 @@
+#pragma once
+/* Histograms and channel sums of an image, calculated in parallel.
+  Each thread counts in its own bins, which are added together at the end.
+*/
+#include <QImage>
+
+// what to calculate
+enum {
+    STATS_RGB  = 1,// histograms of red, green and blue channels
+    STATS_GRAY = 2,// histogram of gray values (qGray)
+    STATS_SUMS = 4 // sums of red, green and blue values
+};
+
+typedef struct {
+    unsigned int red[256];
+    unsigned int green[256];
+    unsigned int blue[256];
+    unsigned int gray[256];
+    long long sum_red;
+    long long sum_green;
+    long long sum_blue;
+    unsigned int count;// number of pixels counted
+} ImageStats;
+
+// Calculate histograms and sums selected by flags. If step>1, only every
+// step-th pixel of every step-th row is counted (sub sampling), which is
+// enough to estimate percentiles of a large image.
+void calcImageStats(const QImage &img, ImageStats &stats, int flags, int step=1);
@@ -0,0 +1,552 @@
+// this file is part of photoquick program which is GPLv3 licensed
+#include "history.h"
+#include "common.h"
+#include <QThread>
+#include <QMutexLocker>
+#include <cstring>
+#include <unordered_set>
+
+// width of tile in bytes
+#define TILE_BYTES (4*HISTORY_TILE_SIZE)
+
+// where the tile data is
+enum { TILE_RAW, TILE_PACKED, TILE_SPILLED };
+// how the tile data is compressed
+enum { PACK_NONE, PACK_QOI, PACK_ZLIB };
+
+// ---------------------- QOI encoding ---------------------- //
+/* Lossless encoding of 32 bit pixels, from the "Quite OK Image" format. Each
+  pixel is encoded as a run of previous pixel, index into a table of recently
+  seen pixels, or a small difference from previous pixel, in 1 or 2 bytes.
+  It is several times faster than zlib.
+*/
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MASK_2   0xc0
+#define QOI_HASH(c) ((qRed(c)*3 + qGreen(c)*5 + qBlue(c)*7 + qAlpha(c)*11) % 64)
+
+// out must have space for 5*n bytes. returns number of bytes written
+static int qoi_encode(const QRgb *px, int n, uchar *out)
+{
+    QRgb index[64] = {0};
+    QRgb prev = qRgba(0,0,0,255);
+    int run = 0, len = 0;
+    for (int i=0; i<n; i++) {
+        QRgb c = px[i];
+        if (c==prev) {
+            run++;
+            if (run==62 or i==n-1) {
+                out[len++] = QOI_OP_RUN | (run-1);
+                run = 0;
+            }
+            continue;
+        }
+        if (run) {
+            out[len++] = QOI_OP_RUN | (run-1);
+            run = 0;
+        }
+        int hash = QOI_HASH(c);
+        if (index[hash]==c) {
+            out[len++] = QOI_OP_INDEX | hash;
+        }
+        else if (qAlpha(c)==qAlpha(prev)) {
+            index[hash] = c;
+            signed char dr = qRed(c) - qRed(prev);
+            signed char dg = qGreen(c) - qGreen(prev);
+            signed char db = qBlue(c) - qBlue(prev);
+            signed char dr_dg = dr - dg;
+            signed char db_dg = db - dg;
+            if (dr>-3 and dr<2 and dg>-3 and dg<2 and db>-3 and db<2) {
+                out[len++] = QOI_OP_DIFF | (dr+2)<<4 | (dg+2)<<2 | (db+2);
+            }
+            else if (dg>-33 and dg<32 and dr_dg>-9 and dr_dg<8 and db_dg>-9 and db_dg<8) {
+                out[len++] = QOI_OP_LUMA | (dg+32);
+                out[len++] = (dr_dg+8)<<4 | (db_dg+8);
+            }
+            else {
+                out[len++] = QOI_OP_RGB;
+                out[len++] = qRed(c);
+                out[len++] = qGreen(c);
+                out[len++] = qBlue(c);
+            }
+        }
+        else {
+            index[hash] = c;
+            out[len++] = QOI_OP_RGBA;
+            out[len++] = qRed(c);
+            out[len++] = qGreen(c);
+            out[len++] = qBlue(c);
+            out[len++] = qAlpha(c);
+        }
+        prev = c;
+    }
+    return len;
+}
+
+static void qoi_decode(const uchar *in, QRgb *px, int n)
+{
+    QRgb index[64] = {0};
+    QRgb c = qRgba(0,0,0,255);
+    for (int i=0; i<n; ) {
+        int b1 = *in++;
+        if (b1==QOI_OP_RGB) {
+            c = qRgba(in[0], in[1], in[2], qAlpha(c));
+            in += 3;
+        }
+        else if (b1==QOI_OP_RGBA) {
+            c = qRgba(in[0], in[1], in[2], in[3]);
+            in += 4;
+        }
+        else if ((b1 & QOI_MASK_2)==QOI_OP_INDEX) {
+            c = index[b1];
+        }
+        else if ((b1 & QOI_MASK_2)==QOI_OP_DIFF) {
+            c = qRgba((qRed(c) + ((b1>>4)&3) - 2) & 255,
+                      (qGreen(c) + ((b1>>2)&3) - 2) & 255,
+                      (qBlue(c) + (b1&3) - 2) & 255, qAlpha(c));
+        }
+        else if ((b1 & QOI_MASK_2)==QOI_OP_LUMA) {
+            int b2 = *in++;
+            int dg = (b1 & 0x3f) - 32;
+            c = qRgba((qRed(c) + dg - 8 + (b2>>4)) & 255,
+                      (qGreen(c) + dg) & 255,
+                      (qBlue(c) + dg - 8 + (b2&15)) & 255, qAlpha(c));
+        }
+        else {// run of previous pixel
+            int run = (b1 & 0x3f) + 1;
+            for (int k=0; k<run and i<n; k++)
+                px[i++] = c;
+            continue;
+        }
+        index[QOI_HASH(c)] = c;
+        px[i++] = c;
+    }
+}
+
+// ---------------------- History Tile ---------------------- //
+
+class HistoryTile
+{
+public:
+    HistoryTile(HistoryStore *store, const uchar *src, int stride, int w, int h, bool rgba);
+    ~HistoryTile();
+    // copy to, or compare with the region of image where the tile belongs
+    void read(uchar *dst, int stride);
+    bool equals(const uchar *src, int stride);
+    // these are called only from worker thread
+    void pack();
+    void spill();
+    int state;// changed only by worker thread
+private:
+    // returns raw data, decompressed in buf if needed
+    const uchar* unpack(uchar *buf);
+    HistoryStore *store;
+    int w, h;// size in bytes
+    bool rgba;// if image is 32 bit, so that QOI can be used
+    uchar *raw;
+    QByteArray packed;
+    int pack_type;
+    qint64 file_pos;
+    int file_size;
+    QMutex mutex;// guards data which is changed by pack() and spill()
+};
+
+HistoryTile:: HistoryTile(HistoryStore *store, const uchar *src, int stride,
+                    int w, int h, bool rgba) : state(TILE_RAW), store(store),
+                    w(w), h(h), rgba(rgba), pack_type(PACK_NONE)
+{
+    raw = (uchar*) malloc(w*h);
+    for (int r=0; r<h; r++)
+        memcpy(raw + r*w, src + r*stride, w);
+    store->memory_used += w*h;
+}
+
+HistoryTile:: ~HistoryTile()
+{
+    if (state==TILE_RAW) {
+        free(raw);
+        store->memory_used -= w*h;
+    }
+    else if (state==TILE_PACKED)
+        store->memory_used -= packed.size();
+    else
+        store->release(file_pos, file_size);
+}
+
+const uchar*
+HistoryTile:: unpack(uchar *buf)
+{
+    if (state==TILE_RAW)
+        return raw;
+    QByteArray data = packed;
+    if (state==TILE_SPILLED) {
+        QMutexLocker locker(&store->file_mutex);
+        store->file.seek(file_pos);
+        data = store->file.read(file_size);
+    }
+    if (pack_type==PACK_QOI)
+        qoi_decode((const uchar*)data.constData(), (QRgb*)buf, w*h/4);
+    else if (pack_type==PACK_ZLIB)
+        memcpy(buf, qUncompress(data).constData(), w*h);
+    else
+        memcpy(buf, data.constData(), w*h);
+    return buf;
+}
+
+void
+HistoryTile:: read(uchar *dst, int stride)
+{
+    QMutexLocker locker(&mutex);
+    uchar *buf = state==TILE_RAW ? NULL : (uchar*) malloc(w*h);
+    const uchar *data = unpack(buf);
+    for (int r=0; r<h; r++)
+        memcpy(dst + r*stride, data + r*w, w);
+    free(buf);
+}
+
+bool
+HistoryTile:: equals(const uchar *src, int stride)
+{
+    QMutexLocker locker(&mutex);
+    uchar *buf = state==TILE_RAW ? NULL : (uchar*) malloc(w*h);
+    const uchar *data = unpack(buf);
+    bool same = true;
+    for (int r=0; r<h and same; r++)
+        same = memcmp(src + r*stride, data + r*w, w)==0;
+    free(buf);
+    return same;
+}
+
+// raw data is read without lock, as only this thread can free it
+void
+HistoryTile:: pack()
+{
+    QByteArray data;
+    int type = PACK_ZLIB;
+    if (rgba) {
+        uchar *buf = (uchar*) malloc(5*w*h/4);
+        int len = qoi_encode((QRgb*)raw, w*h/4, buf);
+        data = QByteArray((char*)buf, len);
+        free(buf);
+        type = PACK_QOI;
+    }
+    else {
+        data = qCompress(raw, w*h, 1);
+    }
+    if (data.size() >= w*h) {
+        data = QByteArray((char*)raw, w*h);
+        type = PACK_NONE;
+    }
+    QMutexLocker locker(&mutex);
+    packed = data;
+    pack_type = type;
+    free(raw);
+    raw = NULL;
+    state = TILE_PACKED;
+    store->memory_used += packed.size() - w*h;
+}
+
+void
+HistoryTile:: spill()
+{
+    qint64 pos = store->allocate(packed.size());
+    if (pos<0)
+        return;
+    store->file_mutex.lock();
+    bool ok = store->file.seek(pos) and store->file.write(packed)==packed.size();
+    store->file_mutex.unlock();
+    if (not ok) {
+        store->release(pos, packed.size());
+        return;
+    }
+    QMutexLocker locker(&mutex);
+    file_pos = pos;
+    file_size = packed.size();
+    store->memory_used -= file_size;
+    packed = QByteArray();
+    state = TILE_SPILLED;
+}
+
+// ---------------------- History Store ---------------------- //
+
+HistoryStore:: HistoryStore() : memory_used(0), disk_used(0), file_end(0)
+{
+}
+
+qint64
+HistoryStore:: allocate(int size)
+{
+    QMutexLocker locker(&file_mutex);
+    if (not file.isOpen() and not file.open())
+        return -1;
+    // whole file can be reused when nothing is in it
+    if (disk_used==0) {
+        free_space.clear();
+        file_end = 0;
+    }
+    disk_used += size;
+    for (size_t i=0; i<free_space.size(); i++) {
+        if (free_space[i].second < size)
+            continue;
+        qint64 pos = free_space[i].first;
+        free_space[i].first += size;
+        free_space[i].second -= size;
+        if (free_space[i].second==0)
+            free_space.erase(free_space.begin()+i);
+        return pos;
+    }
+    qint64 pos = file_end;
+    file_end += size;
+    return pos;
+}
+
+void
+HistoryStore:: release(qint64 pos, int size)
+{
+    QMutexLocker locker(&file_mutex);
+    free_space.push_back(std::make_pair(pos, size));
+    disk_used -= size;
+}
+
+// ---------------------- Undo History ---------------------- //
+
+class HistoryWorker : public QThread
+{
+public:
+    HistoryWorker(UndoHistory *history) : history(history) {}
+    void run() { history->packOldStates(); }
+    UndoHistory *history;
+};
+
+// position and size (in bytes) of i-th tile in image
+static inline void
+tile_rect(const HistoryState &state, int i, int &x, int &y, int &w, int &h)
+{
+    x = (i % state.tiles_x) * TILE_BYTES;
+    y = (i / state.tiles_x) * HISTORY_TILE_SIZE;
+    w = MIN(TILE_BYTES, state.row_bytes - x);
+    h = MIN(HISTORY_TILE_SIZE, state.height - y);
+}
+
+// if tiles of both states are at same position in image
+static bool same_layout(const HistoryState &a, const HistoryState &b)
+{
+    return a.width==b.width and a.height==b.height and a.format==b.format
+            and a.color_table==b.color_table;
+}
+
+// area of image covered by tiles of state which differ from those of prev.
+// whole image if prev is NULL
+static QRect changed_area(const HistoryState &state, const HistoryState *prev)
+{
+    if (not prev)
+        return QRect(0, 0, state.width, state.height);
+    QRect rect;
+    for (int i=0; i<(int)state.tiles.size(); i++) {
+        if (state.tiles[i]==prev->tiles[i])
+            continue;
+        int x, y, w, h;
+        tile_rect(state, i, x, y, w, h);
+        // byte columns to pixel columns
+        int x1 = x*8/state.depth;
+        int x2 = MIN(state.width, ((x+w)*8 + state.depth-1)/state.depth);
+        rect |= QRect(x1, y, x2-x1, h);
+    }
+    return rect;
+}
+
+UndoHistory:: UndoHistory() : index(-1), memory_limit((size_t)1024*1048576),
+                        image_key(0), work_pending(false), stopping(false)
+{
+    worker = new HistoryWorker(this);
+    worker->start(QThread::LowestPriority);
+}
+
+UndoHistory:: ~UndoHistory()
+{
+    mutex.lock();
+    stopping = true;
+    work_available.wakeAll();
+    mutex.unlock();
+    worker->wait();
+    delete worker;
+    states.clear();
+}
+
+void
+UndoHistory:: clear()
+{
+    QMutexLocker locker(&mutex);
+    states.clear();
+    index = -1;
+    image_key = 0;
+}
+
+// must be called with mutex locked
+void
+UndoHistory:: requestWork()
+{
+    work_pending = true;
+    work_available.wakeOne();
+}
+
+// drop oldest states to keep within limit
+void
+UndoHistory:: dropOldStates()
+{
+    while (index > 0 and ((size_t)store.memory_used > memory_limit or
+            (size_t)store.disk_used > HISTORY_DISK_FACTOR*memory_limit)) {
+        states.pop_front();
+        index--;
+    }
+}
+
+void
+UndoHistory:: add(const QImage &img)
+{
+    QMutexLocker locker(&mutex);
+    while ((int)states.size() > index+1)
+        states.pop_back();
+    HistoryState state;
+    state.width = img.width();
+    state.height = img.height();
+    state.format = img.format();
+    state.color_table = img.colorTable();
+    state.depth = img.depth();
+    state.row_bytes = (img.width()*img.depth() + 7)/8;
+    state.tiles_x = (state.row_bytes + TILE_BYTES - 1)/TILE_BYTES;
+    int tiles_y = (state.height + HISTORY_TILE_SIZE - 1)/HISTORY_TILE_SIZE;
+    int count = state.tiles_x*tiles_y;
+    state.tiles.resize(count);
+    bool rgba = img.depth()==32;
+    // tiles are compared with current state only if they are at same position
+    const HistoryState *prev = NULL;
+    if (index>=0 and same_layout(states[index], state))
+        prev = &states[index];
+    ImageView view = constView(img);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i=0; i<count; i++) {
+        int x, y, w, h;
+        tile_rect(state, i, x, y, w, h);
+        const uchar *src = view.row<uchar>(y) + x;
+        if (prev and prev->tiles[i]->equals(src, view.stride))
+            state.tiles[i] = prev->tiles[i];
+        else
+            state.tiles[i] = std::make_shared<HistoryTile>(&store, src, view.stride, w, h, rgba);
+    }
+    changed_rect = changed_area(state, prev);
+    states.push_back(std::move(state));
+    index++;
+    image_key = img.cacheKey();
+    dropOldStates();
+    requestWork();
+}
+
+// replaces img with the state at given index. if img was not changed since it
+// was same as current state, only the tiles which differ are copied
+void
+UndoHistory:: restore(QImage &img, int new_index)
+{
+    const HistoryState &state = states[new_index];
+    const HistoryState &current = states[index];
+    bool changed_tiles_only = not img.isNull() and img.cacheKey()==image_key
+                                and same_layout(state, current);
+    if (not changed_tiles_only) {
+        img = QImage(state.width, state.height, state.format);
+        if (not state.color_table.isEmpty())
+            img.setColorTable(state.color_table);
+    }
+    ImageView view(img);
+    int count = state.tiles.size();
+    #pragma omp parallel for schedule(dynamic)
+    for (int i=0; i<count; i++) {
+        if (changed_tiles_only and state.tiles[i]==current.tiles[i])
+            continue;
+        int x, y, w, h;
+        tile_rect(state, i, x, y, w, h);
+        state.tiles[i]->read(view.row<uchar>(y) + x, view.stride);
+    }
+    changed_rect = changed_area(state, changed_tiles_only ? &current : NULL);
+    index = new_index;
+    image_key = img.cacheKey();
+    requestWork();
+}
+
+bool
+UndoHistory:: undo(QImage &img)
+{
+    QMutexLocker locker(&mutex);
+    if (index<1)
+        return false;
+    restore(img, index-1);
+    return true;
+}
+
+bool
+UndoHistory:: redo(QImage &img)
+{
+    QMutexLocker locker(&mutex);
+    if (index > (int)states.size()-2)
+        return false;
+    restore(img, index+1);
+    return true;
+}
+
+void
+UndoHistory:: setMemoryLimit(size_t bytes)
+{
+    QMutexLocker locker(&mutex);
+    memory_limit = bytes;
+    dropOldStates();
+    requestWork();
+}
+
+void
+UndoHistory:: packOldStates()
+{
+    while (true) {
+        mutex.lock();
+        while (not work_pending and not stopping)
+            work_available.wait(&mutex);
+        if (stopping) {
+            mutex.unlock();
+            return;
+        }
+        work_pending = false;
+        // tiles of states near current state are kept uncompressed
+        int first = MAX(0, index - HISTORY_RAW_STATES);
+        int last = MIN((int)states.size()-1, index + HISTORY_RAW_STATES);
+        std::unordered_set<HistoryTile*> seen;
+        for (int i=first; i<=last; i++) {
+            for (auto &tile : states[i].tiles)
+                seen.insert(tile.get());
+        }
+        // oldest states first
+        std::vector<std::shared_ptr<HistoryTile>> tiles;
+        for (int i=0; i<(int)states.size(); i++) {
+            if (i>=first and i<=last)
+                continue;
+            for (auto &tile : states[i].tiles) {
+                if (tile->state!=TILE_SPILLED and seen.insert(tile.get()).second)
+                    tiles.push_back(tile);
+            }
+        }
+        qint64 spill_above = memory_limit/2;
+        mutex.unlock();
+
+        for (auto &tile : tiles) {
+            if (stopping or work_pending)
+                break;
+            if (tile.use_count()==1)// its states were dropped
+                continue;
+            if (tile->state==TILE_RAW)
+                tile->pack();
+            if (store.memory_used > spill_above)
+                tile->spill();
+        }
+    }
+}
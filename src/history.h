@@ -0,0 +1,98 @@
+#pragma once
+/* Undo history of image states.
+  Each state is stored as tiles of HISTORY_TILE_SIZE rows and HISTORY_TILE_SIZE
+  32 bit pixels (or same number of bytes for other formats). A tile which is
+  same as in previous state is shared, so an edit which changes a small area
+  stores only the changed tiles.
+  While the image is not changed outside of the history, undo and redo copy
+  only the tiles that differ between the two states.
+  A background thread losslessly compresses tiles of states which are more than
+  HISTORY_RAW_STATES steps away from current state. When memory used exceeds
+  half of the limit, compressed tiles of oldest states are moved to a temporary
+  file. Tiles are decompressed or read back when those states are restored.
+  Oldest states are dropped if memory exceeds the limit, or the temporary file
+  exceeds HISTORY_DISK_FACTOR times the limit.
+*/
+#include <QImage>
+#include <QVector>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QTemporaryFile>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#define HISTORY_TILE_SIZE 256
+#define HISTORY_RAW_STATES 2
+#define HISTORY_DISK_FACTOR 4
+
+class HistoryTile;
+class HistoryWorker;
+
+typedef struct {
+    int width;
+    int height;
+    QImage::Format format;
+    QVector<QRgb> color_table;
+    int depth;
+    int row_bytes;// bytes used by pixels in each row
+    int tiles_x;// number of tile columns
+    std::vector<std::shared_ptr<HistoryTile>> tiles;
+} HistoryState;
+
+// memory and temporary file used by all tiles of a history
+class HistoryStore
+{
+public:
+    HistoryStore();
+    // position in file where size bytes can be written, -1 if file can not be opened
+    qint64 allocate(int size);
+    void release(qint64 pos, int size);
+    std::atomic<qint64> memory_used;
+    std::atomic<qint64> disk_used;
+    QTemporaryFile file;
+    QMutex file_mutex;// guards file and free_space
+private:
+    std::vector<std::pair<qint64,int>> free_space;// unused regions of file
+    qint64 file_end;
+};
+
+class UndoHistory
+{
+public:
+    UndoHistory();
+    ~UndoHistory();
+    void clear();
+    // adds img as the latest state, states after current state are discarded
+    void add(const QImage &img);
+    // replace img with previous or next state. returns false if there is none
+    bool undo(QImage &img);
+    bool redo(QImage &img);
+    // limit in bytes. current state is always kept, even if it exceeds limit
+    void setMemoryLimit(size_t bytes);
+    size_t memoryLimit() const { return memory_limit; }
+    size_t memoryUsed() const { return store.memory_used; }
+    size_t diskUsed() const { return store.disk_used; }
+    // area of image (in pixels) changed by last add(), undo() or redo()
+    QRect changedRect() const { return changed_rect; }
+    // compresses and moves to disk the tiles of old states, until there is
+    // nothing to do or new work is requested. called by worker thread
+    void packOldStates();
+private:
+    void dropOldStates();
+    void restore(QImage &img, int index);
+    void requestWork();
+    HistoryStore store;// declared first, as tiles must be freed before it
+    std::deque<HistoryState> states;
+    int index;// current state
+    size_t memory_limit;
+    qint64 image_key;// cacheKey() of image when it was same as current state
+    QRect changed_rect;
+    // guards states and index, which are read by worker thread
+    QMutex mutex;
+    QWaitCondition work_available;
+    std::atomic<bool> work_pending;
+    std::atomic<bool> stopping;
+    HistoryWorker *worker;
+};
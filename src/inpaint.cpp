@@ -534,11 +534,10 @@ MaskedImage:: copyMaskFrom(uchar **oldmask)
 void
 MaskedImage:: copyMaskFrom(QImage mask)
 {
+    ImageView mask_view = constView(mask);
     #pragma omp parallel for
     for (int y=0; y<mask.height(); y++) {
-        QRgb *row;
-        #pragma omp critical
-        { row = (QRgb*)mask.constScanLine(y);}
+        QRgb *row = mask_view.row(y);
         for (int x=0; x<mask.width(); x++) {
             this->mask[y][x] = qRed(row[x])==0 ? 0 : 1;
         }
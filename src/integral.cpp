@@ -0,0 +1,100 @@
+// this file is part of photoquick program which is GPLv3 licensed
+#include "integral.h"
+#include "common.h"
+#include <cstring>
+
+// width of column strips processed by each thread in vertical pass
+#define INTEGRAL_STRIP 256
+
+// row y of table is prefix sums of row y-1 of image. add each row to the next
+// row, a strip of columns at a time
+static void add_rows(unsigned int *data, int stride, int height)
+{
+    int strip_count = (stride + INTEGRAL_STRIP - 1)/INTEGRAL_STRIP;
+    #pragma omp parallel for
+    for (int strip=0; strip<strip_count; strip++)
+    {
+        int x0 = strip*INTEGRAL_STRIP;
+        int x1 = MIN(x0 + INTEGRAL_STRIP, stride);
+        for (int y=1; y<=height; y++) {
+            unsigned int *prev = data + (y-1)*stride;
+            unsigned int *row = data + y*stride;
+            for (int x=x0; x<x1; x++)
+                row[x] += prev[x];
+        }
+    }
+}
+
+IntegralImage:: IntegralImage(const QImage &img, int channel)
+{
+    width = img.width();
+    height = img.height();
+    stride = width+1;
+    data = (unsigned int*) malloc(stride*(height+1)*sizeof(unsigned int));
+    memset(data, 0, stride*sizeof(unsigned int));
+    // shallow copy, converted only if not RGB32, ARGB32 or Grayscale8
+    QImage src = img;
+    if (src.format()!=QImage::Format_Grayscale8)
+        toRgbFormat(src);
+    bool gray = src.format()==QImage::Format_Grayscale8;
+    ImageView view = constView(src);
+
+    // prefix sums of each row
+    #pragma omp parallel for
+    for (int y=0; y<height; y++)
+    {
+        unsigned int *dst = data + (y+1)*stride;
+        unsigned int sum = 0;
+        dst[0] = 0;
+        if (gray) {
+            // every color channel is the gray value
+            uchar *row = view.row<uchar>(y);
+            for (int x=0; x<width; x++) {
+                sum += channel==CHANNEL_A ? 255 : row[x];
+                dst[x+1] = sum;
+            }
+        }
+        else if (channel==CHANNEL_GRAY) {
+            QRgb *row = view.row(y);
+            for (int x=0; x<width; x++) {
+                sum += qGray(row[x]);
+                dst[x+1] = sum;
+            }
+        }
+        else {
+            uchar *row = view.row<uchar>(y);
+            for (int x=0; x<width; x++) {
+                sum += row[4*x+channel];
+                dst[x+1] = sum;
+            }
+        }
+    }
+    add_rows(data, stride, height);
+}
+
+IntegralImage:: IntegralImage(const uchar *plane, int w, int h)
+{
+    width = w;
+    height = h;
+    stride = width+1;
+    data = (unsigned int*) malloc(stride*(height+1)*sizeof(unsigned int));
+    memset(data, 0, stride*sizeof(unsigned int));
+    #pragma omp parallel for
+    for (int y=0; y<height; y++)
+    {
+        const uchar *row = plane + y*width;
+        unsigned int *dst = data + (y+1)*stride;
+        unsigned int sum = 0;
+        dst[0] = 0;
+        for (int x=0; x<width; x++) {
+            sum += row[x];
+            dst[x+1] = sum;
+        }
+    }
+    add_rows(data, stride, height);
+}
+
+IntegralImage:: ~IntegralImage()
+{
+    free(data);
+}
@@ -0,0 +1,33 @@
+#pragma once
+/* Integral image (summed area table) of one channel of an image, which gives
+  sum of any rectangular box of pixels in constant time.
+  Cells are 32 bit unsigned ints, and sums are calculated with wrap around
+  (modulo 2^32) arithmetic. So a box sum is exact as long as the sum of the box
+  itself is less than 2^32 (i.e upto 16.8M white pixels), however large the image is.
+*/
+#include <QImage>
+
+// channel is a byte of pixel (CHANNEL_R, CHANNEL_G etc.) or gray value
+#define CHANNEL_GRAY -1
+
+class IntegralImage
+{
+public:
+    IntegralImage(const QImage &img, int channel);
+    // integral of a plane of w x h bytes
+    IntegralImage(const uchar *plane, int w, int h);
+    ~IntegralImage();
+    // sum of pixels in box x1 <= x < x2, y1 <= y < y2
+    unsigned int sum(int x1, int y1, int x2, int y2) const {
+        return  data[y2*stride + x2] - data[y2*stride + x1]
+              - data[y1*stride + x2] + data[y1*stride + x1];
+    }
+    int width;
+    int height;
+private:
+    IntegralImage(const IntegralImage&);// not copyable
+    IntegralImage& operator=(const IntegralImage&);
+    // (w+1)x(h+1) cells, first row and first column are zero
+    unsigned int *data;
+    int stride;
+};
@@ -3,6 +3,7 @@
 #include "iscissor.h"
 #include "common.h"
 #include "filters.h"
+#include "distance.h"
 #include <QButtonGroup>
 #include <cmath>
 
@@ -27,7 +28,12 @@ void findOptimalPath(GradMap *grad_map, IntBuffer &dp_buff,
 std::vector<QPoint> plotShortPath(IntBuffer *dp_buff, int x1, int y1,
                     int target_x, int target_y);
 
-void floodfill(QImage &img, QPoint pos, QRgb newColor);
+template <typename T>
+void floodfill(QImage &img, QPoint pos, T newColor);
+
+template <typename T>
+void fillPathArea(QImage &mask, std::vector<std::vector<QPoint>> &path,
+                                            QPoint clicked, T fg, T bg);
 
 
 void updateImageArea(QImage &dst, QImage &src, int pos_x, int pos_y);
@@ -166,12 +172,12 @@ IScissorDialog:: scaleImage()
         if (scale != 1.0)
             mask_scaled = mask.scaled(image_scaled.width(), image_scaled.height());
 
+        ImageView view(image_scaled);
+        ImageView mask_view = constView(mask_scaled);
         #pragma omp parallel for
         for (int y=0; y<image_scaled.height(); y++){
-            QRgb *row, *mask_row;
-            #pragma omp critical
-            { row = (QRgb*) image_scaled.scanLine(y);
-              mask_row = (QRgb*) mask_scaled.constScanLine(y); }
+            QRgb *row = view.row(y);
+            QRgb *mask_row = mask_view.row(y);
             for (int x=0; x<image_scaled.width(); x++){
                 if (qRed(mask_row[x])>127){
                     QRgb clr = row[x];
@@ -395,12 +401,12 @@ IScissorDialog:: eraseAt(int pos_x, int pos_y)
     int max_i = y + brush.width() > image.height()? image.height()-1-y : brush.height()-1;
     int max_j = x + brush.width() > image.width() ? image.width() -1-x : brush.width() -1;
 
+    ImageView view(image);
+    ImageView brush_view = constView(brush);
     #pragma omp parallel for
     for (int i=min_i; i<=max_i; i++) {
-        QRgb *row, *brush_row;
-        #pragma omp critical
-        {row = (QRgb*)image.scanLine(y+i);
-         brush_row = (QRgb*)brush.constScanLine(i);}
+        QRgb *row = view.row(y+i);
+        QRgb *brush_row = brush_view.row(i);
         for (int j=min_j; j<=max_j; j++) {
             int clr = row[x+j];
             int alpha = MAX(qAlpha(clr) - qRed(brush_row[j]), 0);
@@ -421,12 +427,12 @@ IScissorDialog:: eraseAt(int pos_x, int pos_y)
     max_i = y + brush_w > img_h ? img_h-1-y : brush_w-1;
     max_j = x + brush_w > img_w ? img_w-1-x : brush_w-1;
 
+    ImageView scaled_view(image_scaled);
+    ImageView brush_view = constView(brush_scaled);
     #pragma omp parallel for
     for (int i=min_i; i<=max_i; i++) {
-        QRgb *row, *brush_row;
-        #pragma omp critical
-        {row = (QRgb*)image_scaled.scanLine(y+i);
-         brush_row = (QRgb*)brush_scaled.constScanLine(i);}
+        QRgb *row = scaled_view.row(y+i);
+        QRgb *brush_row = brush_view.row(i);
         for (int j=min_j; j<=max_j; j++) {
             int clr = row[x+j];
             if (qAlpha(clr)==0) {
@@ -698,45 +704,59 @@ IScissorDialog:: checkPathClosed()
 void
 IScissorDialog:: getMaskedImage(QPoint clicked)
 {
-    QRgb white = qRgb(255,255,255);
-    QRgb black = qRgb(0,0,0);
-
-    if (mode==ERASER_MODE) {
-        mask = QImage(image.width(), image.height(), QImage::Format_ARGB32);
-        mask.fill(black);
-    }
-    for (auto points : fullPath) {
-        for (QPoint pt : points) {
-            mask.setPixel(pt, white);
-        }
-    }
-    //mask.save("mask.png");
-    floodfill(mask, clicked, white);
-    for (auto points : fullPath) {
-        for (QPoint pt : points) {
-            mask.setPixel(pt, black);
-        }
-    }
-    if (mode != ERASER_MODE)
+    if (mode != ERASER_MODE) {
+        fillPathArea(mask, fullPath, clicked, qRgb(255,255,255), qRgb(0,0,0));
         return;
+    }
+    // 8 bit mask takes 1/4th memory of 32 bit mask
+    QImage mask8(image.width(), image.height(), QImage::Format_Grayscale8);
+    mask8.fill(0);
+    fillPathArea<uchar>(mask8, fullPath, clicked, 255, 0);
+    // mask is zero outside this rectangle
+    QRect rect;
     if (smoothEdgesBtn->isChecked())
-        gaussianBlur(mask, 3);
+        rect = featherMask(mask8, MAX(6, MAX(image.width(), image.height())/1000));
+    else
+        rect = maskBoundingRect(mask8);
 
     if (image.format() != QImage::Format_ARGB32)
         image = image.convertToFormat(QImage::Format_ARGB32);
 
+    int w = image.width();
+    ImageView view(image);
+    ImageView mask_view = constView(mask8);
+    #pragma omp parallel for
     for (int y=0; y<image.height(); y++){
-        QRgb *row = (QRgb*)image.scanLine(y);
-        QRgb *mask_row = (QRgb*)mask.constScanLine(y);
-        for (int x=0; x<image.width(); x++){
-            int clr = row[x];
+        QRgb *row = view.row(y);
+        uchar *mask_row = mask_view.row<uchar>(y);
+        bool in_rect = y>=rect.top() and y<=rect.bottom();
+        for (int x=0; x<w; x++){
+            int val = (in_rect and x>=rect.left() and x<=rect.right()) ? mask_row[x] : 0;
             // black regions of mask are made transparent in image
-            int alpha = qAlpha(clr) - (255-qRed(mask_row[x]));
-            if (alpha<0) alpha = 0;
-            row[x] = qRgba(qRed(clr), qGreen(clr), qBlue(clr), alpha);
+            int alpha = MAX(qAlpha(row[x]) - (255-val), 0);
+            row[x] = (row[x] & RGB_MASK) | (alpha << 24);
+        }
+    }
+}
+
+// path pixels are set to bg, and the region enclosed by path, which contains
+// clicked point is filled with fg
+template <typename T>
+void fillPathArea(QImage &mask, std::vector<std::vector<QPoint>> &path,
+                                            QPoint clicked, T fg, T bg)
+{
+    ImageView view(mask);
+    for (auto &points : path) {
+        for (QPoint pt : points) {
+            view.row<T>(pt.y())[pt.x()] = fg;
+        }
+    }
+    floodfill(mask, clicked, fg);
+    for (auto &points : path) {
+        for (QPoint pt : points) {
+            view.row<T>(pt.y())[pt.x()] = bg;
         }
     }
-    mask = QImage();// clear memory in eraser mode
 }
 
 
@@ -1012,9 +1032,10 @@ IntBuffer:: ~IntBuffer()
 /* Stack Based Scanline Floodfill
    Source : http://lodev.org/cgtutor/floodfill.html#Scanline_Floodfill_Algorithm_With_Stack
 */
-void floodfill(QImage &img, QPoint pos, QRgb newColor)
+template <typename T>
+void floodfill(QImage &img, QPoint pos, T newColor)
 {
-    QRgb oldColor = img.pixel(pos);
+    T oldColor = ((T*)img.constScanLine(pos.y()))[pos.x()];
     if (oldColor==newColor)
         return;
 
@@ -1025,7 +1046,7 @@ void floodfill(QImage &img, QPoint pos, QRgb newColor)
 
     std::vector<QPoint> q;
     bool spanAbove, spanBelow;
-    QRgb *row, *row_prev, *row_next;
+    T *row, *row_prev, *row_next;
     q.push_back(QPoint(x, y));
 
     while(!q.empty())
@@ -1034,9 +1055,9 @@ void floodfill(QImage &img, QPoint pos, QRgb newColor)
         q.pop_back();
         x = pt.x();
         y = pt.y();
-        row = (QRgb*)img.scanLine(y);
-        row_prev = (QRgb*)img.constScanLine(y-1);
-        row_next = (QRgb*)img.constScanLine(y+1);
+        row = (T*)img.scanLine(y);
+        row_prev = (T*)img.constScanLine(y-1);
+        row_next = (T*)img.constScanLine(y+1);
         while (x >= 0 && row[x] == oldColor) x--;
         x++;
         spanAbove = spanBelow = 0;
@@ -1065,12 +1086,12 @@ void floodfill(QImage &img, QPoint pos, QRgb newColor)
 
 void updateImageArea(QImage &dst, QImage &src, int pos_x, int pos_y)
 {
+    ImageView dst_view(dst);
+    ImageView src_view = constView(src);
     #pragma omp parallel for
     for (int y=0; y<src.height(); y++) {
-        QRgb *row_dst, *row_src;
-        #pragma omp critical
-        { row_dst = (QRgb*)dst.scanLine(y+pos_y);
-          row_src = (QRgb*)src.constScanLine(y); }
+        QRgb *row_dst = dst_view.row(y+pos_y);
+        QRgb *row_src = src_view.row(y);
         for (int x=0; x<src.width(); x++) {
             row_dst[x+pos_x] = row_src[x];
         }
@@ -27,6 +27,7 @@
 #include "inpaint.h"
 #include "iscissor.h"
 #include "filters.h"
+#include "planar.h"
 #include "pdfwriter.h"
 #include <QFileDialog>
 #include <QInputDialog>
@@ -91,9 +92,12 @@ Window:: Window()
         colorMenu->addAction("Color Balance", this, SLOT(grayWorldFilter()));
         colorMenu->addAction("White Balance", this, SLOT(whiteBalance()));
         colorMenu->addAction("Enhance Colors", this, SLOT(enhanceColors()));
+        colorMenu->addAction("Auto Enhance", this, SLOT(autoEnhanceFilter()));
     QMenu *thresholdMenu = filtersMenu->addMenu("Threshold");
         thresholdMenu->addAction("Threshold", this, SLOT(applyThreshold()));
         thresholdMenu->addAction("Scanned Page", this, SLOT(adaptiveThresh()));
+        thresholdMenu->addAction("Clean Page", this, SLOT(cleanScannedPage()));
+        thresholdMenu->addAction("Multi Level", this, SLOT(multiLevelThreshold()));
     QMenu *brightnessMenu = filtersMenu->addMenu("Brightness");
         brightnessMenu->addAction("Adjust Brightness", this, SLOT(adjustGamma()));
         brightnessMenu->addAction("Stretch Contrast", this, SLOT(stretchImageContrast()));
@@ -102,8 +106,9 @@ Window:: Window()
     QMenu *noiseMenu = filtersMenu->addMenu("Noise Removal");
         noiseMenu->addAction("Despeckle", this, SLOT(reduceSpeckleNoise()));
         noiseMenu->addAction("Remove Dust", this, SLOT(removeDust()));
+        noiseMenu->addAction("Reduce Noise", this, SLOT(reduceNoise()));
     filtersMenu->addAction("Lens Distortion", this, SLOT(lensDistort()));
-    filtersMenu->addAction("Sharpen", this, SLOT(sharpenImage()));
+    filtersMenu->addAction("Sharpen...", this, SLOT(sharpenImage()));
     filtersMenu->addAction("Smooth/Blur...", this, SLOT(blur()));
     QMenu *effectsMenu = filtersMenu->addMenu("Effects");
         effectsMenu->addAction("Vignette", this, SLOT(vignetteFilter()));
@@ -168,6 +173,9 @@ Window:: Window()
     statusbar_h = settings.value("StatusBarHeight", 28).toInt();
     windowdecor_w = settings.value("WindowDecorWidth", 12).toInt();
     windowdecor_h = settings.value("WindowDecorHeight", 36).toInt();
+    // memory used by undo history in MB
+    undo_memory_limit = settings.value("UndoMemoryLimit", 1024).toInt();
+    canvas->history.setMemoryLimit((size_t)undo_memory_limit*1048576);
     data.max_window_w = screen_width - windowdecor_w;
     data.max_window_h = screen_height - windowdecor_h;
 
@@ -266,16 +274,24 @@ Window:: loadPlugins()
             connect(pluginObj, SIGNAL(optimumSizeRequested()), this, SLOT(resizeToOptimum()));
             connect(pluginObj, SIGNAL(sendNotification(QString,QString)), this, SLOT(showNotification(QString,QString)));
             // add menu items and window shortcuts
+            // slots are called in order of connection, so image is converted
+            // before plugin gets it
             QAction *action = addPluginMenuItem(plugin->menuItem(), menu_dict);
-            if (action) connect(action, SIGNAL(triggered()), pluginObj, SLOT(onMenuClick()));
+            if (action) {
+                connect(action, SIGNAL(triggered()), this, SLOT(prepareImageForPlugin()));
+                connect(action, SIGNAL(triggered()), pluginObj, SLOT(onMenuClick()));
+            }
             for (QString menu_path : plugin->menuItems()) {
                 action = addPluginMenuItem(menu_path, menu_dict);
-                if (action) plugin->handleAction(action, ACTION_MENU);
+                if (not action) continue;
+                connect(action, SIGNAL(triggered()), this, SLOT(prepareImageForPlugin()));
+                plugin->handleAction(action, ACTION_MENU);
             }
             for (QString shortcut : plugin->getShortcuts()) {
                 action = new QAction(this);
                 action->setShortcut(shortcut);
                 this->addAction(action);
+                connect(action, SIGNAL(triggered()), this, SLOT(prepareImageForPlugin()));
                 plugin->handleAction(action, ACTION_SHORTCUT);
             }
         }
@@ -285,6 +301,14 @@ Window:: loadPlugins()
     menu_dict["Info"]->addAction("About PhotoQuick", this, SLOT(showAbout()));
 }
 
+// plugins expect RGB32 or ARGB32 image, as it was before Grayscale8 and
+// Mono images were supported
+void
+Window:: prepareImageForPlugin()
+{
+    toRgbFormat(data.image);
+}
+
 void
 Window:: openStartupImage()
 {
@@ -565,6 +589,20 @@ Window:: printImage()
 
 bool isMonochrome(QImage img)
 {
+    if (img.format()==QImage::Format_Mono) {
+        QRgb clr0 = img.color(0) & 0xffffff, clr1 = img.color(1) & 0xffffff;
+        return (clr0==0 and clr1==0xffffff) or (clr0==0xffffff and clr1==0);
+    }
+    if (img.format()==QImage::Format_Grayscale8) {
+        for (int y=0; y<img.height(); y++) {
+            const uchar *row = img.constScanLine(y);
+            for (int x=0; x<img.width(); x++) {
+                if (not (row[x]==0 or row[x]==255)) return false;
+            }
+        }
+        return true;
+    }
+    toRgbFormat(img);
     for (int y=0; y<img.height(); y++) {
         QRgb *row = (QRgb*) img.constScanLine(y);
         for (int x=0; x<img.width(); x++) {
@@ -632,8 +670,18 @@ Window:: exportToPdf()
     if (image.format()==QImage::Format_ARGB32) {
         image = setImageBackgroundColor(image, 0xffffff);
     }
-    if (isMonochrome(image))
+    // threshold filters already give Format_Mono image
+    if (isMonochrome(image)) {
         image = image.convertToFormat(QImage::Format_Mono);
+        // pdf image uses 0 = white, 1 = black
+        if ((image.color(0) & 0xffffff) == 0) {
+            image.invertPixels();
+            image.setColor(0, qRgb(255,255,255));
+            image.setColor(1, qRgb(0,0,0));
+        }
+    }
+    else if (image.format()!=QImage::Format_Grayscale8)
+        toRgbFormat(image);
 
     QFileInfo fi(data.filename);
     QString dir = fi.dir().path();
@@ -656,7 +704,8 @@ Window:: exportToPdf()
     // Embed image as whole JPEG image
     else {
         image.save(&buff, "JPG");
-        img = doc.addImage(buff.data().data(), buff.size(), image.width(), image.height(), PDF_IMG_JPEG);
+        PdfImageFormat format = image.format()==QImage::Format_Grayscale8 ? PDF_IMG_JPEG_GRAY : PDF_IMG_JPEG;
+        img = doc.addImage(buff.data().data(), buff.size(), image.width(), image.height(), format);
     }
     buff.close();
 
@@ -768,6 +817,7 @@ Window:: addBorder()
     bool ok;
     int width = QInputDialog::getInt(this, "Add Border", "Enter Border Width :", 2, 1, 100, 1, &ok);
     if (ok) {
+        toRgbFormat(data.image);
         QPainter painter(&(data.image));
         QPen pen(Qt::black);
         pen.setWidth(width);
@@ -784,6 +834,7 @@ Window:: expandImageBorder()
     ExpandBorderDialog *dlg = new ExpandBorderDialog(this, data.image.width()/5);
     if (dlg->exec() != QDialog::Accepted)
         return;
+    toRgbFormat(data.image);
     int w = dlg->widthSpin->value();
     int left_border = dlg->leftCheckBox->isChecked() ? w : 0;
     int right_border = dlg->rightCheckBox->isChecked() ? w : 0;
@@ -852,6 +903,7 @@ Window:: createPhotoCollage()
 void
 Window:: magicEraser()
 {
+    toRgbFormat(data.image);
     InpaintDialog *dialog = new InpaintDialog(data.image, this);
     dialog->resize(1020, data.max_window_h);
     if (dialog->exec()==QDialog::Accepted) {
@@ -863,6 +915,7 @@ Window:: magicEraser()
 void
 Window:: maskTool()
 {
+    toRgbFormat(data.image);
     IScissorDialog *dialog = new IScissorDialog(data.image, MASK_MODE, this);
     dialog->resize(1020, data.max_window_h);
     if (dialog->exec()==QDialog::Accepted) {
@@ -874,13 +927,14 @@ Window:: maskTool()
 void
 Window:: iScissor()
 {
+    toRgbFormat(data.image);
     IScissorDialog *dialog = new IScissorDialog(data.image, ERASER_MODE, this);
     dialog->resize(1020, data.max_window_h);
     if (dialog->exec()==QDialog::Accepted) {
         data.image = dialog->image;
         canvas->showScaled();
         // add background color
-        QImage img = canvas->pixmap()->toImage();
+        QImage img = canvas->scaledImage();
         BgColorDialog *dlg = new BgColorDialog(canvas, img, 1.0);
         dlg->selectColorName("Transparent");
         if (dlg->exec()==QDialog::Accepted) {
@@ -922,7 +976,7 @@ Window:: removeMaskWidget()
 void
 Window:: lensDistort()
 {
-    QImage img = canvas->pixmap()->toImage();
+    QImage img = canvas->scaledImage();
     LensDialog *dlg = new LensDialog(canvas, img, 1.0);
     if (dlg->exec()==QDialog::Accepted) {
         data.image = dlg->getResult(data.image);
@@ -942,7 +996,7 @@ Window:: toGrayScale()
 void
 Window:: adjustColorLevels()
 {
-    QImage img = canvas->pixmap()->toImage();
+    QImage img = canvas->scaledImage();
     LevelsDialog *dlg = new LevelsDialog(canvas, img, 1.0);
     if (dlg->exec()==QDialog::Accepted) {
         data.image = dlg->getResult(data.image);
@@ -955,7 +1009,7 @@ Window:: adjustColorLevels()
 void
 Window:: applyThreshold()
 {
-    QImage img = canvas->pixmap()->toImage();
+    QImage img = canvas->scaledImage();
     ThresholdDialog *dlg = new ThresholdDialog(canvas, img, 1.0);
     if (dlg->exec()==QDialog::Accepted) {
         data.image = dlg->getResult(data.image);
@@ -972,13 +1026,39 @@ Window:: adaptiveThresh()
     canvas->updateImage();
 }
 
+// removes black specks (dust) smaller than the disc from black & white page
+void
+Window:: cleanScannedPage()
+{
+    bool ok;
+    int radius = QInputDialog::getInt(this, "Clean Page", "Enter Speck Radius :",
+                                        1/*val*/, 1/*min*/, 50/*max*/, 1/*step*/, &ok);
+    if (not ok) return;
+    morphologicalClose(data.image, radius, MORPH_DISC);
+    canvas->updateImage();
+}
+
+// reduce to few gray levels using thresholds calculated by multi-level otsu method
+void
+Window:: multiLevelThreshold()
+{
+    bool ok;
+    int levels = QInputDialog::getInt(this, "Multi Level Threshold", "Enter No. of Gray Levels :",
+                                        3/*val*/, 2/*min*/, MULTI_OTSU_MAX_CLASSES/*max*/, 1/*step*/, &ok);
+    if (not ok) return;
+    int thresh[MULTI_OTSU_MAX_CLASSES-1];
+    calcMultiOtsuThresh(data.image, levels, thresh);
+    multiThreshold(data.image, thresh, levels-1);
+    canvas->updateImage();
+}
+
 void
 Window:: blur()
 {
     bool ok;
     int radius = max(max(data.image.width(), data.image.height())/160, 3);
     radius = QInputDialog::getInt(this, "Gaussian Blur", "Enter Blur Radius :",
-                                        radius/*val*/, 1/*min*/, 30/*max*/, 1/*step*/, &ok);
+                                        radius/*val*/, 1/*min*/, 500/*max*/, 1/*step*/, &ok);
     if (not ok) return;
     gaussianBlur(data.image, radius);
     //boxFilter(data.image, radius);
@@ -988,8 +1068,16 @@ Window:: blur()
 void
 Window:: sharpenImage()
 {
-    unsharpMask(data.image);
-    canvas->updateImage();
+    QImage img = canvas->scaledImage();
+    SharpenDialog *dlg = new SharpenDialog(canvas, img, 1.0);
+    dlg->radius_scale = canvas->scale;
+    if (dlg->exec()==QDialog::Accepted) {
+        dlg->radius_scale = 1.0;
+        data.image = dlg->getResult(data.image);
+        canvas->updateImage();
+        return;
+    }
+    canvas->showScaled();
 }
 
 void
@@ -1006,6 +1094,20 @@ Window:: removeDust()
     canvas->updateImage();
 }
 
+void
+Window:: reduceNoise()
+{
+    bool ok;
+    int level = QInputDialog::getInt(this, "Reduce Noise", "Enter Noise Level :",
+                                        8/*val*/, 1/*min*/, 50/*max*/, 1/*step*/, &ok);
+    if (not ok) return;
+    // details with contrast lower than twice the noise level are smoothed
+    float sigma = 2*level/255.0;
+    int radius = max(max(data.image.width(), data.image.height())/1500, 2);
+    guidedFilter(data.image, radius, sigma*sigma);
+    canvas->updateImage();
+}
+
 void
 Window:: sigmoidContrast()
 {
@@ -1023,7 +1125,7 @@ Window:: stretchImageContrast()
 void
 Window:: adjustContrastLevel()
 {
-    QImage img = canvas->pixmap()->toImage();
+    QImage img = canvas->scaledImage();
     ContrastDialog *dlg = new ContrastDialog(canvas, img, 1.0);
     if (dlg->exec()==QDialog::Accepted) {
         data.image = dlg->getResult(data.image);
@@ -1036,7 +1138,7 @@ Window:: adjustContrastLevel()
 void
 Window:: adjustGamma()
 {
-    QImage img = canvas->pixmap()->toImage();
+    QImage img = canvas->scaledImage();
     GammaDialog *dlg = new GammaDialog(canvas, img, 1.0);
     if (dlg->exec()==QDialog::Accepted) {
         data.image = dlg->getResult(data.image);
@@ -1067,6 +1169,13 @@ Window:: enhanceColors()
     canvas->updateImage();
 }
 
+void
+Window:: autoEnhanceFilter()
+{
+    autoEnhance(data.image);
+    canvas->updateImage();
+}
+
 void
 Window:: vignetteFilter()
 {
@@ -1084,7 +1193,7 @@ Window:: pencilSketchFilter()
 void
 Window:: addBackgroundColor()
 {
-    QImage img = canvas->pixmap()->toImage();
+    QImage img = canvas->scaledImage();
     BgColorDialog *dlg = new BgColorDialog(canvas, img, 1.0);
     if (dlg->exec()==QDialog::Accepted) {
         data.image = dlg->getResult(data.image);
@@ -1136,8 +1245,8 @@ Window:: zoomInImage()
     else
         canvas->scale *= (6.0/5);
     canvas->showScaled();
-    if ((canvas->pixmap()->width()>scrollArea->width() or
-            canvas->pixmap()->height()>scrollArea->height()) && not this->isMaximized())
+    if ((canvas->width()>scrollArea->width() or
+            canvas->height()>scrollArea->height()) && not this->isMaximized())
         this->showMaximized();
     waitFor(30);
     vertical->setValue(vertical->maximum()*relPosV);
@@ -1174,8 +1283,8 @@ Window:: origSizeImage()
     canvas->scale = 1.0;
     canvas->showScaled();
     origSizeBtn->setIcon(QIcon(":/icons/fit-to-screen.png"));
-    if ((canvas->pixmap()->width()>scrollArea->width() or
-            canvas->pixmap()->height()>scrollArea->height()) && not this->isMaximized())
+    if ((canvas->width()>scrollArea->width() or
+            canvas->height()>scrollArea->height()) && not this->isMaximized())
         this->showMaximized();
 }
 
@@ -1194,7 +1303,7 @@ Window:: rotateRight()
 void
 Window:: rotateAny()
 {
-    QImage img = canvas->pixmap()->toImage();
+    QImage img = canvas->scaledImage();
     RotateDialog *dlg = new RotateDialog(canvas, img, 1.0);
     if (dlg->exec()==QDialog::Accepted) {
         data.image = dlg->getResult(data.image);
@@ -1324,8 +1433,8 @@ Window:: adjustWindowSize(bool animation)
                canvas->height() + statusbar_h + 4);
     }
     else {
-        resize(canvas->pixmap()->width() + btnboxes_w + 4,
-               canvas->pixmap()->height() + statusbar_h + 15);
+        resize(canvas->width() + btnboxes_w + 4,
+               canvas->height() + statusbar_h + 15);
     }
     move((screen_width - (width() + windowdecor_w) )/2,
         (screen_height - (height() + windowdecor_h))/2 );
@@ -1417,6 +1526,7 @@ Window:: closeEvent(QCloseEvent *ev)
     settings.setValue("StatusBarHeight", height() - scrollArea->height());
     settings.setValue("WindowDecorWidth", frameGeometry().width() - width());
     settings.setValue("WindowDecorHeight", frameGeometry().height() - height());
+    settings.setValue("UndoMemoryLimit", undo_memory_limit);
     QMainWindow::closeEvent(ev);
 }
 
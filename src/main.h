@@ -20,6 +20,7 @@ public:
     ImageData data;
     int screen_width, screen_height;
     int btnboxes_w, statusbar_h, windowdecor_w, windowdecor_h;
+    int undo_memory_limit;// in MB
     QTimer *timer;      // Slideshow timer
     QMap<QString, QMenu*> menu_dict;
     QAction *overwrite_action, *savecopy_action, *bgcolor_action;
@@ -67,9 +68,12 @@ public slots:
     void grayWorldFilter();
     void whiteBalance();
     void enhanceColors();
+    void autoEnhanceFilter();
     // threshold filters
     void applyThreshold();
     void adaptiveThresh();
+    void cleanScannedPage();
+    void multiLevelThreshold();
     // brightness filters
     void adjustGamma();
     void stretchImageContrast();
@@ -78,6 +82,7 @@ public slots:
     // denoise filters
     void reduceSpeckleNoise();
     void removeDust();
+    void reduceNoise();
     // other filters
     void blur();
     void sharpenImage();
@@ -102,6 +107,7 @@ public slots:
     void playPause();
     // others
     void loadPlugins();
+    void prepareImageForPlugin();
     void resizeToOptimum();
     void showNotification(QString title, QString message);
     void onEditingFinished();
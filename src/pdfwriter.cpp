@@ -53,8 +53,8 @@ PdfDocument:: addImage(const char *buff, int size, int w, int h, PdfImageFormat
     img->add("/Subtype", "/Image");
     img->add("/Width", format("%d", w));
     img->add("/Height", format("%d", h));
-    if (img_format==PDF_IMG_JPEG){
-        img->add("/ColorSpace", "/DeviceRGB");
+    if (img_format==PDF_IMG_JPEG or img_format==PDF_IMG_JPEG_GRAY){
+        img->add("/ColorSpace", img_format==PDF_IMG_JPEG ? "/DeviceRGB" : "/DeviceGray");
         img->add("/BitsPerComponent", "8");
         img->add("/Filter", "/DCTDecode"); // jpg = DCTDecode
         img->stream = std::string(buff, size);
@@ -14,6 +14,7 @@ doc.save(filename);
 
 typedef enum {
     PDF_IMG_JPEG,
+    PDF_IMG_JPEG_GRAY,// single channel jpeg
     PDF_IMG_PNG
 } PdfImageFormat;
 
@@ -521,8 +521,12 @@ CollagePaper:: savePdf()
         if (image.format()==QImage::Format_ARGB32) {
             image = setImageBackgroundColor(image, 0xffffff);
         }
+        // grayscale image is embedded as single channel jpeg
+        if (image.format()==QImage::Format_Mono)
+            image = image.convertToFormat(QImage::Format_Grayscale8);
         image.save(&buff, "JPG");
-        img = doc.addImage(buff.data().data(), buff.size(), image.width(), image.height(), PDF_IMG_JPEG);
+        PdfImageFormat format = image.format()==QImage::Format_Grayscale8 ? PDF_IMG_JPEG_GRAY : PDF_IMG_JPEG;
+        img = doc.addImage(buff.data().data(), buff.size(), image.width(), image.height(), format);
         buff.close();
         page->drawImage(img, item->x*scaleX, out_h - item->y*scaleY - item->h*scaleY, // img Y to pdf Y
                              item->w*scaleX, item->h*scaleY, item->rotation);
@@ -187,6 +187,7 @@ Thumbnail:: setSelected(bool select)
 {
     QImage img = photo.scaledToWidth(100);
     if (select) {
+        toRgbFormat(img);// can not paint on grayscale image
         QPainter painter(&img);
         QPen pen(Qt::blue);
         pen.setWidth(4);
@@ -404,9 +405,13 @@ GridView:: savePdf()
             if (image.format()==QImage::Format_ARGB32) {
                 image = setImageBackgroundColor(image, 0xffffff);
             }
+            // grayscale image is embedded as single channel jpeg
+            if (image.format()==QImage::Format_Mono)
+                image = image.convertToFormat(QImage::Format_Grayscale8);
             image.save(&buff, "JPG");
+            PdfImageFormat format = image.format()==QImage::Format_Grayscale8 ? PDF_IMG_JPEG_GRAY : PDF_IMG_JPEG;
             pdf_img_map[cell.photo] = doc.addImage(buff.data().data(), buff.size(),
-                                    image.width(), image.height(), PDF_IMG_JPEG);
+                                    image.width(), image.height(), format);
             buff.close();
         }
         PdfObject *img_obj = pdf_img_map[cell.photo];
@@ -0,0 +1,308 @@
+// this file is part of photoquick program which is GPLv3 licensed
+#include "planar.h"
+#include "common.h"
+#include <cstring>
+#include <cmath>
+
+// width of column strips processed by each thread in vertical pass
+#define PLANAR_STRIP 256
+
+PlanarImage:: PlanarImage(const QImage &img)
+{
+    width = img.width();
+    height = img.height();
+    plane_size = (size_t)width*height;
+    alpha = img.hasAlphaChannel();
+    data = (float*) malloc(4*plane_size*sizeof(float));
+    if (data==NULL) {
+        width = height = 0;
+        plane_size = 0;
+        return;
+    }
+    QImage src = img;// shallow copy, converted only if required
+    toRgbFormat(src);
+    ImageView view = constView(src);
+    float *r = plane(PLANE_R), *g = plane(PLANE_G), *b = plane(PLANE_B), *a = plane(PLANE_A);
+    #pragma omp parallel for
+    for (int y=0; y<height; y++)
+    {
+        QRgb *row = view.row(y);
+        int i = y*width;
+        for (int x=0; x<width; x++) {
+            r[i+x] = qRed(row[x]);
+            g[i+x] = qGreen(row[x]);
+            b[i+x] = qBlue(row[x]);
+            a[i+x] = qAlpha(row[x]);
+        }
+    }
+}
+
+PlanarImage:: ~PlanarImage()
+{
+    free(data);
+}
+
+static inline int round_to_byte(float val)
+{
+    return clamp(val, 0.0f, 255.0f) + 0.5f;
+}
+
+QImage
+PlanarImage:: toImage() const
+{
+    if (isNull())
+        return QImage();
+    QImage img(width, height, alpha ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+    ImageView view(img);
+    const float *r = plane(PLANE_R), *g = plane(PLANE_G), *b = plane(PLANE_B), *a = plane(PLANE_A);
+    #pragma omp parallel for
+    for (int y=0; y<height; y++)
+    {
+        QRgb *row = view.row(y);
+        int i = y*width;
+        if (not alpha) {
+            for (int x=0; x<width; x++)
+                row[x] = qRgb(round_to_byte(r[i+x]), round_to_byte(g[i+x]), round_to_byte(b[i+x]));
+            continue;
+        }
+        for (int x=0; x<width; x++) {
+            row[x] = qRgba(round_to_byte(r[i+x]), round_to_byte(g[i+x]),
+                           round_to_byte(b[i+x]), round_to_byte(a[i+x]));
+        }
+    }
+    return img;
+}
+
+// v = a*v + b for all values of a plane
+static void scale_plane(float *plane, size_t len, float a, float b)
+{
+    #pragma omp parallel for
+    for (size_t i=0; i<len; i++)
+        plane[i] = a*plane[i] + b;
+}
+
+static void fill_plane(float *plane, size_t len, float val)
+{
+    #pragma omp parallel for
+    for (size_t i=0; i<len; i++)
+        plane[i] = val;
+}
+
+void grayWorld(PlanarImage &img)
+{
+    size_t len = (size_t)img.width*img.height;
+    double sums[3] = {};
+    for (int c=PLANE_R; c<=PLANE_B; c++) {
+        const float *plane = img.plane(c);
+        double sum = 0;
+        #pragma omp parallel for reduction(+:sum)
+        for (size_t i=0; i<len; i++)
+            sum += plane[i];
+        sums[c] = sum;
+    }
+    double mean_rgb = (sums[0] + sums[1] + sums[2])/3;
+    for (int c=PLANE_R; c<=PLANE_B; c++) {
+        if (sums[c] > 0)
+            scale_plane(img.plane(c), len, mean_rgb/sums[c], 0);
+        else
+            scale_plane(img.plane(c), len, 1, mean_rgb/len);
+    }
+}
+
+void levelImage(PlanarImage &img, float black_pt, float white_pt)
+{
+    size_t len = (size_t)img.width*img.height;
+    black_pt *= 255;
+    white_pt *= 255;
+    for (int c=PLANE_R; c<=PLANE_B; c++) {
+        float *plane = img.plane(c);
+        if (white_pt==black_pt) {
+            #pragma omp parallel for
+            for (size_t i=0; i<len; i++)
+                plane[i] = plane[i] > black_pt ? 255 : 0;
+            continue;
+        }
+        scale_plane(plane, len, 255/(white_pt-black_pt), -255*black_pt/(white_pt-black_pt));
+    }
+    // levelImage() makes the image opaque
+    fill_plane(img.plane(PLANE_A), len, 255);
+}
+
+// blur a plane with clamped border by box filter, or by kernel of 2r+1 taps if
+// it is not NULL. result is written to dst
+static void blur_plane(const float *src, float *dst, int w, int h, int r, const float *kernel)
+{
+    int kernel_w = 2*r + 1;
+    float norm = 1.0f/kernel_w;
+    #pragma omp parallel
+    {
+        float *buf = (float*) malloc((w+2*r)*sizeof(float));
+        #pragma omp for
+        for (int y=0; y<h; y++)
+        {
+            const float *row = src + y*w;
+            float *out = dst + y*w;
+            for (int x=-r; x<w+r; x++)
+                buf[x+r] = row[clamp(x, 0, w-1)];
+            if (kernel) {
+                for (int x=0; x<w; x++) {
+                    float sum = 0;
+                    for (int i=0; i<kernel_w; i++)
+                        sum += kernel[i]*buf[x+i];
+                    out[x] = sum;
+                }
+                continue;
+            }
+            double sum = 0;
+            for (int i=0; i<kernel_w; i++)
+                sum += buf[i];
+            out[0] = sum*norm;
+            for (int x=1; x<w; x++) {
+                sum += buf[x+2*r] - buf[x-1];
+                out[x] = sum*norm;
+            }
+        }
+        free(buf);
+    }
+    // vertical pass in place. rows above y are already overwritten when row y
+    // is written, so last r+1 original rows of the strip are kept in a ring
+    int strip_count = (w + PLANAR_STRIP - 1)/PLANAR_STRIP;
+    #pragma omp parallel
+    {
+        int ring_n = r+1;
+        float *ring = (float*) malloc(ring_n*PLANAR_STRIP*sizeof(float));
+        #pragma omp for
+        for (int strip=0; strip<strip_count; strip++)
+        {
+            int x0 = strip*PLANAR_STRIP;
+            int strip_w = MIN(PLANAR_STRIP, w-x0);
+            double sums[PLANAR_STRIP] = {};
+            float *col = dst + x0;
+            if (not kernel) {
+                for (int y=-r; y<=r; y++) {
+                    const float *row = col + clamp(y, 0, h-1)*w;
+                    for (int x=0; x<strip_w; x++)
+                        sums[x] += row[x];
+                }
+            }
+            for (int y=0; y<h; y++)
+            {
+                float *row = col + y*w;
+                if (not kernel and y > 0) {
+                    const float *add = col + MIN(y+r, h-1)*w;
+                    const float *sub = ring + (MAX(y-r-1, 0) % ring_n)*PLANAR_STRIP;
+                    for (int x=0; x<strip_w; x++)
+                        sums[x] += add[x] - sub[x];
+                }
+                memcpy(ring + (y % ring_n)*PLANAR_STRIP, row, strip_w*sizeof(float));
+                if (not kernel) {
+                    for (int x=0; x<strip_w; x++)
+                        row[x] = sums[x]*norm;
+                    continue;
+                }
+                float out[PLANAR_STRIP] = {};
+                for (int i=0; i<kernel_w; i++) {
+                    int j = y+i-r;
+                    const float *tap = j <= y ? ring + (MAX(j, 0) % ring_n)*PLANAR_STRIP
+                                              : col + MIN(j, h-1)*w;
+                    for (int x=0; x<strip_w; x++)
+                        out[x] += kernel[i]*tap[x];
+                }
+                memcpy(row, out, strip_w*sizeof(float));
+            }
+        }
+        free(ring);
+    }
+}
+
+void unsharpMask(PlanarImage &img, float factor, int thresh, int radius, bool gaussian)
+{
+    int w = img.width;
+    int h = img.height;
+    size_t len = (size_t)w*h;
+    int r = MAX(radius, 1);
+    int kernel_w = 2*r + 1;
+    float kernel[kernel_w];
+    if (gaussian) {
+        float sigma = r/2.0;
+        float sum = 0;
+        for (int i=0; i<kernel_w; i++) {
+            kernel[i] = exp(-((i-r)*(i-r))/(2.0*sigma*sigma));
+            sum += kernel[i];
+        }
+        for (int i=0; i<kernel_w; i++)
+            kernel[i] /= sum;
+    }
+    float *mask = (float*) malloc(len*sizeof(float));
+    if (mask==NULL)
+        return;
+    for (int c=PLANE_R; c<=PLANE_B; c++)
+    {
+        float *plane = img.plane(c);
+        blur_plane(plane, mask, w, h, r, gaussian ? kernel : NULL);
+        #pragma omp parallel for
+        for (size_t i=0; i<len; i++) {
+            float diff = plane[i] - mask[i];
+            plane[i] += diff > thresh ? factor*diff : 0;
+        }
+    }
+    free(mask);
+}
+
+// values of given percentiles of all color planes together, in 0-255 range
+static void color_percentiles(PlanarImage &img, float perc_low, float perc_high,
+                              int &low, int &high)
+{
+    size_t len = (size_t)img.width*img.height;
+    unsigned int histogram[256] = {};
+    for (int c=PLANE_R; c<=PLANE_B; c++) {
+        const float *plane = img.plane(c);
+        #pragma omp parallel
+        {
+            unsigned int local[256] = {};
+            #pragma omp for nowait
+            for (size_t i=0; i<len; i++)
+                ++local[round_to_byte(plane[i])];
+            #pragma omp critical
+            {
+                for (int k=0; k<256; k++)
+                    histogram[k] += local[k];
+            }
+        }
+    }
+    size_t total = 3*len;
+    size_t count = 0;
+    low = high = -1;
+    for (int k=0; k<256; k++) {
+        count += histogram[k];
+        if (low<0 and count > total*perc_low/100)
+            low = k;
+        if (high<0 and count >= total*perc_high/100)
+            high = k;
+    }
+    if (low<0) low = 255;
+    if (high<0) high = 255;
+}
+
+void autoEnhance(QImage &img)
+{
+    PlanarImage planar(img);
+    if (planar.isNull())
+        return;
+    grayWorld(planar);
+    int black, white;
+    color_percentiles(planar, 0.5, 99.5, black, white);
+    if (white > black) {// a flat image is left as is
+        // levelImage() makes the image opaque, but transparency is kept here
+        size_t len = (size_t)planar.width*planar.height*sizeof(float);
+        float *alpha = img.hasAlphaChannel() ? (float*) malloc(len) : NULL;
+        if (alpha)
+            memcpy(alpha, planar.plane(PLANE_A), len);
+        levelImage(planar, black/255.0, white/255.0);
+        if (alpha)
+            memcpy(planar.plane(PLANE_A), alpha, len);
+        free(alpha);
+    }
+    unsharpMask(planar);
+    img = planar.toImage();
+}
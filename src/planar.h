@@ -0,0 +1,48 @@
+#pragma once
+/* Planar float image for chains of filters. Each channel is stored in its own
+  plane of floats in 0-255 range. So filters can be applied one after another
+  without packing to 8 bit ARGB32 and unpacking again, and without losing
+  precision in between. Values are clamped only when packed to QImage.
+  e.g  PlanarImage planar(img);
+       if (planar.isNull()) return;// not enough memory
+       grayWorld(planar);
+       levelImage(planar, 0.05, 0.95);
+       unsharpMask(planar);
+       img = planar.toImage();
+*/
+#include <QImage>
+
+enum { PLANE_R, PLANE_G, PLANE_B, PLANE_A };
+
+class PlanarImage
+{
+public:
+    PlanarImage(const QImage &img);
+    ~PlanarImage();
+    // true if memory for planes could not be allocated
+    bool isNull() const { return data==NULL; }
+    // pack to ARGB32 if source image had alpha, otherwise RGB32 (like toRgbFormat()).
+    // values are rounded and clamped to 0-255. returns null image if isNull()
+    QImage toImage() const;
+    float* plane(int c) const { return data + c*plane_size; }
+    int width;
+    int height;
+private:
+    PlanarImage(const PlanarImage&);// not copyable
+    PlanarImage& operator=(const PlanarImage&);
+    float *data;
+    size_t plane_size;
+    bool alpha;
+};
+
+// These work like the QImage versions in filters.h. Alpha is kept unchanged
+// except where the QImage version makes the image opaque.
+void grayWorld(PlanarImage &img);
+// black_pt and white_pt are in 0-1.0 range, like PointOps::level().
+// if they are equal, values above black_pt become 255 and others 0
+void levelImage(PlanarImage &img, float black_pt, float white_pt);
+void unsharpMask(PlanarImage &img, float factor=1.0, int thresh=5, int radius=1, bool gaussian=false);
+
+// color balance, stretch levels of all channels together, and sharpen,
+// using planar image so that it is quantized only once. alpha is kept
+void autoEnhance(QImage &img);
@@ -0,0 +1,177 @@
+// this file is part of photoquick program which is GPLv3 licensed
+#include "pyramid.h"
+#include "common.h"
+#include <cstring>
+
+// rows of level 1 built from each piece of the image
+#define PYRAMID_STRIP 32
+
+// green tone over masked pixel, same as qRgb(0.5*red, 127+0.5*green, 0.5*blue)
+static inline QRgb mask_tint(QRgb clr)
+{
+    return 0xff000000 | ((clr>>1) & 0x7f007f) | (127 + ((clr>>9) & 0x7f)) << 8;
+}
+
+QImage displayPiece(const QImage &img, const QImage &mask, QRect rect)
+{
+    bool alpha = img.hasAlphaChannel();
+    if (mask.isNull())
+        return img.copy(rect).convertToFormat(alpha ? QImage::Format_ARGB32_Premultiplied
+                                                    : QImage::Format_RGB32);
+    QImage piece = img.copy(rect).convertToFormat(alpha ? QImage::Format_ARGB32
+                                                        : QImage::Format_RGB32);
+    ImageView view(piece);
+    ImageView maskView = constView(mask);
+    int x1 = rect.x(), x2 = rect.x() + rect.width();
+    #pragma omp parallel for
+    for (int y=0; y<rect.height(); y++) {
+        QRgb *row = view.row<QRgb>(y);
+        const uchar *maskRow = maskView.row<uchar>(rect.y()+y);
+        int x = x1;
+        while (x < x2) {
+            // whole runs of 64 pixels which are all masked or all unmasked
+            if ((x & 63)==0 and x+64 <= x2) {
+                quint64 word;
+                memcpy(&word, maskRow + x/8, 8);
+                if (word == 0) {
+                    x += 64;
+                    continue;
+                }
+                if (word == ~0ULL) {
+                    QRgb *run = row + x - x1;
+                    #pragma omp simd
+                    for (int i=0; i<64; i++)
+                        run[i] = mask_tint(run[i]);
+                    x += 64;
+                    continue;
+                }
+            }
+            if ((maskRow[x>>3] >> (x&7)) & 1)
+                row[x-x1] = mask_tint(row[x-x1]);
+            x++;
+        }
+    }
+    if (alpha)
+        piece = piece.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    return piece;
+}
+
+// rounded average of 4 pixels, two channels at a time
+static inline QRgb average4(QRgb p1, QRgb p2, QRgb p3, QRgb p4)
+{
+    uint rb = (p1 & 0xff00ff) + (p2 & 0xff00ff) + (p3 & 0xff00ff) + (p4 & 0xff00ff);
+    uint ag = ((p1>>8) & 0xff00ff) + ((p2>>8) & 0xff00ff) + ((p3>>8) & 0xff00ff)
+                + ((p4>>8) & 0xff00ff);
+    rb = ((rb + 0x20002) >> 2) & 0xff00ff;
+    ag = ((ag + 0x20002) >> 2) & 0xff00ff;
+    return rb | ag<<8;
+}
+
+// fills a row of dst from 2x2 pixels of src. pixel x of src is at row[x-ox],
+// and src_w is width of source level. last pixel is repeated if width is odd
+static void halve_row(const QRgb *row1, const QRgb *row2, int ox, int src_w,
+                        QRgb *dst, int x1, int x2)
+{
+    for (int x=x1; x<=x2; x++) {
+        int sx1 = 2*x - ox;
+        int sx2 = MIN(2*x+1, src_w-1) - ox;
+        dst[x] = average4(row1[sx1], row1[sx2], row2[sx1], row2[sx2]);
+    }
+}
+
+static QSize level_size(QSize size, int n)
+{
+    return QSize((size.width() + (1<<n) - 1) >> n, (size.height() + (1<<n) - 1) >> n);
+}
+
+ImagePyramid:: ImagePyramid() : image_key(0), mask_key(0)
+{
+}
+
+void
+ImagePyramid:: clear()
+{
+    levels.clear();
+    dirty.clear();
+    image_key = mask_key = 0;
+}
+
+void
+ImagePyramid:: invalidate(const QImage &img, QRect rect)
+{
+    for (QRect &area : dirty)
+        area |= rect;
+    image_key = img.cacheKey();
+}
+
+QImage
+ImagePyramid:: level(const QImage &img, const QImage &mask, int n)
+{
+    QImage::Format format = img.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied
+                                                  : QImage::Format_RGB32;
+    if (img.cacheKey() != image_key or mask.cacheKey() != mask_key or
+        (not levels.empty() and (levels[0].size() != level_size(img.size(), 1) or
+                                levels[0].format() != format)))
+    {
+        levels.clear();
+        dirty.clear();
+        image_key = img.cacheKey();
+        mask_key = mask.cacheKey();
+    }
+    while ((int)levels.size() < n) {
+        levels.push_back(QImage(level_size(img.size(), levels.size()+1), format));
+        dirty.push_back(img.rect());
+    }
+    for (int i=1; i<=n; i++)
+    {
+        QRect area = dirty[i-1];
+        if (area.isEmpty())
+            continue;
+        dirty[i-1] = QRect();
+        // each pixel of level i covers 2^i x 2^i pixels of image
+        int x1 = area.left() >> i, x2 = area.right() >> i;
+        int y1 = area.top() >> i, y2 = area.bottom() >> i;
+        ImageView dst(levels[i-1]);
+        if (i==1) {
+            int strips = (y2 - y1 + PYRAMID_STRIP)/PYRAMID_STRIP;
+            #pragma omp parallel for schedule(dynamic)
+            for (int strip=0; strip<strips; strip++) {
+                int sy1 = y1 + strip*PYRAMID_STRIP;
+                int sy2 = MIN(y2, sy1 + PYRAMID_STRIP - 1);
+                QRect src_rect(2*x1, 2*sy1, 2*(x2-x1+1), 2*(sy2-sy1+1));
+                src_rect = src_rect.intersected(img.rect());
+                QImage piece = displayPiece(img, mask, src_rect);
+                ImageView src = constView(piece);
+                for (int y=sy1; y<=sy2; y++) {
+                    int row1 = 2*y - src_rect.y();
+                    int row2 = MIN(2*y+1, img.height()-1) - src_rect.y();
+                    halve_row(src.row<QRgb>(row1), src.row<QRgb>(row2), src_rect.x(),
+                                img.width(), dst.row<QRgb>(y), x1, x2);
+                }
+            }
+            continue;
+        }
+        ImageView src = constView(levels[i-2]);
+        #pragma omp parallel for
+        for (int y=y1; y<=y2; y++) {
+            int row2 = MIN(2*y+1, src.height-1);
+            halve_row(src.row<QRgb>(2*y), src.row<QRgb>(row2), 0, src.width,
+                        dst.row<QRgb>(y), x1, x2);
+        }
+    }
+    return levels[n-1];
+}
+
+int
+ImagePyramid:: levelFor(QSize img_size, QSize size)
+{
+    int n = 0;
+    while (n < 30) {
+        QSize next = level_size(img_size, n+1);
+        if (next.width() < size.width() or next.height() < size.height()
+                or next == level_size(img_size, n))
+            break;
+        n++;
+    }
+    return n;
+}
@@ -0,0 +1,33 @@
+#pragma once
+/* Mipmap pyramid of the displayed image, used to draw zoomed out views.
+  Level n is the image (with mask overlay) downscaled by 2^n, where each pixel
+  is the average of 2x2 pixels of the level below. Levels are built only when
+  requested, and only the area changed since they were last built is updated.
+  Levels are 32 bit, and premultiplied if the image has alpha, so that they can
+  be averaged.
+*/
+#include <QImage>
+#include <vector>
+
+// 32 bit copy of rect of image, with a green tone over masked pixels.
+// mask is MonoLSB (1=masked) or null. result is premultiplied if img has alpha
+QImage displayPiece(const QImage &img, const QImage &mask, QRect rect);
+
+class ImagePyramid
+{
+public:
+    ImagePyramid();
+    void clear();
+    // marks rect of img as changed since levels were built from it
+    void invalidate(const QImage &img, QRect rect);
+    // level n (>=1) of img. levels are rebuilt if img or mask is not the one
+    // they were built from, otherwise only the changed area is updated
+    QImage level(const QImage &img, const QImage &mask, int n);
+    // highest level which is not smaller than size, 0 if it is the image itself
+    static int levelFor(QSize img_size, QSize size);
+private:
+    std::vector<QImage> levels;// levels[i] is level i+1
+    std::vector<QRect> dirty;// area of each level to be updated, in image pixels
+    qint64 image_key;// cacheKey() of image and mask the levels are built from
+    qint64 mask_key;
+};
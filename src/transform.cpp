@@ -27,7 +27,7 @@ Crop:: Crop(Canvas *canvas, QStatusBar *statusbar) : QObject(canvas),
 {
     mouse_pressed = false;
     canvas->drag_to_scroll = false;
-    pixmap = canvas->pixmap()->copy();
+    pixmap = QPixmap::fromImage(canvas->scaledImage());
     scaleX = float(pixmap.width())/canvas->data->image.width();
     scaleY = float(pixmap.height())/canvas->data->image.height();
     topleft = QPoint(0,0);
@@ -325,7 +325,7 @@ PerspectiveTransform(Canvas *canvas, QStatusBar *statusbar) : QObject(canvas),
 {
     mouse_pressed = false;
     canvas->drag_to_scroll = false;
-    pixmap = canvas->pixmap()->copy();
+    pixmap = QPixmap::fromImage(canvas->scaledImage());
     scaleX = float(pixmap.width())/canvas->data->image.width();
     scaleY = float(pixmap.height())/canvas->data->image.height();
     p1 = topleft = QPoint(0,0);